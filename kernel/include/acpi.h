@@ -84,10 +84,72 @@ typedef struct {
     uint8_t page_protection;
 } __attribute__((packed)) acpi_hpet_t;
 
+// SRAT (System Resource Affinity Table): CPUs and memory ranges tagged
+// with the proximity domain (NUMA node) they belong to.
+typedef struct {
+    acpi_sdt_header_t hdr;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    // followed by variable entries
+} __attribute__((packed)) acpi_srat_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_srat_entry_hdr_t;
+
+#define ACPI_SRAT_TYPE_LAPIC_AFFINITY   0
+#define ACPI_SRAT_TYPE_MEMORY_AFFINITY  1
+#define ACPI_SRAT_TYPE_X2APIC_AFFINITY  2
+
+#define ACPI_SRAT_ENABLED    (1u << 0)
+#define ACPI_SRAT_HOTPLUG    (1u << 1) // memory affinity only
+
+typedef struct {
+    acpi_srat_entry_hdr_t h;
+    uint8_t pxm_lo;        // proximity domain bits 0-7
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t pxm_hi[3];     // proximity domain bits 8-31
+    uint32_t clock_domain;
+} __attribute__((packed)) acpi_srat_lapic_t;
+
+typedef struct {
+    acpi_srat_entry_hdr_t h;
+    uint32_t pxm;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) acpi_srat_memory_t;
+
+typedef struct {
+    acpi_srat_entry_hdr_t h;
+    uint16_t reserved1;
+    uint32_t pxm;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_t;
+
+// SLIT (System Locality Information Table): a count x count matrix of
+// relative distances between proximity domains; 10 means local.
+typedef struct {
+    acpi_sdt_header_t hdr;
+    uint64_t locality_count;
+    uint8_t entries[];
+} __attribute__((packed)) acpi_slit_t;
+
 // Init and queries
 bool acpi_init(void);
 const acpi_madt_t* acpi_madt(void);
 const acpi_hpet_t* acpi_hpet(void);
+const acpi_srat_t* acpi_srat(void);  // NULL when absent
+const acpi_slit_t* acpi_slit(void);  // NULL when absent
 uint64_t acpi_lapic_phys(void);
 
 typedef struct {
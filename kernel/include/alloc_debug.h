@@ -4,9 +4,11 @@
 #include <stdint.h>
 #include <stdio.h>
 
-// Set ALLOC_DEBUG to 0 at compile time to disable poisoning/redzones.
+// Poisoning, redzones and magic checks on every slab and stelloc allocation.
+// Off by default; build with CPPFLAGS=-DALLOC_DEBUG=1 to enable them.
+// Release builds still sample allocations through kfence (see kfence.h).
 #ifndef ALLOC_DEBUG
-#define ALLOC_DEBUG 1
+#define ALLOC_DEBUG 0
 #endif
 
 #define ALLOC_POISON_ALLOC 0xAF
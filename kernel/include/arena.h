@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Region allocator for objects that die together. Allocation bumps a pointer
+// through a chunk and takes a new chunk when it runs out; nothing is freed
+// one object at a time. arena_reset() and arena_destroy() release every
+// chunk in one pass.
+//
+// An arena is not locked: one owner at a time, or the caller serialises.
+//
+// Chunks of one page come from palloc (HHDM addresses, no page-table
+// changes), larger ones from vmalloc. An allocation that does not fit a
+// chunk gets a vmalloc'd chunk of its own, except in page-chunk arenas
+// created with ARENA_ATOMIC, which never touch vmalloc.
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_ALIGN         16
+
+// Flags for arena_create()
+#define ARENA_ATOMIC 0x1 // page chunks only; usable with interrupts off
+
+typedef struct arena arena_t;
+
+// Position in an arena for arena_restore().
+typedef struct arena_mark {
+    void *chunk;
+    uintptr_t cur;
+} arena_mark_t;
+
+// Create an arena taking 'chunk_size' bytes (rounded up to pages, 0 for
+// ARENA_DEFAULT_CHUNK) at a time. The arena header lives in the first chunk.
+arena_t *arena_create(size_t chunk_size, uint32_t flags);
+
+// ARENA_ALIGN-aligned memory, or NULL when out of memory.
+void *arena_alloc(arena_t *a, size_t size);
+// 'align' is a power of two no larger than a page.
+void *arena_alloc_aligned(arena_t *a, size_t size, size_t align);
+
+// Drop every allocation; the first chunk is kept for reuse.
+void arena_reset(arena_t *a);
+void arena_destroy(arena_t *a);
+
+// Drop every allocation made since arena_save().
+arena_mark_t arena_save(arena_t *a);
+void arena_restore(arena_t *a, arena_mark_t mark);
+
+// Bytes handed out and bytes held in chunks.
+size_t arena_used(const arena_t *a);
+size_t arena_footprint(const arena_t *a);
+
+// Per-CPU scratch arena for short, non-sleeping work:
+//
+//     arena_scratch_t s;
+//     arena_t *a = arena_scratch_begin(&s);
+//     ... arena_alloc(a, n) ...
+//     arena_scratch_end(&s);
+//
+// Interrupts stay off between begin and end so the task cannot migrate;
+// scratch regions nest. Scratch arenas are ARENA_ATOMIC, so one allocation
+// is limited to a page minus the chunk header. Returns NULL when the
+// arena cannot be created; arena_scratch_end() must still be called.
+typedef struct arena_scratch {
+    arena_t *arena;
+    arena_mark_t mark;
+    uint64_t irq;
+} arena_scratch_t;
+
+arena_t *arena_scratch_begin(arena_scratch_t *s);
+void arena_scratch_end(arena_scratch_t *s);
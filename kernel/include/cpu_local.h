@@ -5,12 +5,14 @@
 #include <stdbool.h>
 
 typedef struct cpu_local {
+    struct cpu_local *self; // Must stay first: cpu_local_get() reads %fs:0
     uint32_t cpu_index;    // 0-based logical CPU index (BSP=0)
     uint32_t lapic_id;     // APIC ID from firmware/MP table
     void    *tss_base;     // Optional: per-CPU TSS base (if assigned)
     void    *current_task; // Scheduler-owned pointer to current task on this CPU
     void    *idle_task;    // Scheduler-owned pointer to idle task on this CPU
     uint64_t tick_count;   // Per-CPU timer ticks
+    uint32_t numa_node;    // NUMA node from the SRAT (0 without one)
     bool     online;       // Set true once CPU is fully up
 } cpu_local_t;
 
@@ -19,3 +21,17 @@ void cpu_local_set(cpu_local_t* ptr);
 
 // Retrieve the current CPU's local data pointer (may be NULL early).
 cpu_local_t* cpu_local_get(void);
+
+// Disable interrupts and return the previous RFLAGS for cpu_irq_restore().
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & (1ULL << 9)) __asm__ __volatile__("sti" ::: "memory");
+}
+
+// Index of the executing CPU; 0 (the BSP) until per-CPU data is installed.
+uint32_t cpu_local_index(void);
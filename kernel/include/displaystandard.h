@@ -6,4 +6,15 @@
 void displaystandard_init(struct fb *fb);
 void displaystandard_putc(char c);
 
+// Physical address and size (pitch * height) of the console framebuffer.
+bool displaystandard_fb_region(uint64_t *phys, size_t *size);
+// Redraw through a write-combining mapping instead of the bootloader's.
+// Needs the page allocator; returns false and keeps the old mapping on failure.
+bool displaystandard_map_wc(void);
+// Point the console at another mapping of the same framebuffer; returns the
+// previous base.
+void *displaystandard_set_mapping(void *base);
+// Repaint the whole screen from the console's character grid.
+void displaystandard_redraw(void);
+
 #endif /* DISPLAYSTANDARD_H */
\ No newline at end of file
@@ -10,6 +10,11 @@
 #define GDT_SELECTOR_USER_CS   (0x20 | 0x3)
 #define GDT_SELECTOR_TSS       0x28
 
+// Interrupt stack table slots. #PF gets its own per-CPU stack so faults on
+// demand-paged kernel stacks can be serviced.
+#define GDT_IST_PAGE_FAULT  1
+#define GDT_IST_STACK_SIZE  0x4000
+
 // Initialize and load a 64-bit GDT/TSS for the given CPU index.
 // cpu_index should be a small, unique 0-based index per CPU (e.g., BSP=0, APs as enumerated).
 void gdt_init(uint32_t cpu_index);
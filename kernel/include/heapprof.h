@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Allocation-site heap profiler. While running, malloc() and friends sample
+// roughly one allocation per 'interval' bytes on each CPU and charge it to
+// its caller (__builtin_return_address(0) of the libc entry point). Each
+// site keeps sampled and estimated counts, live and total bytes and a
+// histogram of object lifetimes; heapprof_report() logs the sites with the
+// most live bytes, symbolised, followed by the slab and stelloc
+// fragmentation reports.
+//
+// Cost when not running is one flag test per malloc and free. While running,
+// every free probes the table of sampled pointers without a lock; only the
+// free of a sampled pointer takes the profiler lock and reads the clock.
+
+// Lifetime buckets: <1us, <10us, ... <1s, >=1s.
+#define HEAPPROF_LIFETIME_BUCKETS 8
+
+// Start profiling, sampling one allocation per 'interval' bytes (1 samples
+// every allocation). Returns 0, or -1 when already running or out of memory.
+int heapprof_start(size_t interval);
+void heapprof_stop(void);
+void heapprof_report(void);
+
+extern bool heapprof_enabled;
+
+void heapprof_record_alloc(void *ptr, size_t size, void *site);
+void heapprof_record_free(void *ptr);
+void heapprof_record_retag(void *ptr, void *site);
+
+static inline void heapprof_alloc(void *ptr, size_t size, void *site) {
+    if (__builtin_expect(heapprof_enabled, 0)) heapprof_record_alloc(ptr, size, site);
+}
+
+static inline void heapprof_free(void *ptr) {
+    if (__builtin_expect(heapprof_enabled, 0)) heapprof_record_free(ptr);
+}
+
+// Charge a sampled allocation to 'site' instead of the libc wrapper that
+// made it (calloc, realloc and posix_memalign allocate through malloc).
+static inline void heapprof_retag(void *ptr, void *site) {
+    if (__builtin_expect(heapprof_enabled, 0)) heapprof_record_retag(ptr, site);
+}
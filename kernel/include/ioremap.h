@@ -5,7 +5,24 @@
 
 // Map a physical MMIO range [phys, phys+size) into kernel virtual space and
 // return the mapped virtual base. Returns 0 on failure.
+//
+// A range already covered by a live mapping of the same type reuses it and
+// takes a reference; each ioremap() must be paired with one iounmap().
+//
+// ioremap() and ioremap_uc() map strongly uncached: every access reaches the
+// device in program order. Use them for registers (LAPIC, IOAPIC, HPET).
+// ioremap_wc() maps write-combining: stores are buffered and merged, loads
+// are uncached, and ordering against other memory needs an sfence. Meant for
+// framebuffers and other write-mostly apertures. ioremap_wt() maps
+// write-through: loads hit the cache, stores go straight to the device.
 void* ioremap(uint64_t phys, size_t size);
+void* ioremap_uc(uint64_t phys, size_t size);
+void* ioremap_wc(uint64_t phys, size_t size);
+void* ioremap_wt(uint64_t phys, size_t size);
 
-// Optional unmap (not strictly needed yet). Safe to no-op if not implemented.
+// Drop a reference taken by ioremap(). The last one unmaps the range and
+// returns its virtual space to the window.
 void iounmap(void* virt, size_t size);
+
+// Log every live mapping with its type, references and page sizes.
+void ioremap_dump(void);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sampled guarded allocations (after Linux KFENCE). One malloc in every
+// 'interval' on each CPU is served from a small pool of pages, each with an
+// unmapped guard page on both sides. The object sits against one of the
+// guards, so an out-of-bounds access faults; a freed slot's page is unmapped
+// so a use-after-free faults too. Faults and corrupted slack bytes are
+// reported with the allocation and free sites, then the kernel halts.
+//
+// Cost when not sampling is one per-CPU counter decrement per malloc and a
+// range check per free.
+
+#define KFENCE_POOL_BASE  0xFFFF80D000000000ULL
+#define KFENCE_SLOTS      255
+// Guard page, then a (data, guard) pair per slot.
+#define KFENCE_POOL_SIZE  ((2ULL * KFENCE_SLOTS + 1) * 0x1000ULL)
+
+// Default sampling interval; build with CPPFLAGS=-DKFENCE_SAMPLE_INTERVAL=0
+// to disable sampling.
+#ifndef KFENCE_SAMPLE_INTERVAL
+#define KFENCE_SAMPLE_INTERVAL 4096
+#endif
+
+extern uint32_t kfence_interval;
+
+void kfence_init(void);
+
+// Change the sampling interval at run time; 0 disables sampling.
+void kfence_set_interval(uint32_t interval);
+
+// True when this allocation should be sampled.
+bool kfence_sample_slow(void);
+static inline bool kfence_should_sample(void) {
+    if (__builtin_expect(kfence_interval == 0, 1)) return false;
+    return kfence_sample_slow();
+}
+
+static inline bool kfence_owns(const void *ptr) {
+    return (uint64_t)(uintptr_t)ptr - KFENCE_POOL_BASE < KFENCE_POOL_SIZE;
+}
+
+// Allocate 'size' bytes aligned to 'align' (0 = default) from the pool, or
+// NULL when the request does not fit a page or every slot is busy. 'caller'
+// is the allocation site shown in reports.
+void *kfence_alloc(size_t size, size_t align, void *caller);
+void kfence_free(void *ptr, void *caller);
+size_t kfence_usable_size(void *ptr);
+
+// Page fault hook: report an access that hit a guard or a freed slot and
+// return true; false when 'va' is outside the pool.
+bool kfence_handle_fault(uint64_t va, uint64_t err_code, uint64_t rip);
+
+void kfence_dump_stats(void);
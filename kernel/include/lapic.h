@@ -5,6 +5,8 @@
 // Vector used for LAPIC timer interrupts; ensure an IDT entry exists
 #define LAPIC_TIMER_VECTOR 0xF0
 #define LAPIC_PANIC_VECTOR 0xF1
+#define LAPIC_CALL_VECTOR  0xF2
+#define LAPIC_TLB_VECTOR   0xF3
 
 typedef void (*lapic_timer_cb_t)(void);
 
@@ -12,6 +14,8 @@ bool lapic_supported(void);
 void lapic_enable(void);
 void lapic_eoi(void);
 void lapic_send_ipi_all_others(uint8_t vector);
+// Send a fixed IPI to one CPU by APIC ID. Returns false if the LAPIC is not mapped.
+bool lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
 
 // Timer API (periodic)
 void lapic_timer_init(uint32_t hz, uint64_t tsc_hz_hint);
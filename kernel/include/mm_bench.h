@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Boot-time memory-management microbenchmarks. Off by default; build with
+// CPPFLAGS=-DMM_BENCH=1 to run them from kmain and print results to the log.
+#ifndef MM_BENCH
+#define MM_BENCH 0
+#endif
+
+// Run every benchmark below in sequence.
+void mm_bench_run(void);
+
+// Address-space switch cost with and without PCID-tagged TLB entries.
+void mm_bench_pcid_switch(void);
+
+// Mapping a large range page by page versus with one vmm_map_range() call.
+void mm_bench_map_range(void);
+
+// vmalloc/vfree churn: per-pair cost and how often the lazy purge runs.
+void mm_bench_vmalloc(void);
+
+// Sparse touch of a demand-paged reservation versus a fully committed range.
+void mm_bench_vheap_reserve(void);
+
+// malloc/free of small objects with 100k live: free must not scale with heap.
+void mm_bench_slab_free(void);
+
+// Hot malloc/free pairs served from the per-CPU magazines.
+void mm_bench_slab_pair(void);
+
+// The slab pair loop on 1, 2, 4 ... CPUs at once, in ops/s per CPU count.
+void mm_bench_slab_scale(void);
+
+// Typed cache with a constructor versus malloc + manual initialisation.
+void mm_bench_kmem_cache(void);
+
+// Burst of small allocations, then free: how much flows back to palloc.
+void mm_bench_slab_reclaim(void);
+
+// Growing a cache by one-page slabs from the HHDM versus from vheap.
+void mm_bench_slab_direct(void);
+
+// Replay of a traced mixed-size workload under the old and current size classes.
+void mm_bench_slab_frag(void);
+
+// Stelloc alloc/free latency (average and worst) on a fragmented heap.
+void mm_bench_stelloc(void);
+
+// Mixed-size stelloc alloc/free on 1, 2, 4 ... CPUs at once, in ops/s per
+// CPU count.
+void mm_bench_stelloc_scale(void);
+
+// Heap growth during an allocation burst: fixed batches versus adaptive.
+void mm_bench_growth(void);
+
+// Large buffers on the direct vmalloc path: cost and prompt page return.
+void mm_bench_large(void);
+
+// Repeated realloc growth of one buffer: how often it moves and what it costs.
+void mm_bench_realloc(void);
+
+// Zero-backed calloc of a large and of medium buffers against malloc + memset,
+// the medium ones with the free timed too.
+void mm_bench_calloc(void);
+
+// malloc/free overhead of the heap profiler, followed by its site report.
+void mm_bench_heapprof(void);
+
+// Burst allocation through malloc/free against an arena and a scratch arena.
+void mm_bench_arena(void);
+
+// Full-screen console redraw through the boot, UC, WT and WC framebuffer mappings.
+void mm_bench_fb(void);
+
+// Re-mapping a live MMIO range and map/unmap cycles of a large one.
+void mm_bench_ioremap(void);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu_local.h>
+
+// NUMA topology from the ACPI SRAT and SLIT. Proximity domains are renumbered
+// to dense node ids 0..numa_node_count()-1 in the order the SRAT lists them.
+// Without an SRAT (or before numa_init()) there is a single node 0 that owns
+// every CPU and all memory.
+
+#define NUMA_MAX_NODES    8
+#define NUMA_MAX_MEMBLKS  64   // SRAT memory ranges tracked
+#define NUMA_LOCAL_DISTANCE   10
+#define NUMA_REMOTE_DISTANCE  20 // used between nodes when there is no SLIT
+
+// Parse SRAT/SLIT (after acpi_init()) and split the page allocator into
+// per-node pools. Must run before smp_init() so CPUs come up with their node.
+void numa_init(void);
+
+uint32_t numa_node_count(void);
+// Node of a physical address; memory outside every SRAT range is node 0.
+uint32_t numa_node_of_phys(uint64_t pa);
+// End of the SRAT range holding 'pa', or the start of the next range when
+// 'pa' is in none: the first address that may belong to another node.
+uint64_t numa_node_boundary(uint64_t pa);
+uint32_t numa_node_of_apic(uint32_t apic_id);
+uint8_t numa_distance(uint32_t from, uint32_t to);
+// Nodes ordered by distance from 'node', 'node' first. numa_node_count()
+// entries.
+const uint8_t *numa_fallback(uint32_t node);
+
+// Node of the executing CPU.
+static inline uint32_t numa_node_id(void) {
+    cpu_local_t *l = cpu_local_get();
+    return l ? l->numa_node : 0;
+}
+
+void numa_dump(void);
@@ -15,4 +15,37 @@ size_t palloc_get_total_page_count(void); // Returns the total number of pages
 size_t palloc_get_used_page_count(void); // Returns the number of used pages
 void* palloc_zero_allocate_page(void); // Allocates a single 4KiB page and zeroes it
 
+// Pool of pages zeroed ahead of time, which palloc_zero_allocate_page()
+// takes first. The idle task refills it while free memory is above the high
+// watermark; a shrinker empties it under pressure.
+#define PALLOC_ZERO_POOL_PAGES 256
+// Zero up to 'max' free pages into the pool. Returns the number added.
+size_t palloc_zero_refill(size_t max);
+
+// Page-type map for frames used through their HHDM address, one byte per
+// frame with the vheap encoding (VHEAP_PT_*). Frames at or above
+// PALLOC_PT_MAX_PHYS cannot be tagged: palloc_set_page_type() returns false
+// and the caller has to map the memory through vheap instead. Lookups are
+// lock-free; anything outside the direct map reads as VHEAP_PT_NONE.
+#define PALLOC_PT_MAX_PHYS (64ULL * 1024 * 1024 * 1024)
+bool palloc_set_page_type(void *page, size_t npages, uint8_t type);
+uint8_t palloc_page_type(const void *ptr);
+
+// NUMA: pages come from the calling CPU's node first (palloc_allocate_page)
+// or from 'node' first, falling back to the other nodes by distance.
+void* palloc_allocate_page_node(uint32_t node);
+// Split the usable ranges into per-node pools; called by numa_init().
+void palloc_numa_init(void);
+void palloc_node_pages(uint32_t node, size_t *total, size_t *free);
+void palloc_dump_nodes(void);
+
+// Reclaim watermarks, in pages. Dropping below 'low' flags memory pressure
+// and wakes the reclaim task (see shrinker.h), which runs the shrinkers
+// until 'high' is reached again. Below 'min' background reclaim is not
+// keeping up, and allocators at a safe point reclaim synchronously.
+void palloc_set_watermarks(size_t min, size_t low, size_t high);
+size_t palloc_min_watermark(void);
+size_t palloc_low_watermark(void);
+size_t palloc_high_watermark(void);
+
 #endif  /* PALLOC_H */
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Memory-pressure shrinkers. Subsystems that cache free memory register a
+// callback; when palloc drops below its low watermark it flags pressure and
+// the registry asks each shrinker, in 'order', to give pages back until the
+// high watermark is reached again.
+//
+// palloc itself never calls shrinkers (its callers may hold any lock).
+// Pressure is acted on by the reclaim task, which polls the flag every few
+// milliseconds, and at safe points: the idle loop, and the vmalloc() entry
+// once free memory is below the min watermark. Shrinkers must still only
+// trylock locks that an allocation path might hold, and must not register
+// or unregister shrinkers.
+
+typedef struct shrinker {
+    const char *name;
+    // Try to free up to 'target' pages. Returns the number of pages freed.
+    size_t (*shrink)(size_t target, void *ctx);
+    void *ctx;
+    int order;                 // lower runs first
+    uint64_t runs;             // times invoked
+    uint64_t freed;            // pages reported freed in total
+    struct shrinker *next;
+} shrinker_t;
+
+void shrinker_register(shrinker_t *s);
+void shrinker_unregister(shrinker_t *s);
+
+// Run shrinkers until 'target' pages are freed or all have run. Returns the
+// number of pages freed; 0 if another CPU is already shrinking.
+size_t shrinker_run(size_t target);
+
+// Flag memory pressure (called by palloc below its low watermark).
+void shrinker_kick(void);
+
+// If pressure was flagged and free memory is still below the high
+// watermark, run the shrinkers. Returns the number of pages freed.
+size_t shrinker_poll(void);
+
+// Direct reclaim at an allocation safe point. With the reclaim task running
+// this only acts below the min watermark, so allocation latency does not
+// depend on reclaim until memory is nearly gone; before it starts it is
+// shrinker_poll(). Returns the number of pages freed.
+size_t shrinker_reclaim_direct(void);
+
+// Start the reclaim task; call once the scheduler is initialised.
+void shrinker_start_reclaimd(void);
+
+// Memory pressure, from free pages against the palloc watermarks.
+typedef enum {
+    MEM_PRESSURE_NONE = 0, // at or above the low watermark
+    MEM_PRESSURE_LOW,      // below low: background reclaim
+    MEM_PRESSURE_MIN,      // below min: allocators reclaim synchronously
+    MEM_PRESSURE_OOM,      // no free pages left
+} mem_pressure_t;
+
+mem_pressure_t mem_pressure(void);
+const char *mem_pressure_name(mem_pressure_t level);
+
+// Log the registered shrinkers and their totals.
+void shrinker_dump(void);
@@ -5,13 +5,91 @@
 #include <stdbool.h>
 
 // Maximum size to serve from slab. Larger sizes go to stelloc.
-#define SLAB_MAX_SIZE 1024U
+#define SLAB_MAX_SIZE 16384U
 
 void slab_init(void);
 void *slab_alloc(size_t size);
+// Allocation whose address is a multiple of 'align' (a power of two), or
+// NULL when no size class guarantees it.
+void *slab_alloc_aligned(size_t size, size_t align);
 void slab_free(void *ptr);
 
+// One-page slabs use palloc frames through the HHDM instead of a vheap
+// mapping (default on). Switching only affects slabs created afterwards.
+void slab_set_direct_map(bool on);
+
 // Helper: returns true if ptr points to a slab-managed object
 bool slab_owns(void *ptr);
 // Helper: usable size of a slab allocation (its cache size)
 size_t slab_usable_size(void *ptr);
+
+// Typed object caches. Objects are exactly 'size' bytes rounded up to
+// 'align' (0 means 8; use KMEM_ALIGN_CACHELINE to keep hot objects on their
+// own cache lines) and are served from per-CPU magazines. If 'ctor' is given
+// it runs when an object is first handed out of a slab, not on every
+// allocation: objects must be returned to the cache in constructed state.
+typedef struct slab_cache kmem_cache_t;
+
+#define KMEM_ALIGN_CACHELINE 64U
+#define KMEM_CACHE_MAX_SIZE  SLAB_MAX_SIZE
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+typedef struct kmem_cache_stats {
+    const char *name;
+    size_t obj_size;
+    size_t align;
+    size_t slab_pages;
+    size_t obj_per_slab;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t active;      // allocs - frees
+    uint64_t slabs;       // live slabs (slab_pages each)
+    uint64_t slabs_freed; // slabs released back to vheap
+    uint64_t empty_slabs; // completely free slabs kept for reuse
+    uint64_t refills;     // magazine refills from the slab layer
+    uint64_t ctor_calls;
+} kmem_cache_stats_t;
+
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *out);
+
+// Number of completely free slabs a cache keeps before releasing pages
+// (default 2). Lowering it releases the excess immediately.
+void kmem_cache_set_empty_limit(kmem_cache_t *cache, uint32_t limit);
+
+// Log one line per cache that has seen any use.
+void kmem_cache_dump_stats(void);
+// Per cache: slots in use against slab capacity, partial and empty slabs,
+// and how the free slots split between the slabs and the magazines.
+void kmem_cache_dump_fragmentation(void);
+
+// Geometry of the malloc size classes, for reports. Returns false once
+// 'index' is past the last class.
+typedef struct slab_class_info {
+    size_t obj_size;
+    size_t slab_pages;
+    size_t obj_per_slab;
+} slab_class_info_t;
+
+bool slab_class_info(size_t index, slab_class_info_t *out);
+// Bytes in front of the first object of a slab whose objects are 'align'-aligned.
+size_t slab_header_size(size_t align);
+
+// Allocation trace. While a trace is running malloc() and free() append
+// (ptr, size) events to a buffer of 'capacity' entries; recording stops
+// silently when it fills. slab_frag_report() replays the trace against the
+// current size classes and the original power-of-two, single-page layout and
+// logs the peak footprint and internal waste of each.
+int slab_trace_start(size_t capacity);
+void slab_trace_stop(void);
+void slab_trace_record(void *ptr, size_t size);
+void slab_frag_report(void);
+
+extern bool slab_tracing;
+
+// Record a malloc (size > 0) or free (size 0) when a trace is running.
+static inline void slab_trace(void *ptr, size_t size) {
+    if (__builtin_expect(slab_tracing, 0)) slab_trace_record(ptr, size);
+}
@@ -3,14 +3,26 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Upper bound on logical CPUs tracked by per-CPU tables (matches the GDT/TSS bound).
+#define SMP_MAX_CPUS 256
+
 // Initialize SMP using Limine MP response; bring APs online.
 void smp_init(uint64_t tsc_hz_hint);
 
 // Number of logical CPUs detected (includes BSP).
 uint32_t smp_cpu_count(void);
 
+// LAPIC ID of a logical CPU index, or UINT32_MAX if unknown.
+uint32_t smp_cpu_lapic_id(uint32_t cpu_index);
+
 // Blocking wait until all APs have reported online (bounded by init sequence).
 void smp_wait_all_aps(void);
 
+// Run fn(arg) on 'count' CPUs at once: the caller and count - 1 idle APs.
+// Returns once every one has returned, or false without running anything
+// when fewer APs are idle or another run is in progress. For benchmarks
+// and tests before the scheduler owns the APs.
+bool smp_run_on_cpus(uint32_t count, void (*fn)(void *), void *arg);
+
 // Broadcast a halt IPI to all other CPUs (used during panic paths).
 void smp_halt_others(void);
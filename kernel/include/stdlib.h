@@ -16,6 +16,12 @@ void *realloc(void *ptr, size_t size);
 
 void *calloc(size_t nmemb, size_t size);
 
+// Memory whose address is a multiple of 'alignment' (a power of two).
+void *aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+// Bytes actually available at 'ptr'; at least the size that was requested.
+size_t malloc_usable_size(void *ptr);
+
 extern char **environ;
 
 long strtol(const char *nptr, char **endptr, int base);
@@ -10,13 +10,69 @@
 #define STELLOC_DUMB        1  // acquire 1 page on demand
 #define STELLOC_SMART       2  // acquire a small batch (e.g., 4 pages)
 #define STELLOC_AGGRESSIVE  3  // acquire a larger batch (e.g., 16 pages)
+#define STELLOC_ADAPTIVE    4  // per-arena batch sized from recent demand (default)
+
+// Requests of at least this many bytes (with alignment up to a page) skip
+// the arenas: each gets a vmalloc range of its own, tagged VHEAP_PT_LARGE in
+// the vheap page-type map, and is unmapped and returned to palloc as soon as
+// it is freed.
+#define STELLOC_LARGE_THRESHOLD (64 * 1024)
+
+// Zeroed requests (calloc) of at least this many bytes are served as whole
+// pages that are already zero instead of being cleared by the caller; see
+// stelloc_allocate_zeroed(). It matches STELLOC_LARGE_THRESHOLD: such blocks
+// pay the vmalloc range and the unmap on free either way, so skipping the
+// memset is a pure saving. Below it the range and the unmap cost more than
+// the memset saves, and sizes up to SLAB_MAX_SIZE stay in the slab caches.
+#define STELLOC_ZERO_PAGES_THRESHOLD STELLOC_LARGE_THRESHOLD
+
+// Number of heap arenas; CPU n allocates from arena n % STELLOC_ARENAS.
+#define STELLOC_ARENAS 16
 
 void stelloc_init_heap();
 void *stelloc_allocate(ulong size);
 void stelloc_free(void *ptr);
+// Like stelloc_allocate() with the memory zeroed. From
+// STELLOC_ZERO_PAGES_THRESHOLD bytes the block is a large block whose pages
+// are zero already: a vheap reservation backed with zeroed frames when
+// first touched, or under memory pressure a range of pre-zeroed frames.
+// Smaller blocks are cleared with memset.
+void *stelloc_allocate_zeroed(ulong size);
+// Like stelloc_allocate() with the returned address a multiple of 'align'
+// (a power of two). Blocks are always at least 16-byte aligned.
+void *stelloc_allocate_aligned(ulong size, ulong align);
+
+// Bytes the caller may use at 'ptr' (at least the size it asked for).
+size_t stelloc_usable_size(void *ptr);
+// Resize the block at 'ptr' without moving it: shrink in place or grow into
+// the free block that follows. Returns false, leaving the block untouched,
+// when that is not possible.
+bool stelloc_resize(void *ptr, ulong size);
 
-// Configure stelloc's growth behavior. Default is STELLOC_SMART.
+// Configure stelloc's growth behavior. Default is STELLOC_ADAPTIVE; the
+// fixed modes remain for comparison.
 void stelloc_set_mode(int mode);
 int  stelloc_get_mode(void);
 
+// Decisions of the adaptive growth controller, summed over all arenas.
+typedef struct stelloc_growth_stats {
+    uint64_t grows;        // pools added
+    uint64_t grow_pages;   // pages in those pools
+    uint64_t up;           // batch doubled: growth was frequent or demand high
+    uint64_t down;         // batch halved: idle, low demand or memory pressure
+    uint64_t hold;         // batch kept
+    uint64_t batch_max;    // largest current batch of any arena, in pages
+} stelloc_growth_stats_t;
+
+void stelloc_get_growth_stats(stelloc_growth_stats_t *out);
+// Take one-page pools (STELLOC_DUMB growth, or any growth under memory
+// pressure) straight from palloc through the HHDM instead of mapping them in
+// vheap. Default on; larger pools always come from vheap.
+void stelloc_set_direct_map(bool on);
+
+// Log pool size and alloc/free counts for every arena in use.
+void stelloc_dump_stats(void);
+// Log free bytes, free block count and largest free block per arena.
+void stelloc_dump_fragmentation(void);
+
 #endif /* STELLOC_H */
\ No newline at end of file
@@ -5,18 +5,91 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+struct vrange_stats; // vrange.h
+
 // Initialize a virtually contiguous heap at 'base_va' with size 'size_bytes'.
 // Returns 0 on success.
 int vheap_init(uint64_t base_va, uint64_t size_bytes);
 
-// Ensure there is at least 'bytes' of committed (mapped) space from the current
-// commit pointer by mapping new palloc pages as needed. Returns the start VA
-// where the space is available, or 0 on failure. Moves the commit pointer.
+// Allocate 'bytes' (rounded up to pages) of mapped, virtually contiguous
+// memory from the vheap window, followed by an unmapped guard page.
+// Returns NULL on failure.
+void *vmalloc(size_t bytes);
+
+// vmalloc() with the memory zeroed. Frames come from palloc's pre-zeroed
+// pool while it lasts, so the caller does not clear them itself.
+void *vzalloc(size_t bytes);
+
+// Release a vmalloc() allocation. The pages stay mapped until the next lazy
+// purge, which unmaps them in one TLB flush and returns the frames to palloc.
+void vfree(void *ptr);
+
+// Release a vmalloc() allocation and unmap it now: the frames are back in
+// palloc on return, only the address space waits for the next purge. Costs
+// a TLB flush (and shootdown) per call.
+void vfree_now(void *ptr);
+
+// Usable size of the vmalloc() allocation starting at 'ptr', or 0.
+size_t vmalloc_size(const void *ptr);
+
+// Purge lazily freed ranges now. Returns the number of pages reclaimed.
+size_t vheap_purge(void);
+
+// Snapshot of the window's range allocator counters.
+void vheap_get_stats(struct vrange_stats *out);
+
+// Pages mapped around each demand fault: an aligned 64KiB cluster.
+#define VHEAP_FAULT_CLUSTER 16
+
+// Hand out 'bytes' (rounded up to pages) of vheap address space without
+// backing memory, followed by a guard page. Pages are zero-filled on first
+// touch, VHEAP_FAULT_CLUSTER at a time. Release with vfree(). The fault path
+// takes the vrange, palloc and vmm locks, so code holding one of those must
+// not touch pages of a reservation that are not populated yet.
+void *vheap_reserve(size_t bytes);
+
+// Back [va, va + bytes) inside a reservation now instead of on first touch.
+// Returns 0 on success.
+int vheap_populate(uint64_t va, size_t bytes);
+
+// Page-fault fast path: map the cluster around 'va' if it lies in a live
+// allocation. Returns 0 if the fault was resolved.
+int vheap_handle_fault(uint64_t va, uint64_t err_code);
+
+typedef struct vheap_fault_stats {
+    uint64_t faults;          // resolved demand faults
+    uint64_t pages_faulted;   // pages mapped by those faults (incl. fault-around)
+    uint64_t pages_populated; // pages mapped by vheap_populate()
+    uint64_t bad_faults;      // faults in the window outside any allocation
+    uint64_t oom_faults;      // faults that could not get a frame
+    uint64_t reserved_bytes;  // total handed out by vheap_reserve()
+} vheap_fault_stats_t;
+
+void vheap_get_fault_stats(vheap_fault_stats_t *out);
+
+// Page-type map. Every page of the window has one byte: the high nibble is
+// the owner type, the low nibble is free for the owner (e.g. the page index
+// inside a multi-page object). Lookups are lock-free and constant time.
+#define VHEAP_PT_NONE       0x00
+#define VHEAP_PT_VMALLOC    0x10  // vmalloc()/vheap_reserve() memory
+#define VHEAP_PT_SLAB       0x20  // slab page; header at the slab base
+#define VHEAP_PT_LARGE      0x30  // stelloc large allocation (whole vmalloc range)
+#define VHEAP_PT_TYPE_MASK  0xF0
+#define VHEAP_PT_AUX_MASK   0x0F
+
+// Largest window the page-type map can describe.
+#define VHEAP_MAX_BYTES     (64ULL * 1024 * 1024 * 1024)
+
+void vheap_set_page_type(uint64_t va, size_t npages, uint8_t type);
+uint8_t vheap_page_type(uint64_t va);
+
+// Legacy form of vmalloc(): returns the start VA of 'bytes' of freshly mapped
+// space, or 0 on failure. The range can be released with vfree().
 uint64_t vheap_commit(size_t bytes);
 
 // Query reserved virtual heap range.
 void vheap_bounds(uint64_t* base_va, uint64_t* size_bytes);
 
-// Map a single 4KiB page at 'va' if within the reserved heap range.
+// Map a single 4KiB page at 'va' if it lies inside a live vheap allocation.
 // Returns 0 on success, non-zero on failure.
 int vheap_map_one(uint64_t va);
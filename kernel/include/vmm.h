@@ -4,16 +4,132 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <smp.h>
 
 // Page table flags
 #define VMM_P_PRESENT   (1ULL << 0)
 #define VMM_P_WRITABLE  (1ULL << 1)
 #define VMM_P_USER      (1ULL << 2)
+#define VMM_P_PWT       (1ULL << 3)
+#define VMM_P_PCD       (1ULL << 4)
+#define VMM_P_HUGE      (1ULL << 7)  // PS bit in PDPT/PD entries
+#define VMM_P_PAT       (1ULL << 7)  // PAT bit in 4KiB leaves (same position as PS)
+#define VMM_P_GLOBAL    (1ULL << 8)  // survives CR3 writes; set on kernel-half leaves
+#define VMM_P_PAT_LARGE (1ULL << 12) // PAT bit in 2MiB/1GiB leaves
 #define VMM_P_NX        (1ULL << 63)
 
+// Memory types for 4KiB leaves. vmm_init() programs IA32_PAT as
+//   0 WB  1 WT  2 UC-  3 UC  4 WP  5 WC  6 UC-  7 UC
+// which keeps the power-on meaning of PWT/PCD and matches the entries the
+// bootloader guarantees, so its own mappings are unaffected. Without PAT
+// support the PAT bit is ignored and WC degrades to WT; ioremap_wc() maps
+// UC- instead in that case.
+#define VMM_CACHE_WB       0ULL
+#define VMM_CACHE_WT       (VMM_P_PWT)
+#define VMM_CACHE_UC_MINUS (VMM_P_PCD)
+#define VMM_CACHE_UC       (VMM_P_PCD | VMM_P_PWT)
+#define VMM_CACHE_WC       (VMM_P_PAT | VMM_P_PWT)
+#define VMM_CACHE_MASK     (VMM_P_PAT | VMM_P_PCD | VMM_P_PWT)
+
+// Permission bits vmm_protect_range() is allowed to change.
+#define VMM_PROT_MASK   (VMM_P_WRITABLE | VMM_P_USER | VMM_P_NX)
+
+// Above this many pages a batched flush reloads CR3 instead of issuing invlpg.
+#define VMM_FLUSH_BATCH 32
+
+// Options for vmm_unmap_range().
+#define VMM_UNMAP_FREE  (1u << 0)  // return the backing frames to palloc
+
+// First address of the kernel half shared by every address space.
+#define VMM_KERNEL_BASE 0xFFFF800000000000ULL
+
+// An address space: a PML4 whose upper half mirrors the kernel's and whose
+// lower half is private. With PCID support each space carries a tag so CR3
+// switches do not throw away its TLB entries.
+typedef struct vmm_space {
+    uint64_t pml4_phys;
+    volatile uint64_t *pml4;
+    uint16_t pcid;                   // 0 for the kernel space / when PCID is off
+    uint64_t pcid_gen;               // allocator generation 'pcid' belongs to
+    _Atomic uint64_t tlb_gen;        // bumped on every lower-half invalidation
+    uint64_t cpu_seen_gen[SMP_MAX_CPUS]; // tlb_gen each CPU last flushed up to
+    _Atomic uint64_t active[SMP_MAX_CPUS / 64]; // CPUs currently running on it
+    struct vmm_space *next;          // all spaces, for kernel PML4 propagation
+} vmm_space_t;
+
+// Pending TLB invalidations. Collect addresses while editing page tables and
+// commit once; the commit also shoots the same entries down on other CPUs.
+typedef struct vmm_flush {
+    uint64_t va[VMM_FLUSH_BATCH];
+    size_t count;
+    bool full;     // too many pages: flush the whole TLB instead
+    void *free_pages; // frames released once the flush has completed
+    vmm_space_t *space; // lower-half entries of this space; NULL = kernel half
+} vmm_flush_t;
+
 // Initialize VMM (grabs current PML4 via CR3 and translates through HHDM)
 void vmm_init(void);
 
+// Mark a CPU as running on the kernel page tables so shootdowns reach it.
+void vmm_cpu_online(uint32_t cpu_index);
+
 // Map a single 4KiB page at virtual address 'va' to physical 'pa' with flags.
 // Returns 0 on success, non-zero on failure.
 int vmm_map_page(uint64_t va, uint64_t pa, uint64_t flags);
+
+// Map 'npages' 4KiB pages at 'va' to the physically contiguous run starting
+// at 'pa_start' (vmm_map_range) or to the frames listed in 'pa_list'
+// (vmm_map_pages). Each table is walked once; only entries that replace a
+// present mapping are invalidated. On failure nothing stays mapped.
+int vmm_map_range(uint64_t va, uint64_t pa_start, size_t npages, uint64_t flags);
+int vmm_map_pages(uint64_t va, const uint64_t *pa_list, size_t npages, uint64_t flags);
+
+// Map 'count' 2MiB pages at 'va' to the contiguous run at 'pa', both 2MiB
+// aligned, in the kernel half. 'flags' take the 4KiB encoding (VMM_CACHE_*
+// included) and are converted for large leaves. A page table left empty by
+// earlier 4KiB mappings is replaced; one that still maps anything makes the
+// call fail. On failure nothing stays mapped.
+int vmm_map_large(uint64_t va, uint64_t pa, size_t count, uint64_t flags);
+
+// Remove 'npages' 4KiB mappings starting at 'va'. Holes are skipped. With
+// VMM_UNMAP_FREE the frames go back to palloc. If 'flush' is NULL the
+// invalidation is committed before returning; otherwise it is queued on it.
+// Returns 0 on success, non-zero if a 2MiB mapping would have to be split.
+int vmm_unmap_range(uint64_t va, size_t npages, uint32_t opts, vmm_flush_t *flush);
+
+// Replace the VMM_PROT_MASK bits of present mappings in the range with
+// 'flags'. Same flush and return conventions as vmm_unmap_range().
+int vmm_protect_range(uint64_t va, size_t npages, uint64_t flags, vmm_flush_t *flush);
+
+// True once IA32_PAT holds the layout above on this CPU.
+bool vmm_pat_supported(void);
+
+// Translate a mapped virtual address. Returns false if not present.
+bool vmm_translate(uint64_t va, uint64_t *pa_out);
+
+// Flush batching.
+void vmm_flush_init(vmm_flush_t *flush);
+void vmm_flush_add(vmm_flush_t *flush, uint64_t va);
+void vmm_flush_all(vmm_flush_t *flush);
+// Invalidate locally and on every other CPU that may cache the entries, then
+// reset the batch. Must not be called while holding a lock that another CPU
+// may spin on with interrupts disabled.
+void vmm_flush_commit(vmm_flush_t *flush);
+
+// Address spaces. vmm_space_create() returns NULL on allocation failure.
+vmm_space_t *vmm_kernel_space(void);
+vmm_space_t *vmm_space_create(void);
+// Free the lower-half page tables. The space must not be active on any CPU;
+// leaf frames are not freed (unmap them with VMM_UNMAP_FREE first).
+void vmm_space_destroy(vmm_space_t *space);
+// Load 'space' on this CPU, keeping its TLB entries when PCIDs allow it.
+void vmm_space_switch(vmm_space_t *space);
+vmm_space_t *vmm_space_current(void);
+// Lower-half mapping helpers for a specific space.
+int vmm_space_map_page(vmm_space_t *space, uint64_t va, uint64_t pa, uint64_t flags);
+int vmm_space_unmap_range(vmm_space_t *space, uint64_t va, size_t npages, uint32_t opts);
+
+// PCID state. Clearing 'use' keeps CR4.PCIDE but makes every switch flush,
+// which is how the benchmark measures the cost without tags.
+bool vmm_pcid_supported(void);
+void vmm_pcid_set_enabled(bool use);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <lock.h>
+
+// Virtual address range allocator for a fixed kernel window.
+//
+// Free ranges live in a red-black tree ordered by address and augmented with
+// the largest free size in each subtree, so a lowest-address first fit is a
+// single O(log n) descent. Busy ranges live in a second tree keyed by start
+// address so a release only needs the base VA.
+//
+// Released ranges are not reusable straight away: they sit on a lazy list
+// with their mappings intact until enough pages have accumulated, then the
+// whole list is unmapped under one TLB flush batch (one shootdown IPI) and
+// the address space is returned to the free tree. Backing frames go back to
+// palloc only after that flush.
+
+typedef struct vrange_node {
+    struct vrange_node *parent, *left, *right;
+    uint64_t start;        // first VA of the range
+    uint64_t size;         // bytes (busy: usable size, excluding guard)
+    uint64_t max_free;     // largest 'size' in this subtree (free tree only)
+    struct vrange_node *next; // lazy list / node free list
+    uint32_t unmap_opts;   // vmm_unmap_range() opts applied at purge time
+    uint8_t red;
+} vrange_node_t;
+
+typedef struct vrange_tree {
+    vrange_node_t *root;
+    vrange_node_t nil;     // per-tree sentinel; never copy a tree
+} vrange_tree_t;
+
+typedef struct vrange_stats {
+    uint64_t allocs, frees, purges;
+    uint64_t busy_bytes;   // currently handed out
+    uint64_t lazy_bytes;   // released, waiting for a purge
+    uint64_t free_bytes;   // immediately allocatable
+    uint64_t largest_free; // largest single free range
+} vrange_stats_t;
+
+typedef struct vrange {
+    spinlock_t lock;
+    const char *name;
+    uint64_t base, size;
+    uint32_t guard_pages;  // unmapped pages kept after every allocation
+    vrange_tree_t free;
+    vrange_tree_t busy;
+    vrange_node_t *lazy;
+    uint64_t lazy_pages;
+    uint64_t lazy_limit;   // purge once this many pages are pending
+    vrange_node_t *spare;  // node pool carved from palloc pages
+    vrange_stats_t stats;
+} vrange_t;
+
+// Default number of lazily released pages before a purge (32 MiB).
+#define VRANGE_LAZY_LIMIT 8192
+
+// Set up 'r' to manage [base, base + size). Returns 0 on success.
+int vrange_init(vrange_t *r, const char *name, uint64_t base, uint64_t size, uint32_t guard_pages);
+
+// Reserve 'bytes' (rounded up to pages) aligned to 'align' (a power of two,
+// at least 4KiB). Nothing is mapped. Returns the VA or 0 when the window is
+// exhausted even after purging the lazy list.
+uint64_t vrange_alloc(vrange_t *r, size_t bytes, size_t align);
+
+// Release the busy range starting at 'va'. Its pages are unmapped with
+// 'unmap_opts' (e.g. VMM_UNMAP_FREE) at the next purge. Returns the usable
+// size of the range, or 0 if 'va' is not the start of a busy range.
+size_t vrange_release(vrange_t *r, uint64_t va, uint32_t unmap_opts);
+
+// Look up the busy range containing 'va'. Returns true and fills the bounds
+// when found; guard pages are not part of a range.
+bool vrange_lookup(vrange_t *r, uint64_t va, uint64_t *start, uint64_t *size);
+
+// Unmap everything on the lazy list under one flush and make the address
+// space reusable. Returns the number of pages purged.
+size_t vrange_purge(vrange_t *r);
+
+void vrange_get_stats(vrange_t *r, vrange_stats_t *out);
@@ -13,6 +13,8 @@ static const acpi_sdt_header_t* xsdt;
 static const acpi_sdt_header_t* rsdt;
 static const acpi_madt_t* madt_tbl;
 static const acpi_hpet_t* hpet_tbl;
+static const acpi_srat_t* srat_tbl;
+static const acpi_slit_t* slit_tbl;
 
 static uint8_t checksum8(const void* ptr, size_t len) {
     const uint8_t* p = (const uint8_t*)ptr;
@@ -148,11 +150,28 @@ bool acpi_init(void) {
     } else {
         debug_printf("ACPI: HPET not found\n");
     }
+    const acpi_sdt_header_t* srat_h = xsdt ? find_in_xsdt("SRAT") : find_in_rsdt("SRAT");
+    if (srat_h) {
+        srat_tbl = (const acpi_srat_t*)srat_h;
+        debug_printf("ACPI: SRAT @ %p len=%u rev=%u\n", srat_tbl, (unsigned)srat_tbl->hdr.length, (unsigned)srat_tbl->hdr.revision);
+    } else {
+        debug_printf("ACPI: SRAT not found\n");
+    }
+    const acpi_sdt_header_t* slit_h = xsdt ? find_in_xsdt("SLIT") : find_in_rsdt("SLIT");
+    if (slit_h) {
+        slit_tbl = (const acpi_slit_t*)slit_h;
+        debug_printf("ACPI: SLIT @ %p len=%u localities=%llu\n", slit_tbl, (unsigned)slit_tbl->hdr.length,
+                     (unsigned long long)slit_tbl->locality_count);
+    } else {
+        debug_printf("ACPI: SLIT not found\n");
+    }
     return true;
 }
 
 const acpi_madt_t* acpi_madt(void) { return madt_tbl; }
 const acpi_hpet_t* acpi_hpet(void) { return hpet_tbl; }
+const acpi_srat_t* acpi_srat(void) { return srat_tbl; }
+const acpi_slit_t* acpi_slit(void) { return slit_tbl; }
 
 uint64_t acpi_lapic_phys(void) {
     if (!madt_tbl) return 0;
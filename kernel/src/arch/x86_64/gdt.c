@@ -61,6 +61,7 @@ typedef struct __attribute__((packed)) {
 #define MAX_GDT_CPUS 256
 static gdt_blob_t gdt_blobs[MAX_GDT_CPUS];
 static tss_t tss_array[MAX_GDT_CPUS];
+static uint8_t pf_stacks[MAX_GDT_CPUS][GDT_IST_STACK_SIZE] __attribute__((aligned(16)));
 static spinlock_t gdt_lock = {0};
 static int gdt_built = 0;
 
@@ -116,6 +117,7 @@ void gdt_init(uint32_t cpu_index) {
     gdt_blob_t *blob = &gdt_blobs[cpu_index];
     memset(tss, 0, sizeof(*tss));
     tss->iopb_offset = sizeof(*tss);
+    tss->ist1 = (uint64_t)&pf_stacks[cpu_index][GDT_IST_STACK_SIZE]; // GDT_IST_PAGE_FAULT
 
     memset(blob, 0, sizeof(*blob));
     set_gdt_code_entry(&blob->entries[1], 0); // kernel CS
@@ -27,7 +27,7 @@ bool hpet_supported(void) {
     const acpi_hpet_t* t = acpi_hpet();
     if (!t) return false;
     if (t->address.address_space_id != 0) return false; // must be MMIO
-    hpet_regs = (volatile uint64_t*)ioremap(t->address.address, 0x400);
+    if (!hpet_regs) hpet_regs = (volatile uint64_t*)ioremap_uc(t->address.address, 0x400);
     if (!hpet_regs) { error_printf("HPET: ioremap failed for phys=%#016llx\n", (unsigned long long)t->address.address); return false; }
     debug_printf("HPET: phys=%#016llx -> base=%p\n", (unsigned long long)t->address.address, hpet_regs);
     uint64_t caps = mmio_read64(hpet_regs + 0); // GCAP_ID
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <idt.h>
+#include <gdt.h>
 #include <spinlock.h>
 
 extern void idt_load(void* idtr);
@@ -44,6 +45,7 @@ extern void irq_stub_44(void); extern void irq_stub_45(void); extern void irq_st
 extern void isr_stub_240(void);
 extern void isr_stub_241(void);
 extern void isr_stub_242(void);
+extern void isr_stub_243(void);
 extern void isr_stub_255(void);
 
 static void set_idt_gate(int vec, void* handler, uint8_t type_attr, uint8_t ist) {
@@ -78,7 +80,7 @@ void idt_init(void) {
         set_idt_gate(11, isr_stub_11, gate, 0);
         set_idt_gate(12, isr_stub_12, gate, 0);
         set_idt_gate(13, isr_stub_13, gate, 0);
-        set_idt_gate(14, isr_stub_14, gate, 0);
+        set_idt_gate(14, isr_stub_14, gate, GDT_IST_PAGE_FAULT);
         set_idt_gate(15, isr_stub_15, gate, 0);
         set_idt_gate(16, isr_stub_16, gate, 0);
         set_idt_gate(17, isr_stub_17, gate, 0);
@@ -115,10 +117,11 @@ void idt_init(void) {
         set_idt_gate(46, irq_stub_46, gate, 0);
         set_idt_gate(47, irq_stub_47, gate, 0);
 
-        // LAPIC timer, panic, and spurious vectors
+        // LAPIC timer, panic, TLB shootdown, and spurious vectors
         set_idt_gate(240, isr_stub_240, gate, 0);
         set_idt_gate(241, isr_stub_241, gate, 0);
         set_idt_gate(242, isr_stub_242, gate, 0);
+        set_idt_gate(243, isr_stub_243, gate, 0);
         set_idt_gate(255, isr_stub_255, gate, 0);
 
         idtr.base = (uint64_t)&idt[0];
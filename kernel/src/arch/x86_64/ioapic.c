@@ -31,7 +31,7 @@ static inline uint32_t ioapic_read(uint8_t reg) {
 bool ioapic_supported(void) {
     ioapic_info_t info;
     if (!acpi_get_first_ioapic(&info)) return false;
-    ioapic_base = (volatile uint32_t*)ioremap(info.phys_base, 0x20);
+    if (!ioapic_base) ioapic_base = (volatile uint32_t*)ioremap_uc(info.phys_base, 0x20);
     if (!ioapic_base) { error_printf("IOAPIC: ioremap failed for phys=%#010x\n", (unsigned)info.phys_base); return false; }
     gsi_base = info.gsi_base;
     debug_printf("IOAPIC: phys=%#010x -> base=%p gsi_base=%u\n", (unsigned)info.phys_base, ioapic_base, (unsigned)gsi_base);
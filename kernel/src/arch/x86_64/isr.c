@@ -6,6 +6,7 @@
 #include <stdatomic.h>
 #include <panic.h>
 #include <vheap.h>
+#include <kfence.h>
 #include <vmm.h>
 #include <lprintf.h>
 #include <symbols.h>
@@ -618,28 +619,29 @@ void kernel_panic(const char* reason, const isr_frame_t* f) {
 
 static void default_exception(isr_frame_t* f) {
     if (f->int_no == 14) {
-        uint64_t cr2;
-        __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
-        // Attempt recovery for non-present page inside reserved vheap range on kernel-mode access
-        if ((f->err_code & 1ULL) == 0) { // P=0 (non-present)
-            debug_printf("PF: Attempting recovery for faulting address %p, err_code=0x%llx\n", (void*)cr2, (unsigned long long)f->err_code);
-            uint64_t base, size; vheap_bounds(&base, &size);
-            if (base && cr2 >= base && cr2 < (base + size)) {
-                if (vheap_map_one(cr2) == 0) {
-                    debug_printf("PF: recovered by mapping vheap page at %p\n", (void*)cr2);
-                    return; // recovered
-                }
-            }
-            debug_printf("PF: recovery failed\n");
-        }
         dump_page_fault(f->err_code);
     }
     kernel_panic(exc_name(f->int_no), f);
 }
 
+// #PF runs on its own IST stack so a fault on an unpopulated stack page can
+// be resolved instead of escalating to a double fault.
+static void page_fault(isr_frame_t* f) {
+    uint64_t cr2;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+    // Demand paging for vheap reservations (non-present, kernel-mode)
+    if ((f->err_code & 1ULL) == 0 && vheap_handle_fault(cr2, f->err_code) == 0) {
+        return; // recovered
+    }
+    // Guarded sampled allocation: report the bad access before the panic dump
+    (void)kfence_handle_fault(cr2, f->err_code, f->rip);
+    debug_printf("PF: unresolved fault at %p, err_code=0x%llx\n", (void*)cr2, (unsigned long long)f->err_code);
+    default_exception(f);
+}
+
 void exceptions_install_defaults(void) {
     for (int v = 0; v < 32; ++v) {
-        isr_register((uint8_t)v, default_exception);
+        isr_register((uint8_t)v, v == 14 ? page_fault : default_exception);
     }
 }
 
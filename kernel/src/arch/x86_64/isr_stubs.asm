@@ -145,4 +145,5 @@ IRQ 47
 ISR_NOERR 240
 ISR_NOERR 241
 ISR_NOERR 242
+ISR_NOERR 243
 ISR_NOERR 255
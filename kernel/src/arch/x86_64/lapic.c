@@ -54,11 +54,21 @@ void lapic_send_ipi_all_others(uint8_t vector) {
     lapic_write(LAPIC_REG_ICR_LOW, icr_low);
 }
 
+bool lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    if (!lapic_base) return false;
+    // Wait for any previous IPI to leave the ICR (delivery status, bit 12)
+    while (lapic_read(LAPIC_REG_ICR_LOW) & (1u << 12)) { __asm__ __volatile__("pause"); }
+    lapic_write(LAPIC_REG_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, (uint32_t)vector); // fixed delivery, physical dest, no shorthand
+    return true;
+}
+
 bool lapic_supported(void) {
     uint64_t phys = acpi_lapic_phys();
     if (!phys) return false;
-    // Map MMIO with ioremap to ensure page tables cover the region
-    lapic_base = (volatile uint32_t*)ioremap(phys, 0x1000);
+    // Map MMIO with ioremap to ensure page tables cover the region; probing
+    // again keeps the first mapping
+    if (!lapic_base) lapic_base = (volatile uint32_t*)ioremap_uc(phys, 0x1000);
     if (!lapic_base) { error_printf("LAPIC: ioremap failed for phys=%#016llx\n", (unsigned long long)phys); return false; }
     debug_printf("LAPIC: phys=%#016llx -> base=%p (ioremap)\n", (unsigned long long)phys, lapic_base);
     // Light sanity: read ID or SVR
@@ -4,6 +4,10 @@
 
 #define MSR_FS_BASE 0xC0000100
 
+// FS base is undefined until the BSP installs its block; reading %fs:0 before
+// that would dereference whatever the firmware left behind.
+static volatile bool cpu_local_ready = false;
+
 static inline void wrmsr(uint32_t msr, uint64_t val) {
     uint32_t lo = (uint32_t)val;
     uint32_t hi = (uint32_t)(val >> 32);
@@ -11,11 +15,19 @@ static inline void wrmsr(uint32_t msr, uint64_t val) {
 }
 
 void cpu_local_set(cpu_local_t* ptr) {
+    ptr->self = ptr;
     wrmsr(MSR_FS_BASE, (uint64_t)ptr);
+    cpu_local_ready = true;
 }
 
 cpu_local_t* cpu_local_get(void) {
+    if (!cpu_local_ready) return NULL;
     cpu_local_t* ptr;
     __asm__ __volatile__("mov %%fs:0, %0" : "=r"(ptr));
     return ptr;
 }
+
+uint32_t cpu_local_index(void) {
+    cpu_local_t* ptr = cpu_local_get();
+    return ptr ? ptr->cpu_index : 0;
+}
@@ -0,0 +1,19 @@
+#include <stdlib.h>
+#include <stelloc.h>
+#include <slab.h>
+#include <kfence.h>
+#include <heapprof.h>
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (size == 0 || alignment == 0 || (alignment & (alignment - 1))) return NULL;
+    void *p = NULL;
+    if (kfence_should_sample()) p = kfence_alloc(size, alignment, __builtin_return_address(0));
+    // Small sizes come from a slab class that is naturally aligned enough;
+    // everything else is carved at the right offset inside a stelloc block.
+    if (!p && size <= SLAB_MAX_SIZE) p = slab_alloc_aligned(size, alignment);
+    if (!p) p = stelloc_allocate_aligned((ulong)size, (ulong)alignment);
+    slab_trace(p, size);
+    heapprof_alloc(p, size, __builtin_return_address(0));
+    return p;
+}
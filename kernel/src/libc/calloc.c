@@ -1,13 +1,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stelloc.h>
+#include <slab.h>
+#include <heapprof.h>
 
 void *calloc(size_t nmemb, size_t size)
 {
-    size_t total_size = nmemb * size;
+    size_t total_size;
+    if (__builtin_mul_overflow(nmemb, size, &total_size)) return NULL;
+    // Large requests come back already zero: no memset on this path.
+    if (total_size >= STELLOC_ZERO_PAGES_THRESHOLD) {
+        void *ptr = stelloc_allocate_zeroed((ulong)total_size);
+        slab_trace(ptr, total_size);
+        heapprof_alloc(ptr, total_size, __builtin_return_address(0));
+        return ptr;
+    }
     void *ptr = malloc(total_size);
     if (ptr) {
+        heapprof_retag(ptr, __builtin_return_address(0));
         memset(ptr, 0, total_size);
     }
     return ptr;
-}
\ No newline at end of file
+}
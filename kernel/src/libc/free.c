@@ -2,10 +2,15 @@
 #include <stelloc.h>
 #include <slab.h>
 #include <stdio.h>
+#include <kfence.h>
+#include <heapprof.h>
 
 void free(void *ptr)
 {
     if (!ptr) return;
+    slab_trace(ptr, 0);
+    heapprof_free(ptr);
+    if (kfence_owns(ptr)) { kfence_free(ptr, __builtin_return_address(0)); return; }
     if (slab_owns(ptr)) { slab_free(ptr); return; }
     stelloc_free(ptr);
 }
\ No newline at end of file
@@ -1,13 +1,17 @@
 #include <stdlib.h>
 #include <stelloc.h>
 #include <slab.h>
+#include <kfence.h>
+#include <heapprof.h>
 
 void *malloc(size_t size)
 {
     if (size == 0) return NULL;
-    if (size <= SLAB_MAX_SIZE) {
-        void *p = slab_alloc(size);
-        if (p) return p;
-    }
-    return stelloc_allocate((ulong)size);
+    void *p = NULL;
+    if (kfence_should_sample()) p = kfence_alloc(size, 0, __builtin_return_address(0));
+    if (!p && size <= SLAB_MAX_SIZE) p = slab_alloc(size);
+    if (!p) p = stelloc_allocate((ulong)size);
+    slab_trace(p, size);
+    heapprof_alloc(p, size, __builtin_return_address(0));
+    return p;
 }
\ No newline at end of file
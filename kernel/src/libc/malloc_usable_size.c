@@ -0,0 +1,12 @@
+#include <stdlib.h>
+#include <stelloc.h>
+#include <slab.h>
+#include <kfence.h>
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (!ptr) return 0;
+    if (kfence_owns(ptr)) return kfence_usable_size(ptr);
+    if (slab_owns(ptr)) return slab_usable_size(ptr);
+    return stelloc_usable_size(ptr);
+}
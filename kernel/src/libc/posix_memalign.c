@@ -0,0 +1,22 @@
+#include <stdlib.h>
+#include <heapprof.h>
+
+// errno values as on Linux; this libc has no <errno.h> yet.
+#define POSIX_MEMALIGN_EINVAL 22
+#define POSIX_MEMALIGN_ENOMEM 12
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return POSIX_MEMALIGN_EINVAL;
+    }
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+    void *p = aligned_alloc(alignment, size);
+    if (!p) return POSIX_MEMALIGN_ENOMEM;
+    heapprof_retag(p, __builtin_return_address(0));
+    *memptr = p;
+    return 0;
+}
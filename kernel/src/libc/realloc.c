@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stelloc.h>
+#include <slab.h>
+#include <kfence.h>
+#include <heapprof.h>
 
 void *realloc(void *ptr, size_t size)
 {
@@ -12,16 +15,50 @@ void *realloc(void *ptr, size_t size)
         return NULL;
     }
 
-    // Allocate new memory block
-    void *new_ptr = malloc(size);
-    if (new_ptr == NULL) {
-        return NULL; // Allocation failed
+    size_t old_size;
+    if (kfence_owns(ptr)) {
+        // Guarded sample: never resized in place, the copy goes to a normal block.
+        old_size = kfence_usable_size(ptr);
+    } else if (slab_owns(ptr)) {
+        // Stay in the slot while it fits, unless a much smaller class would
+        // do: a string shrunk to a few bytes should not pin a large slot.
+        old_size = slab_usable_size(ptr);
+        if (size <= old_size && (size > old_size / 2 || old_size <= 64)) {
+            slab_trace(ptr, 0);
+            slab_trace(ptr, size);
+            heapprof_free(ptr);
+            heapprof_alloc(ptr, size, __builtin_return_address(0));
+            return ptr;
+        }
+    } else {
+        // Shrink in place, or grow into the free block that follows.
+        old_size = stelloc_usable_size(ptr);
+        if (size > SLAB_MAX_SIZE || size > old_size / 2) {
+            if (stelloc_resize(ptr, (ulong)size)) {
+                slab_trace(ptr, 0);
+                slab_trace(ptr, size);
+                heapprof_free(ptr);
+                heapprof_alloc(ptr, size, __builtin_return_address(0));
+                return ptr;
+            }
+        }
     }
 
-    memcpy(new_ptr, ptr, size);
+    // Large blocks are whole vmalloc ranges and never grow in place: leave
+    // headroom so a buffer appended to a little at a time moves only
+    // O(log n) times.
+    size_t want = size;
+    if (size >= STELLOC_LARGE_THRESHOLD && size > old_size) want = size + size / 4;
+    void *new_ptr = malloc(want);
+    if (new_ptr == NULL && want != size) new_ptr = malloc(size);
+    if (new_ptr == NULL) {
+        return NULL; // Allocation failed; the old block is still valid
+    }
+    heapprof_retag(new_ptr, __builtin_return_address(0));
 
-    // Free the old block
+    // Copy only what the old block holds
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
     free(ptr);
 
     return new_ptr;
-}
\ No newline at end of file
+}
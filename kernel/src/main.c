@@ -34,8 +34,12 @@
 #include <stdatomic.h>
 #include <symbols.h>
 #include <alloc_debug.h>
+#include <slab.h>
 #include <sched.h>
 #include <smp.h>
+#include <mm_bench.h>
+#include <numa.h>
+#include <shrinker.h>
 
 
 // Halt and catch fire function.
@@ -52,12 +56,14 @@ static uint64_t monotonic_ms(void) {
     return timebase_monotonic_ns() / 1000000ULL;
 }
 
+#if ALLOC_DEBUG
 static bool check_bytes(const uint8_t *p, size_t n, uint8_t val) {
     for (size_t i = 0; i < n; i++) {
         if (p[i] != val) return false;
     }
     return true;
 }
+#endif
 
 static uint64_t task0_tick = 0;
 static uint64_t task1_tick = 0;
@@ -159,6 +165,16 @@ static void init_palloc(void) {
     success_printf("Page allocator initialized with %zu pages free.\n", palloc_get_free_page_count());
 }
 
+// The bootloader's framebuffer mapping has whatever memory type it chose;
+// console output is mostly framebuffer stores, so draw through WC instead.
+static void init_display_wc(void) {
+    if (displaystandard_map_wc()) {
+        success_printf("Framebuffer remapped write-combining.\n");
+    } else {
+        error_printf("Framebuffer WC remap failed; keeping the boot mapping.\n");
+    }
+}
+
 static void init_heap(void) {
     info_printf("Initializing stelloc heap allocator...\n");
     stelloc_init_heap();
@@ -170,7 +186,7 @@ static void init_heap(void) {
     uint8_t *a = malloc(24);      // slab-sized
     stack_check = (uintptr_t)a;
     uint8_t *b = malloc(64);      // slab-sized
-    uint8_t *c = malloc(2048);    // stelloc-sized (above SLAB_MAX_SIZE)
+    uint8_t *c = malloc(SLAB_MAX_SIZE + 1); // stelloc-sized
     halt_if(!a || !b || !c, "Heap allocator failed to return memory.");
 
 #if ALLOC_DEBUG
@@ -282,12 +298,14 @@ extern void kmain(void) {
 
     init_palloc();
     init_heap();
+    init_display_wc();
 
     init_pic();
     uint64_t tsc_hz = calibrate_tsc();
 
     info_printf("Initializing ACPI...\n");
     acpi_init();
+    numa_init();
 
     timebase_init(tsc_hz);
 
@@ -300,11 +318,16 @@ extern void kmain(void) {
     // Defer enabling interrupts until after IDT, exception handlers, and timers are configured.
     idt_enable_interrupts();
     success_printf("Interrupts enabled.\n");
+    // task_create() enables interrupts, so this waits until they are on.
+    shrinker_start_reclaimd();
 
     init_environment();
     seed_shared_time();
 
     smp_wait_all_aps();
+#if MM_BENCH
+    mm_bench_run();
+#endif
     scheduler_start();
 
     success_printf("Kernel initialization complete.\n");
@@ -0,0 +1,208 @@
+// NUMA topology. The SRAT gives the proximity domain of every CPU (by APIC
+// id) and of every memory range; the SLIT, when present, the distances
+// between domains. Domains get dense node ids in order of first appearance,
+// each node gets a fallback list sorted by distance, and palloc is told to
+// split its ranges along the node boundaries.
+
+#include <numa.h>
+#include <acpi.h>
+#include <palloc.h>
+#include <smp.h>
+#include <lprintf.h>
+#include <stdio.h>
+
+typedef struct numa_memblk {
+    uint64_t start, end;
+    uint32_t node;
+} numa_memblk_t;
+
+typedef struct numa_cpu {
+    uint32_t apic_id;
+    uint32_t node;
+} numa_cpu_t;
+
+static uint32_t nr_nodes = 1;
+static uint32_t node_pxm[NUMA_MAX_NODES];
+static numa_memblk_t memblks[NUMA_MAX_MEMBLKS];   // sorted by start
+static uint32_t nr_memblks;
+static numa_cpu_t cpus[SMP_MAX_CPUS];
+static uint32_t nr_cpus;
+static uint8_t distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+static uint32_t node_for_pxm(uint32_t pxm) {
+    for (uint32_t i = 0; i < nr_nodes; i++) {
+        if (node_pxm[i] == pxm) return i;
+    }
+    if (nr_nodes == NUMA_MAX_NODES) {
+        error_printf("numa: more than %u proximity domains, folding domain %u into node 0\n",
+                     (unsigned)NUMA_MAX_NODES, (unsigned)pxm);
+        return 0;
+    }
+    node_pxm[nr_nodes] = pxm;
+    return nr_nodes++;
+}
+
+static void add_memblk(uint64_t base, uint64_t len, uint32_t node) {
+    if (!len) return;
+    if (nr_memblks == NUMA_MAX_MEMBLKS) {
+        error_printf("numa: too many SRAT memory ranges, %#llx+%#llx left on node 0\n",
+                     (unsigned long long)base, (unsigned long long)len);
+        return;
+    }
+    uint32_t i = nr_memblks++;
+    while (i > 0 && memblks[i - 1].start > base) {
+        memblks[i] = memblks[i - 1];
+        i--;
+    }
+    memblks[i].start = base;
+    memblks[i].end = base + len;
+    memblks[i].node = node;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t node) {
+    if (nr_cpus < SMP_MAX_CPUS) {
+        cpus[nr_cpus].apic_id = apic_id;
+        cpus[nr_cpus].node = node;
+        nr_cpus++;
+    }
+}
+
+static void parse_srat(const acpi_srat_t *srat) {
+    // Domain ids are only known once seen, so node 0 is whatever comes first.
+    nr_nodes = 0;
+    const uint8_t *p = (const uint8_t *)srat + sizeof(acpi_srat_t);
+    const uint8_t *end = (const uint8_t *)srat + srat->hdr.length;
+    while (p + sizeof(acpi_srat_entry_hdr_t) <= end) {
+        const acpi_srat_entry_hdr_t *h = (const acpi_srat_entry_hdr_t *)p;
+        if (h->length == 0 || p + h->length > end) break;
+        if (h->type == ACPI_SRAT_TYPE_LAPIC_AFFINITY && h->length >= sizeof(acpi_srat_lapic_t)) {
+            const acpi_srat_lapic_t *e = (const acpi_srat_lapic_t *)p;
+            if (e->flags & ACPI_SRAT_ENABLED) {
+                uint32_t pxm = e->pxm_lo | ((uint32_t)e->pxm_hi[0] << 8) | ((uint32_t)e->pxm_hi[1] << 16) |
+                               ((uint32_t)e->pxm_hi[2] << 24);
+                add_cpu(e->apic_id, node_for_pxm(pxm));
+            }
+        } else if (h->type == ACPI_SRAT_TYPE_X2APIC_AFFINITY && h->length >= sizeof(acpi_srat_x2apic_t)) {
+            const acpi_srat_x2apic_t *e = (const acpi_srat_x2apic_t *)p;
+            if (e->flags & ACPI_SRAT_ENABLED) add_cpu(e->x2apic_id, node_for_pxm(e->pxm));
+        } else if (h->type == ACPI_SRAT_TYPE_MEMORY_AFFINITY && h->length >= sizeof(acpi_srat_memory_t)) {
+            const acpi_srat_memory_t *e = (const acpi_srat_memory_t *)p;
+            if (e->flags & ACPI_SRAT_ENABLED) add_memblk(e->base, e->length, node_for_pxm(e->pxm));
+        }
+        p += h->length;
+    }
+    if (nr_nodes == 0) nr_nodes = 1;
+}
+
+static void build_distances(const acpi_slit_t *slit) {
+    for (uint32_t a = 0; a < NUMA_MAX_NODES; a++) {
+        for (uint32_t b = 0; b < NUMA_MAX_NODES; b++) {
+            distance[a][b] = a == b ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+    if (slit) {
+        uint64_t n = slit->locality_count;
+        if (sizeof(acpi_slit_t) + n * n > slit->hdr.length) {
+            error_printf("numa: SLIT too short for %llu localities, ignored\n", (unsigned long long)n);
+        } else {
+            for (uint32_t a = 0; a < nr_nodes; a++) {
+                for (uint32_t b = 0; b < nr_nodes; b++) {
+                    if (node_pxm[a] < n && node_pxm[b] < n) {
+                        distance[a][b] = slit->entries[node_pxm[a] * n + node_pxm[b]];
+                    }
+                }
+            }
+        }
+    }
+    // Fallback order: by distance, then node id. Selection sort, at most 8.
+    for (uint32_t a = 0; a < nr_nodes; a++) {
+        bool used[NUMA_MAX_NODES] = { false };
+        for (uint32_t k = 0; k < nr_nodes; k++) {
+            uint32_t best = NUMA_MAX_NODES;
+            for (uint32_t b = 0; b < nr_nodes; b++) {
+                if (used[b]) continue;
+                // The local node goes first even if a broken SLIT says otherwise.
+                if (b == a) { best = b; break; }
+                if (best == NUMA_MAX_NODES || distance[a][b] < distance[a][best]) best = b;
+            }
+            used[best] = true;
+            fallback[a][k] = (uint8_t)best;
+        }
+    }
+}
+
+void numa_init(void) {
+    const acpi_srat_t *srat = acpi_srat();
+    nr_nodes = 1;
+    nr_memblks = nr_cpus = 0;
+    node_pxm[0] = 0;
+    if (srat) parse_srat(srat);
+    build_distances(srat ? acpi_slit() : NULL);
+    if (!srat) {
+        info_printf("numa: no SRAT, one node\n");
+        return;
+    }
+    palloc_numa_init();
+    numa_dump();
+}
+
+uint32_t numa_node_count(void) { return nr_nodes; }
+
+uint32_t numa_node_of_phys(uint64_t pa) {
+    for (uint32_t i = 0; i < nr_memblks; i++) {
+        if (pa < memblks[i].start) break;
+        if (pa < memblks[i].end) return memblks[i].node;
+    }
+    return 0;
+}
+
+uint64_t numa_node_boundary(uint64_t pa) {
+    for (uint32_t i = 0; i < nr_memblks; i++) {
+        if (pa < memblks[i].start) return memblks[i].start;
+        if (pa < memblks[i].end) return memblks[i].end;
+    }
+    return UINT64_MAX;
+}
+
+uint32_t numa_node_of_apic(uint32_t apic_id) {
+    for (uint32_t i = 0; i < nr_cpus; i++) {
+        if (cpus[i].apic_id == apic_id) return cpus[i].node;
+    }
+    return 0;
+}
+
+uint8_t numa_distance(uint32_t from, uint32_t to) {
+    if (from >= nr_nodes || to >= nr_nodes) return NUMA_REMOTE_DISTANCE;
+    return distance[from][to];
+}
+
+const uint8_t *numa_fallback(uint32_t node) {
+    return fallback[node < nr_nodes ? node : 0];
+}
+
+void numa_dump(void) {
+    for (uint32_t n = 0; n < nr_nodes; n++) {
+        uint32_t ncpu = 0;
+        for (uint32_t i = 0; i < nr_cpus; i++) ncpu += cpus[i].node == n;
+        size_t total = 0, free = 0;
+        palloc_node_pages(n, &total, &free);
+        info_printf("numa: node %u (pxm %u): %u cpus, %zu MiB (%zu MiB free)\n", (unsigned)n,
+                    (unsigned)node_pxm[n], (unsigned)ncpu, total >> 8, free >> 8);
+        for (uint32_t i = 0; i < nr_memblks; i++) {
+            if (memblks[i].node != n) continue;
+            info_printf("numa:   %#016llx-%#016llx\n", (unsigned long long)memblks[i].start,
+                        (unsigned long long)memblks[i].end);
+        }
+    }
+    if (nr_nodes > 1) {
+        for (uint32_t a = 0; a < nr_nodes; a++) {
+            char line[4 * NUMA_MAX_NODES + 1];
+            size_t len = 0;
+            for (uint32_t b = 0; b < nr_nodes; b++) {
+                len += (size_t)snprintf(line + len, sizeof(line) - len, " %3u", (unsigned)distance[a][b]);
+            }
+            info_printf("numa: distances from node %u:%s\n", (unsigned)a, line);
+        }
+    }
+}
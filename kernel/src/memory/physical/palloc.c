@@ -10,32 +10,79 @@
 #include <extendedint.h>
 #include <stdint.h>
 #include <lock.h>
+#include <cpu_local.h>
 #include <string.h>
+#include <shrinker.h>
+#include <numa.h>
+#include <lprintf.h>
 
 #define PAGE_SIZE 4096ULL
 #define PAGE_MASK (PAGE_SIZE - 1ULL)
 
 static ulong totalentrycount = 0;     // total memmap entries observed (debug)
 static ulong totalpagecount = 0;      // total USABLE pages managed by palloc
-static ulong freepagecount = 0;       // free pages available (ranges + free list)
+static ulong freepagecount = 0;       // free pages available (ranges + free lists)
 static ulong usedpagecount = 0;       // allocated pages (accounting only)
 
-// Head of the free list (HHDM-mapped address of a free page). The first
-// pointer-sized word in a free page stores the next pointer.
-static void *free_list_head = NULL;
+// Taken from the #PF demand-fault path and under other irq-saved mm locks,
+// so always held with interrupts disabled.
 static spinlock_t palloc_lock;
 
+// Page-type map: a directory of zeroed pages, each holding one type byte for
+// 4096 frames (16 MiB). Leaves are created on first use and never freed, so
+// readers need no lock.
+#define PT_LEAF_PAGES 4096ULL
+static uint8_t *page_types[PALLOC_PT_MAX_PHYS / (PT_LEAF_PAGES * PAGE_SIZE)];
+static spinlock_t page_type_lock;
+
 // Lazy allocation from usable ranges instead of pushing every page at init
 typedef struct {
     uint64_t start;   // inclusive physical address (aligned)
     uint64_t end;     // exclusive physical address (aligned)
     uint64_t cursor;  // next physical address to hand out
+    uint32_t node;
 } p_range_t;
 
-#define PALLOC_MAX_RANGES 128
-static p_range_t ranges[PALLOC_MAX_RANGES];
+// Most machines fit the static table. Larger memory maps get a table carved
+// from the front of a usable range; either way every usable range is kept.
+// The slack leaves room for palloc_numa_init() to split ranges at node
+// boundaries.
+#define PALLOC_STATIC_RANGES 128
+#define PALLOC_SPLIT_SLACK   (2 * NUMA_MAX_MEMBLKS)
+static p_range_t static_ranges[PALLOC_STATIC_RANGES];
+static p_range_t *ranges = static_ranges;
+static uint32_t range_cap = PALLOC_STATIC_RANGES;
 static uint32_t range_count = 0;
-static uint32_t range_curr = 0;
+
+// Per-node pool: a free list of returned pages (the first pointer-sized
+// word in a free page stores the next pointer) plus the node's slice of the
+// range table, which is sorted by node. Before palloc_numa_init() node 0
+// owns everything.
+typedef struct {
+    void *free_list;
+    uint32_t range_end, range_curr;
+    ulong total, free;
+    ulong allocs_local, allocs_remote;
+} p_node_t;
+
+static p_node_t nodes[NUMA_MAX_NODES];
+static uint32_t node_count = 1;
+
+// Pre-zeroed pages, linked through their first word (cleared again on the
+// way out). The pages count as allocated; the shrinker hands them back.
+static void *zero_pool;
+static size_t zero_pool_count;
+static spinlock_t zero_pool_lock;
+static uint64_t zero_hits, zero_misses, zero_filled;
+
+static size_t zero_pool_shrink(size_t target, void *ctx);
+static shrinker_t zero_pool_shrinker = { .name = "palloc-zero", .shrink = zero_pool_shrink, .order = 0 };
+
+// Reclaim watermarks (pages). Defaults scale with memory: low is 1/64 of
+// RAM clamped to [64, 16384] pages, min is half of low, high twice low.
+static size_t wmark_min = 0;
+static size_t wmark_low = 0;
+static size_t wmark_high = 0;
 
 static inline uint64_t align_up_u64(uint64_t x, uint64_t a) {
     return (x + (a - 1)) & ~(a - 1);
@@ -48,15 +95,28 @@ static inline void *phys_to_virt(uint64_t phys) {
     return (void *)(phys + hhdm_request.response->offset);
 }
 
+static inline uint64_t virt_to_phys(const void *virt) {
+    return (uint64_t)(uintptr_t)virt - hhdm_request.response->offset;
+}
+
+static bool usable_range(const struct limine_memmap_entry *e, uint64_t *start, uint64_t *end) {
+    if (e == NULL || e->type != LIMINE_MEMMAP_USABLE) return false;
+    *start = align_up_u64(e->base, PAGE_SIZE);
+    *end = align_down_u64(e->base + e->length, PAGE_SIZE);
+    return *end > *start;
+}
+
 void palloc_init(struct limine_memmap_response* memmap) {
     spinlock_init(&palloc_lock);
-    free_list_head = NULL;
+    spinlock_init(&page_type_lock);
+    spinlock_init(&zero_pool_lock);
     totalentrycount = 0;
     totalpagecount = 0;
     freepagecount = 0;
     usedpagecount = 0;
     range_count = 0;
-    range_curr = 0;
+    memset(nodes, 0, sizeof(nodes));
+    node_count = 1;
 
     if (memmap == NULL || memmap->entry_count == 0) {
         return;
@@ -64,72 +124,274 @@ void palloc_init(struct limine_memmap_response* memmap) {
 
     totalentrycount = (ulong)memmap->entry_count;
 
-    // Collect usable ranges lazily (no per-page touching)
+    // Size the range table first; carve it out of the first usable range
+    // big enough when the static one is too small.
+    uint64_t start, end;
+    uint32_t usable = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *e = memmap->entries[i];
-        if (e == NULL) continue;
-        if (e->type != LIMINE_MEMMAP_USABLE) continue;
+        if (usable_range(memmap->entries[i], &start, &end)) usable++;
+    }
+    uint64_t carve_base = 0, carve_bytes = 0;
+    bool carved = false; // carve_base can be physical 0
+    if (usable + PALLOC_SPLIT_SLACK > PALLOC_STATIC_RANGES) {
+        uint32_t cap = usable + PALLOC_SPLIT_SLACK;
+        carve_bytes = align_up_u64((uint64_t)cap * sizeof(p_range_t), PAGE_SIZE);
+        for (uint64_t i = 0; i < memmap->entry_count; i++) {
+            if (usable_range(memmap->entries[i], &start, &end) && end - start > carve_bytes) {
+                carve_base = start;
+                carved = true;
+                break;
+            }
+        }
+        if (carved) {
+            ranges = (p_range_t *)phys_to_virt(carve_base);
+            range_cap = cap;
+        }
+    }
 
-        uint64_t start = align_up_u64(e->base, PAGE_SIZE);
-        uint64_t end   = align_down_u64(e->base + e->length, PAGE_SIZE);
-        if (end <= start) continue;
+    // Collect usable ranges lazily (no per-page touching)
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        if (!usable_range(memmap->entries[i], &start, &end)) continue;
+        if (carved && start == carve_base) start += carve_bytes;
         uint64_t pages = (end - start) / PAGE_SIZE;
         totalpagecount += (ulong)pages;
-        if (range_count < PALLOC_MAX_RANGES) {
+        if (range_count < range_cap) {
             ranges[range_count].start = start;
             ranges[range_count].end = end;
             ranges[range_count].cursor = start;
+            ranges[range_count].node = 0;
             range_count++;
         } else {
-            // If too many ranges, conservatively skip adding; we still track totals.
-            // In the worst case this reduces available memory management but keeps booting.
+            // Only when no range could hold the table; the pages are not
+            // managed, so do not count them either.
+            totalpagecount -= (ulong)pages;
         }
     }
     // Initially, all pages are free (either as not-yet-handed-out range space or in the free list)
     freepagecount = totalpagecount;
+    nodes[0].range_end = range_count;
+    nodes[0].total = nodes[0].free = totalpagecount;
+
+    size_t low = (size_t)(totalpagecount / 64);
+    if (low < 64) low = 64;
+    if (low > 16384) low = 16384;
+    palloc_set_watermarks(low / 2, low, low * 2);
+    shrinker_register(&zero_pool_shrinker);
 }
 
-void* palloc_allocate_page(void) {
+static inline bool range_before(const p_range_t *a, const p_range_t *b) {
+    return a->node != b->node ? a->node < b->node : a->start < b->start;
+}
+
+void palloc_numa_init(void) {
+    uint64_t irq = cpu_irq_save();
     spin_lock(&palloc_lock);
-    // Prefer reusing freed pages
-    if (free_list_head != NULL) {
-        void *page = free_list_head;
-        void *next = *(void **)page;
-        free_list_head = next;
-        if (freepagecount > 0) freepagecount--; // consume one free page
-        usedpagecount++;
-        spin_unlock(&palloc_lock);
+    // Split ranges that straddle a node boundary; the pieces are appended
+    // and split again in turn.
+    for (uint32_t i = 0; i < range_count; i++) {
+        p_range_t *r = &ranges[i];
+        r->node = numa_node_of_phys(r->start);
+        uint64_t limit = align_down_u64(numa_node_boundary(r->start), PAGE_SIZE);
+        if (limit <= r->start || limit >= r->end) continue;
+        if (range_count == range_cap) {
+            error_printf("palloc: range table full, %#llx-%#llx stays on node %u\n",
+                         (unsigned long long)r->start, (unsigned long long)r->end, (unsigned)r->node);
+            continue;
+        }
+        p_range_t *tail = &ranges[range_count++];
+        tail->start = limit;
+        tail->end = r->end;
+        tail->cursor = r->cursor > limit ? r->cursor : limit;
+        r->end = limit;
+        if (r->cursor > limit) r->cursor = limit;
+    }
+    // Sort by (node, start): insertion sort over a few hundred entries at most.
+    for (uint32_t i = 1; i < range_count; i++) {
+        p_range_t r = ranges[i];
+        uint32_t j = i;
+        for (; j > 0 && range_before(&r, &ranges[j - 1]); j--) ranges[j] = ranges[j - 1];
+        ranges[j] = r;
+    }
+
+    // Rebuild the pools. Pages freed so far move to their node's list.
+    void *freed = NULL;
+    for (uint32_t n = 0; n < node_count; n++) {
+        while (nodes[n].free_list) {
+            void *page = nodes[n].free_list;
+            nodes[n].free_list = *(void **)page;
+            *(void **)page = freed;
+            freed = page;
+        }
+    }
+    memset(nodes, 0, sizeof(nodes));
+    node_count = numa_node_count();
+    for (uint32_t i = 0; i < range_count; i++) {
+        p_node_t *n = &nodes[ranges[i].node];
+        if (n->range_end == 0) n->range_curr = i;
+        n->range_end = i + 1;
+        n->total += (ulong)((ranges[i].end - ranges[i].start) / PAGE_SIZE);
+        n->free += (ulong)((ranges[i].end - ranges[i].cursor) / PAGE_SIZE);
+    }
+    while (freed) {
+        void *page = freed;
+        freed = *(void **)page;
+        p_node_t *n = &nodes[numa_node_of_phys(virt_to_phys(page))];
+        *(void **)page = n->free_list;
+        n->free_list = page;
+        n->free++;
+    }
+    spin_unlock(&palloc_lock);
+    cpu_irq_restore(irq);
+}
+
+void palloc_set_watermarks(size_t min, size_t low, size_t high) {
+    if (low < min) low = min;
+    if (high < low) high = low;
+    wmark_min = min;
+    wmark_low = low;
+    wmark_high = high;
+}
+
+size_t palloc_min_watermark(void) { return wmark_min; }
+
+size_t palloc_low_watermark(void) { return wmark_low; }
+size_t palloc_high_watermark(void) { return wmark_high; }
+
+// Called after an allocation: flag pressure once free memory dips below the
+// low watermark. The shrinkers run later from a safe point.
+static inline void check_watermark(void) {
+    if (freepagecount < wmark_low) shrinker_kick();
+}
+
+// Take a page from one node: freed pages first, then the node's ranges.
+static void *node_take_locked(p_node_t *n) {
+    if (n->free_list != NULL) {
+        void *page = n->free_list;
+        n->free_list = *(void **)page;
         return page;
     }
-    // Else allocate lazily from usable ranges
-    while (range_curr < range_count) {
-        p_range_t *r = &ranges[range_curr];
+    while (n->range_curr < n->range_end) {
+        p_range_t *r = &ranges[n->range_curr];
         if (r->cursor < r->end) {
             uint64_t phys = r->cursor;
             r->cursor += PAGE_SIZE;
-            if (freepagecount > 0) freepagecount--; // one less free page remaining
-            usedpagecount++;
-            void *page = phys_to_virt(phys);
-            spin_unlock(&palloc_lock);
-            return page;
+            return phys_to_virt(phys);
         }
         // Move to next range
-        range_curr++;
+        n->range_curr++;
+    }
+    return NULL;
+}
+
+void* palloc_allocate_page_node(uint32_t node) {
+    if (node >= node_count) node = 0;
+    const uint8_t *order = numa_fallback(node);
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&palloc_lock);
+    // Local node first, then the others by distance
+    for (uint32_t i = 0; i < node_count; i++) {
+        p_node_t *n = &nodes[order[i]];
+        void *page = node_take_locked(n);
+        if (page == NULL) continue;
+        if (n->free > 0) n->free--;
+        if (freepagecount > 0) freepagecount--; // consume one free page
+        usedpagecount++;
+        if (i == 0) nodes[node].allocs_local++;
+        else nodes[node].allocs_remote++;
+        spin_unlock(&palloc_lock);
+        cpu_irq_restore(irq);
+        check_watermark();
+        return page;
     }
     // Out of memory
     spin_unlock(&palloc_lock);
+    cpu_irq_restore(irq);
+    shrinker_kick();
     return NULL;
 }
 
+void* palloc_allocate_page(void) {
+    return palloc_allocate_page_node(numa_node_id());
+}
+
+static void *zero_pool_pop(void) {
+    if (!__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED)) return NULL;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&zero_pool_lock);
+    void *page = zero_pool;
+    if (page) {
+        zero_pool = *(void **)page;
+        zero_pool_count--;
+    }
+    spin_unlock(&zero_pool_lock);
+    cpu_irq_restore(irq);
+    if (page) *(void **)page = NULL;
+    return page;
+}
+
 void* palloc_zero_allocate_page(void) {
-    void *page = palloc_allocate_page();
+    void *page = zero_pool_pop();
+    if (page) {
+        __atomic_fetch_add(&zero_hits, 1, __ATOMIC_RELAXED);
+        return page;
+    }
+    page = palloc_allocate_page();
     if (page != NULL) {
         // Zero the page (use memset for speed)
         memset(page, 0, PAGE_SIZE);
+        __atomic_fetch_add(&zero_misses, 1, __ATOMIC_RELAXED);
     }
     return page;
 }
 
+size_t palloc_zero_refill(size_t max) {
+    size_t done = 0;
+    while (done < max && __atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) < PALLOC_ZERO_POOL_PAGES) {
+        // Zeroing ahead is only worth it while memory is plentiful.
+        if (freepagecount < wmark_high) break;
+        void *page = palloc_allocate_page();
+        if (!page) break;
+        memset(page, 0, PAGE_SIZE);
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&zero_pool_lock);
+        *(void **)page = zero_pool;
+        zero_pool = page;
+        zero_pool_count++;
+        spin_unlock(&zero_pool_lock);
+        cpu_irq_restore(irq);
+        done++;
+    }
+    if (done) __atomic_fetch_add(&zero_filled, done, __ATOMIC_RELAXED);
+    return done;
+}
+
+static size_t zero_pool_shrink(size_t target, void *ctx) {
+    (void)ctx;
+    uint64_t irq = cpu_irq_save();
+    if (!spin_trylock(&zero_pool_lock)) {
+        cpu_irq_restore(irq);
+        return 0;
+    }
+    void *list = NULL;
+    size_t n = 0;
+    while (zero_pool && n < target) {
+        void *page = zero_pool;
+        zero_pool = *(void **)page;
+        *(void **)page = list;
+        list = page;
+        n++;
+    }
+    zero_pool_count -= n;
+    spin_unlock(&zero_pool_lock);
+    cpu_irq_restore(irq);
+    while (list) {
+        void *page = list;
+        list = *(void **)page;
+        palloc_free_page(page);
+    }
+    return n;
+}
+
 void palloc_free_page(void* page) {
     if (page == NULL) return;
     // Ensure alignment
@@ -138,37 +400,85 @@ void palloc_free_page(void* page) {
         // Not page-aligned, ignore.
         return;
     }
-    // Push back onto the free list
+    // Push back onto the free list of the page's node
+    uint32_t node = node_count > 1 ? numa_node_of_phys(virt_to_phys(page)) : 0;
+    uint64_t irq = cpu_irq_save();
     spin_lock(&palloc_lock);
-    *(void **)page = free_list_head;
-    free_list_head = page;
+    p_node_t *n = &nodes[node];
+    *(void **)page = n->free_list;
+    n->free_list = page;
+    n->free++;
     freepagecount++;
     if (usedpagecount > 0) usedpagecount--;
     spin_unlock(&palloc_lock);
+    cpu_irq_restore(irq);
+}
+
+static uint8_t *page_type_leaf(uint64_t idx, bool create) {
+    uint8_t **slot = &page_types[idx / PT_LEAF_PAGES];
+    uint8_t *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (leaf || !create) return leaf;
+    // The leaf itself comes from palloc: not under palloc_lock.
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&page_type_lock);
+    leaf = *slot;
+    if (!leaf) {
+        leaf = (uint8_t *)palloc_zero_allocate_page();
+        __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&page_type_lock);
+    cpu_irq_restore(irq);
+    return leaf;
+}
+
+bool palloc_set_page_type(void *page, size_t npages, uint8_t type) {
+    uint64_t phys = virt_to_phys(page);
+    if ((uintptr_t)page < hhdm_request.response->offset || (phys & PAGE_MASK)) return false;
+    uint64_t idx = phys / PAGE_SIZE;
+    if (npages > PALLOC_PT_MAX_PHYS / PAGE_SIZE - idx || idx >= PALLOC_PT_MAX_PHYS / PAGE_SIZE) return false;
+    for (size_t i = 0; i < npages; i++, idx++) {
+        // Clearing a frame that was never tagged needs no leaf.
+        uint8_t *leaf = page_type_leaf(idx, type != 0);
+        if (leaf) leaf[idx % PT_LEAF_PAGES] = type;
+        else if (type != 0) return false;
+    }
+    return true;
+}
+
+uint8_t palloc_page_type(const void *ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr < hhdm_request.response->offset) return 0;
+    uint64_t idx = (addr - hhdm_request.response->offset) / PAGE_SIZE;
+    if (idx >= PALLOC_PT_MAX_PHYS / PAGE_SIZE) return 0;
+    uint8_t *leaf = page_type_leaf(idx, false);
+    return leaf ? leaf[idx % PT_LEAF_PAGES] : 0;
+}
+
+static bool on_free_list(const void *page) {
+    for (uint32_t n = 0; n < node_count; n++) {
+        for (void *it = nodes[n].free_list; it != NULL; it = *(void **)it) {
+            if (it == page) return true;
+        }
+    }
+    return false;
 }
 
 bool palloc_is_page_allocated(void* page) {
     if (page == NULL) return false;
     // Convert to phys to check lazy ranges
-    uint64_t phys = (uint64_t)(unsigned long long)page - hhdm_request.response->offset;
+    uint64_t phys = virt_to_phys(page);
     // First, check if it lies within any managed range
     for (uint32_t i = 0; i < range_count; ++i) {
         p_range_t *r = &ranges[i];
         if (phys >= r->start && phys < r->end) {
             // If not yet handed out, it's free
             if (phys >= r->cursor) return false;
-            // If handed out before, check if it was freed back into free list
-            for (void *it = free_list_head; it != NULL; it = *(void **)it) {
-                if (it == page) return false;
-            }
-            return true; // handed out and not in free list => allocated
+            // Handed out and not in a free list => allocated
+            return !on_free_list(page);
         }
     }
     // Not in managed ranges: fallback to free list scan (could be manually freed non-managed page)
-    for (void *it = free_list_head; it != NULL; it = *(void **)it) {
-        if (it == page) return false;
-    }
-    return true;
+    return !on_free_list(page);
 }
 
 size_t palloc_get_free_page_count(void) {
@@ -181,4 +491,24 @@ size_t palloc_get_total_page_count(void) {
 
 size_t palloc_get_used_page_count(void) {
     return (size_t)usedpagecount;
-}
\ No newline at end of file
+}
+
+void palloc_node_pages(uint32_t node, size_t *total, size_t *free) {
+    if (node >= node_count) { *total = *free = 0; return; }
+    *total = (size_t)nodes[node].total;
+    *free = (size_t)nodes[node].free;
+}
+
+void palloc_dump_nodes(void) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        p_node_t *n = &nodes[i];
+        info_printf("palloc: node %u: %llu/%llu pages free, allocs %llu local, %llu from other nodes\n",
+                    (unsigned)i, (unsigned long long)n->free, (unsigned long long)n->total,
+                    (unsigned long long)n->allocs_local, (unsigned long long)n->allocs_remote);
+    }
+    info_printf("palloc: zero pool: %zu pages, %llu zeroed ahead, %llu hits, %llu misses\n",
+                __atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&zero_filled, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&zero_hits, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&zero_misses, __ATOMIC_RELAXED));
+}
@@ -1,5 +1,34 @@
-// Stelloc: simple free-list allocator that grows by acquiring pages from palloc.
-// Block layout in free list: [size (ulong)] [next (ulong)] ...payload...
+// Stelloc: general-purpose heap for allocations too large for the slab
+// caches. It is a TLSF (two-level segregated fit) allocator: free blocks are
+// binned by size into FL_COUNT power-of-two ranges, each split into SL_COUNT
+// linear steps, with a bitmap per level so finding a fitting bin is two
+// bit scans. Every block carries a boundary tag (the header below), so both
+// neighbours are reachable in O(1) and free coalesces immediately. Allocation
+// and free cost does not depend on how fragmented the heap is.
+//
+// Block layout: [prev_phys][size | arena | flags] payload...
+// 'prev_phys' is only meaningful while the previous block is free. Free
+// blocks keep their bin links in the first 16 payload bytes. Each pool (a
+// region taken from vheap or palloc) starts with a stelloc_pool_t linking it
+// into its arena's pool list and ends with a zero-sized used sentinel; a
+// pool that is one free block again can be handed back under memory
+// pressure.
+//
+// The heap is split into STELLOC_ARENAS arenas, each with its own bins,
+// pools and lock; CPU n allocates from arena n % STELLOC_ARENAS. Every block
+// records its arena in the top byte of its size word. A free on the owning
+// CPU goes straight back into the bins; a free from any other CPU is pushed
+// onto the owner's lock-free remote list and merged the next time the owner
+// takes its lock, so CPUs never contend on each other's arena locks.
+//
+// An arena that runs out of space adds a pool whose size is picked by an
+// adaptive controller (see grow_plan()): bursts double it, idle time and
+// memory pressure shrink it back.
+//
+// Requests of STELLOC_LARGE_THRESHOLD bytes or more never enter the arenas:
+// they get a page-granular vmalloc range each, so a freed buffer leaves no
+// large free block behind to be split up by small requests. Zeroed large
+// requests get pages that arrive already zero.
 
 #include <stelloc.h>
 #include <palloc.h>
@@ -11,320 +40,796 @@
 #include <vmm.h>
 #include <stdint.h>
 #include <alloc_debug.h>
-
-#define FREE_HEADER_SIZE  (sizeof(ulong) * 2) // size + next
-
-typedef struct stelloc_hdr {
-    ulong size; // requested size (aligned)
-#if ALLOC_DEBUG
+#include <cpu_local.h>
+#include <lprintf.h>
+#include <kfence.h>
+#include <shrinker.h>
+#include <timebase.h>
+#include <string.h>
+
+typedef struct tlsf_block {
+    struct tlsf_block *prev_phys;
+    ulong size;                      // payload bytes | arena << 56 | BLOCK_* flags
+    struct tlsf_block *next_free;    // free blocks only
+    struct tlsf_block *prev_free;
+} tlsf_block_t;
+
+#define BLOCK_FREE       0x1UL
+#define BLOCK_PREV_FREE  0x2UL
+#define BLOCK_FLAGS      0x3UL
+#define BLOCK_ARENA_SHIFT 56
+#define BLOCK_ARENA_MASK (0xFFUL << BLOCK_ARENA_SHIFT)
+#define BLOCK_SIZE_MASK  (~(BLOCK_ARENA_MASK | BLOCK_FLAGS))
+
+#define BLOCK_HDR_SIZE   (2 * sizeof(ulong))  // prev_phys + size
+#define BLOCK_ALIGN      16UL
+#define BLOCK_MIN_SIZE   (2 * sizeof(void *)) // room for the free links
+
+// Size classes: sizes below SMALL_BLOCK_SIZE are binned linearly in
+// BLOCK_ALIGN steps in the first row; above it each power of two is split
+// into SL_COUNT bins.
+#define SL_INDEX_LOG2    5
+#define SL_COUNT         (1U << SL_INDEX_LOG2)
+#define ALIGN_LOG2       4
+#define FL_INDEX_SHIFT   (SL_INDEX_LOG2 + ALIGN_LOG2)
+#define FL_INDEX_MAX     36                  // largest block: 64 GiB
+#define FL_COUNT         (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1UL << FL_INDEX_SHIFT)
+
+// Growth granularity per fixed mode, in pages.
+#define GROW_PAGES_DUMB        1
+#define GROW_PAGES_SMART       4
+#define GROW_PAGES_AGGRESSIVE  16
+
+// Adaptive growth: bounds of the per-arena batch and the time scales it
+// reacts to.
+#define GROW_PAGES_MIN   4
+#define GROW_PAGES_MAX   256                          // 1 MiB pools
+#define GROW_BURST_NS    (2ULL * 1000 * 1000)         // growing again this soon doubles
+#define GROW_WINDOW_NS   (50ULL * 1000 * 1000)        // a batch should last this long
+#define GROW_IDLE_NS     (1000ULL * 1000 * 1000)      // each idle period halves
+
+// With ALLOC_DEBUG every payload is framed as
+// [stelloc_dbg_t][front redzone] user bytes [back redzone].
+typedef struct stelloc_dbg {
     uint32_t magic;
     uint32_t requested;
-#endif
-} stelloc_hdr_t;
+    ulong size;            // user size rounded to BLOCK_ALIGN
+} stelloc_dbg_t;
 
 #if ALLOC_DEBUG
-#define ALLOC_HEADER_SIZE (sizeof(stelloc_hdr_t) + ALLOC_REDZONE_SIZE)
+#define ALLOC_HEADER_SIZE (sizeof(stelloc_dbg_t) + ALLOC_REDZONE_SIZE)
 #define ALLOC_TAIL_REDZONE ALLOC_REDZONE_SIZE
 #else
-#define ALLOC_HEADER_SIZE (sizeof(stelloc_hdr_t))
+#define ALLOC_HEADER_SIZE 0UL
 #define ALLOC_TAIL_REDZONE 0
 #endif
 #define ALLOC_OVERHEAD (ALLOC_HEADER_SIZE + ALLOC_TAIL_REDZONE)
-#define ALIGN8(x) (((x) + 7UL) & ~7UL)
-
-static ulong FreeListHead = 0;   // pointer to first free block (virtual)
-static int g_mode = STELLOC_SMART;
-// Tail bump region taken from a free block to pack small allocations tightly.
-static ulong TailPtr = 0;
-static ulong TailSize = 0;
-static spinlock_t stelloc_lock;
+#define ALIGN16(x) (((x) + (BLOCK_ALIGN - 1)) & ~(BLOCK_ALIGN - 1))
+
+// Pool header; 16 bytes so the first block stays BLOCK_ALIGN-aligned.
+typedef struct stelloc_pool {
+    struct stelloc_pool *next;
+    ulong bytes;
+} stelloc_pool_t;
+
+typedef struct stelloc_arena {
+    spinlock_t lock;
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    tlsf_block_t *bins[FL_COUNT][SL_COUNT];
+    tlsf_block_t *remote;            // blocks freed by other CPUs (lock-free push)
+    stelloc_pool_t *pools;
+    uint64_t allocs, frees, remote_frees, pool_bytes;
+    uint64_t alloc_bytes;            // block bytes handed out, ever
+    // Growth controller (STELLOC_ADAPTIVE), under 'lock'.
+    uint32_t grow_batch;             // pages in the next pool
+    uint64_t grow_last_ns;           // time of the last growth, 0: none yet
+    uint64_t grow_mark;              // alloc_bytes at the last growth
+    uint64_t grows, grow_pages, grow_up, grow_down, grow_hold;
+} __attribute__((aligned(64))) stelloc_arena_t;
+
+static stelloc_arena_t arenas[STELLOC_ARENAS];
+static int g_mode = STELLOC_ADAPTIVE;
+static bool g_direct = true;  // one-page pools from the HHDM, not vheap
 
 static inline ulong ptr_to_ulong(void *p) { return (ulong)(uintptr_t)p; }
 static inline void *ulong_to_ptr(ulong v) { return (void *)(uintptr_t)v; }
 
-#if ALLOC_DEBUG
-static void stelloc_stamp(ulong block, size_t size, size_t requested) {
-    stelloc_hdr_t *hdr = (stelloc_hdr_t *)block;
-    hdr->size = (ulong)size;
-    hdr->magic = ALLOC_DBG_MAGIC;
-    hdr->requested = (uint32_t)requested;
-    uint8_t *front = (uint8_t *)hdr + sizeof(stelloc_hdr_t);
-    uint8_t *payload = (uint8_t *)block + ALLOC_HEADER_SIZE;
-    uint8_t *back = payload + size;
-    alloc_dbg_fill(front, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE);
-    alloc_dbg_fill(payload, size, ALLOC_POISON_ALLOC);
-    if (ALLOC_TAIL_REDZONE) {
-        alloc_dbg_fill(back, ALLOC_TAIL_REDZONE, ALLOC_REDZONE_BYTE);
-    }
+static inline ulong block_size(const tlsf_block_t *b) { return b->size & BLOCK_SIZE_MASK; }
+// Callable without the arena lock: the owner may be flipping the flag bits
+// of the same word, but the arena bits never change.
+static inline stelloc_arena_t *block_arena(const tlsf_block_t *b) {
+    ulong size = __atomic_load_n(&b->size, __ATOMIC_RELAXED);
+    return &arenas[(size & BLOCK_ARENA_MASK) >> BLOCK_ARENA_SHIFT];
+}
+static inline bool block_is_free(const tlsf_block_t *b) { return (b->size & BLOCK_FREE) != 0; }
+static inline bool block_prev_is_free(const tlsf_block_t *b) { return (b->size & BLOCK_PREV_FREE) != 0; }
+static inline void *block_payload(tlsf_block_t *b) { return (uint8_t *)b + BLOCK_HDR_SIZE; }
+static inline tlsf_block_t *block_from_payload(void *p) { return (tlsf_block_t *)((uint8_t *)p - BLOCK_HDR_SIZE); }
+static inline tlsf_block_t *block_next(tlsf_block_t *b) {
+    return (tlsf_block_t *)((uint8_t *)block_payload(b) + block_size(b));
 }
 
-static void stelloc_check_and_poison_free(void *payload, size_t size) {
-    ulong block = ptr_to_ulong(payload) - ALLOC_HEADER_SIZE;
-    stelloc_hdr_t *hdr = (stelloc_hdr_t *)block;
-    if (hdr->magic != ALLOC_DBG_MAGIC) {
-        alloc_debug_fail("stelloc free: magic corrupt", payload);
-    }
-    uint8_t *front = (uint8_t *)hdr + sizeof(stelloc_hdr_t);
-    uint8_t *back = (uint8_t *)payload + size;
-    if (!alloc_dbg_check(front, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE)) {
-        alloc_debug_fail("stelloc free: front redzone corrupt", payload);
+static inline void block_set_size(tlsf_block_t *b, ulong size) { b->size = size | (b->size & ~BLOCK_SIZE_MASK); }
+
+// Flip the free bit of 'b' and mirror it into the next block's tag.
+static inline void block_mark_free(tlsf_block_t *b) {
+    tlsf_block_t *next = block_next(b);
+    next->prev_phys = b;
+    next->size |= BLOCK_PREV_FREE;
+    b->size |= BLOCK_FREE;
+}
+
+static inline void block_mark_used(tlsf_block_t *b) {
+    block_next(b)->size &= ~BLOCK_PREV_FREE;
+    b->size &= ~BLOCK_FREE;
+}
+
+static inline int fls_ulong(ulong x) { return 63 - __builtin_clzl(x); }
+
+// Bin of a free block of exactly 'size' bytes.
+static inline void mapping_insert(ulong size, int *fl, int *sl) {
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = (int)(size / (SMALL_BLOCK_SIZE / SL_COUNT));
+    } else {
+        int f = fls_ulong(size);
+        *sl = (int)((size >> (f - SL_INDEX_LOG2)) ^ (1UL << SL_INDEX_LOG2));
+        *fl = f - (FL_INDEX_SHIFT - 1);
     }
-    if (ALLOC_TAIL_REDZONE && !alloc_dbg_check(back, ALLOC_TAIL_REDZONE, ALLOC_REDZONE_BYTE)) {
-        alloc_debug_fail("stelloc free: back redzone corrupt", payload);
+}
+
+// Round 'size' up to the start of the next bin, so any block found in that
+// bin or above fits without walking the bin.
+static inline ulong search_size(ulong size) {
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += (1UL << (fls_ulong(size) - SL_INDEX_LOG2)) - 1;
     }
-    alloc_dbg_fill(payload, size, ALLOC_POISON_FREE);
+    return size;
 }
-#else
-static inline void stelloc_stamp(ulong block, size_t size, size_t requested) {
-    (void)requested;
-    *(ulong *)block = (ulong)size;
+
+// First bin whose every block can hold 'size' bytes. Returns false when
+// 'size' is beyond the largest class.
+static inline bool mapping_search(ulong size, int *fl, int *sl) {
+    mapping_insert(search_size(size), fl, sl);
+    return *fl < (int)FL_COUNT;
 }
-static inline void stelloc_check_and_poison_free(void *payload, size_t size) {
-    (void)payload; (void)size;
+
+static void bin_remove(stelloc_arena_t *a, tlsf_block_t *b, int fl, int sl) {
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else {
+        a->bins[fl][sl] = b->next_free;
+        if (!a->bins[fl][sl]) {
+            a->sl_bitmap[fl] &= ~(1U << sl);
+            if (!a->sl_bitmap[fl]) a->fl_bitmap &= ~(1U << fl);
+        }
+    }
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
 }
-#endif
 
-// Insert a free block in address-sorted order and coalesce with neighbors.
-static void insert_free_sorted(void *addr, ulong size) {
-    ulong block = ptr_to_ulong(addr);
-    ulong end = block + size;
+static void bin_insert(stelloc_arena_t *a, tlsf_block_t *b) {
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+    b->prev_free = NULL;
+    b->next_free = a->bins[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    a->bins[fl][sl] = b;
+    a->fl_bitmap |= 1U << fl;
+    a->sl_bitmap[fl] |= 1U << sl;
+}
 
-    // Empty list
-    if (FreeListHead == 0) {
-        *(ulong *)block = size;
-        *((ulong *)block + 1) = 0;
-        FreeListHead = block;
-        return;
-    }
+static inline void bin_unlink(stelloc_arena_t *a, tlsf_block_t *b) {
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+    bin_remove(a, b, fl, sl);
+}
 
-    // Insert at head if before current head
-    if (block < FreeListHead) {
-        // Try coalesce with old head if adjacent
-        ulong head = FreeListHead;
-        if (end == head) {
-            size += *(ulong *)head;
-            *(ulong *)block = size;
-            *((ulong *)block + 1) = *((ulong *)head + 1);
-            FreeListHead = block;
-            return;
-        }
-        *(ulong *)block = size;
-        *((ulong *)block + 1) = FreeListHead;
-        FreeListHead = block;
-        return;
+// Take a free block of at least 'size' bytes out of its bin, or NULL.
+static tlsf_block_t *locate_free(stelloc_arena_t *a, ulong size) {
+    int fl, sl;
+    if (!mapping_search(size, &fl, &sl)) return NULL;
+    uint32_t sl_map = a->sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint32_t fl_map = a->fl_bitmap & (~0U << (fl + 1));
+        if (!fl_map) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = a->sl_bitmap[fl];
     }
+    sl = __builtin_ctz(sl_map);
+    tlsf_block_t *b = a->bins[fl][sl];
+    bin_remove(a, b, fl, sl);
+    return b;
+}
 
-    // Find insertion point: prev < block <= curr
-    ulong prev = FreeListHead;
-    ulong curr = *((ulong *)prev + 1);
-    while (curr != 0 && curr < block) {
-        prev = curr;
-        curr = *((ulong *)curr + 1);
+// Merge free neighbours into 'b' (not in the bins) and return the result.
+static tlsf_block_t *block_merge(stelloc_arena_t *a, tlsf_block_t *b) {
+    if (block_prev_is_free(b)) {
+        tlsf_block_t *prev = b->prev_phys;
+        bin_unlink(a, prev);
+        block_set_size(prev, block_size(prev) + BLOCK_HDR_SIZE + block_size(b));
+        b = prev;
+    }
+    tlsf_block_t *next = block_next(b);
+    if (block_is_free(next)) {
+        bin_unlink(a, next);
+        block_set_size(b, block_size(b) + BLOCK_HDR_SIZE + block_size(next));
     }
+    return b;
+}
 
-    // Check coalesce with prev (prev_end == block)
-    ulong prev_size = *(ulong *)prev;
-    ulong prev_end = prev + prev_size;
-    if (prev_end == block) {
-        // Merge into prev
-        *(ulong *)prev = prev_size + size;
-        // Also try to merge with curr if now adjacent
-        if (curr != 0) {
-            ulong curr_size = *(ulong *)curr;
-            if (prev + *(ulong *)prev == curr) { // prev_end(updated) == curr
-                *(ulong *)prev += curr_size;
-                *((ulong *)prev + 1) = *((ulong *)curr + 1);
-            }
-        }
-        return;
+// Trim 'b' (out of the bins or in use) to 'size' and return the tail to the
+// bins when it is large enough to be a block of its own. The tail merges
+// with a free block after it, which only exists when shrinking a used block.
+static void block_trim(stelloc_arena_t *a, tlsf_block_t *b, ulong size) {
+    ulong total = block_size(b);
+    if (total < size + BLOCK_HDR_SIZE + BLOCK_MIN_SIZE) return;
+    block_set_size(b, size);
+    tlsf_block_t *rest = block_next(b);
+    // Same arena as 'b'; no PREV_FREE since 'b' is (about to be) used
+    rest->size = (total - size - BLOCK_HDR_SIZE) | (b->size & BLOCK_ARENA_MASK);
+    rest = block_merge(a, rest);
+    block_mark_free(rest);
+    bin_insert(a, rest);
+}
+
+// Return a used block to 'a' (locked), coalescing with its neighbours.
+static void arena_release(stelloc_arena_t *a, tlsf_block_t *b) {
+    b = block_merge(a, b);
+    block_mark_free(b);
+    bin_insert(a, b);
+    a->frees++;
+}
+
+// Merge the blocks other CPUs have freed into 'a' (locked).
+static void arena_drain_remote(stelloc_arena_t *a) {
+    if (!__atomic_load_n(&a->remote, __ATOMIC_RELAXED)) return;
+    tlsf_block_t *b = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while (b) {
+        tlsf_block_t *next = b->next_free;
+        arena_release(a, b);
+        b = next;
     }
+}
 
-    // No merge with prev, insert between prev and curr
-    *(ulong *)block = size;
-    *((ulong *)block + 1) = curr;
-    *((ulong *)prev + 1) = block;
-
-    // Coalesce with curr if adjacent (end == curr)
-    if (curr != 0) {
-        if (end == curr) {
-            ulong curr_size = *(ulong *)curr;
-            *(ulong *)block = size + curr_size;
-            *((ulong *)block + 1) = *((ulong *)curr + 1);
+static void arena_push_remote(stelloc_arena_t *a, tlsf_block_t *b) {
+    tlsf_block_t *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        b->next_free = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, b, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&a->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+static inline stelloc_arena_t *local_arena(void) {
+    return &arenas[cpu_local_index() % STELLOC_ARENAS];
+}
+
+static inline tlsf_block_t *pool_first(stelloc_pool_t *pool) {
+    return (tlsf_block_t *)(pool + 1);
+}
+
+static inline ulong pool_block_size(ulong bytes) {
+    return (bytes - sizeof(stelloc_pool_t) - 2 * BLOCK_HDR_SIZE) & ~(BLOCK_ALIGN - 1);
+}
+
+// Hand [va, va + bytes) to arena 'a' as a new pool.
+static void pool_add(stelloc_arena_t *a, ulong va, ulong bytes) {
+    ulong tag = (ulong)(a - arenas) << BLOCK_ARENA_SHIFT;
+    stelloc_pool_t *pool = (stelloc_pool_t *)ulong_to_ptr(va);
+    pool->bytes = bytes;
+    pool->next = a->pools;
+    a->pools = pool;
+    tlsf_block_t *b = pool_first(pool);
+    b->prev_phys = NULL;
+    b->size = pool_block_size(bytes) | tag;
+    tlsf_block_t *sentinel = block_next(b);
+    sentinel->size = tag; // used, zero-sized: stops merging at the pool end
+    block_mark_free(b);
+    bin_insert(a, b);
+    a->pool_bytes += bytes;
+    a->grows++;
+    a->grow_pages += bytes / 4096;
+}
+
+static inline void pool_add_locked(stelloc_arena_t *a, ulong va, ulong bytes) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&a->lock);
+    pool_add(a, va, bytes);
+    spin_unlock(&a->lock);
+    cpu_irq_restore(irq);
+}
+
+// Pick the size of the next pool of 'a' (locked) from how it has been
+// growing. Growing again within GROW_BURST_NS doubles the batch. Otherwise
+// the bytes allocated since the last growth give the arena's allocation
+// rate: the batch doubles while it would last less than GROW_WINDOW_NS at
+// that rate and halves when it would last four times as long. An arena that
+// did not grow for GROW_IDLE_NS halves its batch once per idle period, and
+// memory pressure drops it to the minimum. 'now' is 0 until the timebase
+// runs, which keeps the batch as it is.
+static size_t grow_plan(stelloc_arena_t *a, uint64_t now, bool pressure) {
+    uint32_t batch = a->grow_batch;
+    if (pressure) {
+        batch = GROW_PAGES_MIN;
+    } else if (now && a->grow_last_ns) {
+        uint64_t dt = now - a->grow_last_ns;
+        if (dt < GROW_BURST_NS) {
+            batch *= 2;
+        } else if (dt >= GROW_IDLE_NS) {
+            uint64_t idle = dt / GROW_IDLE_NS;
+            batch >>= idle < 8 ? idle : 8;
+        } else {
+            uint64_t want = (a->alloc_bytes - a->grow_mark) * (GROW_WINDOW_NS / 1000) / (dt / 1000) / 4096;
+            if (want > batch) batch *= 2;
+            else if (want < batch / 4) batch /= 2;
         }
+        if (batch < GROW_PAGES_MIN) batch = GROW_PAGES_MIN;
+        if (batch > GROW_PAGES_MAX) batch = GROW_PAGES_MAX;
     }
+    if (batch > a->grow_batch) a->grow_up++;
+    else if (batch < a->grow_batch) a->grow_down++;
+    else a->grow_hold++;
+    a->grow_batch = batch;
+    if (now) a->grow_last_ns = now;
+    a->grow_mark = a->alloc_bytes;
+    return batch;
 }
 
-static void grow_heap(ulong min_bytes) {
-    // Decide how many pages to acquire
-    size_t pages = 1;
-    if (g_mode == STELLOC_SMART) pages = 4;
-    else if (g_mode == STELLOC_AGGRESSIVE) pages = 16;
-
-    // Ensure we cover min_bytes
-    size_t need_pages = (size_t)((min_bytes + (4096 - 1)) / 4096);
+// Add at least 'need' bytes of block space to 'a'. Called without the arena
+// lock: vheap_commit() may purge and wait on TLB shootdowns.
+static bool grow_arena(stelloc_arena_t *a, ulong need) {
+    bool pressure = mem_pressure() != MEM_PRESSURE_NONE;
+    size_t pages = GROW_PAGES_DUMB;
+    if (g_mode == STELLOC_ADAPTIVE) {
+        uint64_t now = timebase_monotonic_ns();
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&a->lock);
+        pages = grow_plan(a, now, pressure);
+        spin_unlock(&a->lock);
+        cpu_irq_restore(irq);
+    } else if (g_mode == STELLOC_SMART) pages = GROW_PAGES_SMART;
+    else if (g_mode == STELLOC_AGGRESSIVE) pages = GROW_PAGES_AGGRESSIVE;
+    // Under memory pressure take only what this request needs.
+    if (pressure) pages = GROW_PAGES_DUMB;
+
+    // The pool block must land in a bin that locate_free() will search.
+    size_t need_pages = (size_t)((search_size(need) + sizeof(stelloc_pool_t) + 2 * BLOCK_HDR_SIZE + 4095) / 4096);
     if (need_pages > pages) pages = need_pages;
 
-    // Try to batch pages contiguously when possible; we still accept non-contiguous pages
-    // by c..c...alescing? (I still can't spell it.) adjacent ones into larger blocks.
+    // A one-page pool needs no virtual contiguity: use the frame's HHDM
+    // address and leave the page tables alone.
+    if (pages == 1 && g_direct) {
+        void *pg = palloc_allocate_page();
+        if (pg) {
+            pool_add_locked(a, ptr_to_ulong(pg), 4096);
+            return true;
+        }
+    }
+    uint64_t va = vheap_commit(pages * 4096);
+    if (va) {
+        pool_add_locked(a, va, pages * 4096);
+        return true;
+    }
+    // No vheap: fall back to direct-map pages, which only serve one-page blocks.
+    if (need_pages > 1) return false;
+    bool any = false;
     for (size_t i = 0; i < pages; i++) {
         void *pg = palloc_allocate_page();
         if (!pg) break;
-        insert_free_sorted(pg, 4096UL);
+        pool_add_locked(a, ptr_to_ulong(pg), 4096);
+        any = true;
     }
+    return any;
+}
+
+#if ALLOC_DEBUG
+static void stelloc_stamp(void *payload, size_t size, size_t requested) {
+    stelloc_dbg_t *dbg = (stelloc_dbg_t *)payload;
+    dbg->magic = ALLOC_DBG_MAGIC;
+    dbg->requested = (uint32_t)requested;
+    dbg->size = (ulong)size;
+    uint8_t *front = (uint8_t *)payload + sizeof(stelloc_dbg_t);
+    uint8_t *user = (uint8_t *)payload + ALLOC_HEADER_SIZE;
+    alloc_dbg_fill(front, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE);
+    alloc_dbg_fill(user, size, ALLOC_POISON_ALLOC);
+    alloc_dbg_fill(user + size, ALLOC_TAIL_REDZONE, ALLOC_REDZONE_BYTE);
 }
 
+static void stelloc_check_and_poison_free(void *user) {
+    stelloc_dbg_t *dbg = (stelloc_dbg_t *)((uint8_t *)user - ALLOC_HEADER_SIZE);
+    if (dbg->magic != ALLOC_DBG_MAGIC) {
+        alloc_debug_fail("stelloc free: magic corrupt", user);
+    }
+    uint8_t *front = (uint8_t *)dbg + sizeof(stelloc_dbg_t);
+    uint8_t *back = (uint8_t *)user + dbg->size;
+    if (!alloc_dbg_check(front, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE)) {
+        alloc_debug_fail("stelloc free: front redzone corrupt", user);
+    }
+    if (!alloc_dbg_check(back, ALLOC_TAIL_REDZONE, ALLOC_REDZONE_BYTE)) {
+        alloc_debug_fail("stelloc free: back redzone corrupt", user);
+    }
+    alloc_dbg_fill(user, dbg->size, ALLOC_POISON_FREE);
+    dbg->magic = 0; // catch double frees
+}
+
+// Resize a live block's debug frame: poison any new bytes and move the back
+// redzone.
+static void stelloc_restamp(void *payload, size_t size, size_t requested) {
+    stelloc_dbg_t *dbg = (stelloc_dbg_t *)payload;
+    uint8_t *user = (uint8_t *)payload + ALLOC_HEADER_SIZE;
+    if (size > dbg->size) alloc_dbg_fill(user + dbg->size, size - dbg->size, ALLOC_POISON_ALLOC);
+    dbg->size = (ulong)size;
+    dbg->requested = (uint32_t)requested;
+    alloc_dbg_fill(user + size, ALLOC_TAIL_REDZONE, ALLOC_REDZONE_BYTE);
+}
+
+static inline size_t user_size(tlsf_block_t *b) {
+    return ((stelloc_dbg_t *)block_payload(b))->size;
+}
+#else
+static inline void stelloc_stamp(void *payload, size_t size, size_t requested) {
+    (void)payload; (void)size; (void)requested;
+}
+static inline void stelloc_check_and_poison_free(void *user) { (void)user; }
+static inline void stelloc_restamp(void *payload, size_t size, size_t requested) {
+    (void)payload; (void)size; (void)requested;
+}
+static inline size_t user_size(tlsf_block_t *b) {
+    return __atomic_load_n(&b->size, __ATOMIC_RELAXED) & BLOCK_SIZE_MASK;
+}
+#endif
+
+// Hand back pools that are a single free block again. Pools are unlinked
+// under the arena lock (skipped if busy, see shrinker.h) and released after
+// it is dropped: vfree() may need TLB shootdowns.
+static size_t stelloc_shrink(size_t target, void *ctx) {
+    (void)ctx;
+    size_t freed = 0;
+    for (int i = 0; i < STELLOC_ARENAS && freed < target; i++) {
+        stelloc_arena_t *a = &arenas[i];
+        if (!a->pools) continue;
+        stelloc_pool_t *release = NULL;
+        uint64_t irq = cpu_irq_save();
+        if (!spin_trylock(&a->lock)) {
+            cpu_irq_restore(irq);
+            continue;
+        }
+        arena_drain_remote(a);
+        for (stelloc_pool_t **pp = &a->pools; *pp; ) {
+            stelloc_pool_t *pool = *pp;
+            tlsf_block_t *b = pool_first(pool);
+            if (block_is_free(b) && block_size(b) == pool_block_size(pool->bytes)) {
+                bin_unlink(a, b);
+                a->pool_bytes -= pool->bytes;
+                *pp = pool->next;
+                pool->next = release;
+                release = pool;
+            } else {
+                pp = &pool->next;
+            }
+        }
+        spin_unlock(&a->lock);
+        cpu_irq_restore(irq);
+        while (release) {
+            stelloc_pool_t *pool = release;
+            release = pool->next;
+            freed += (size_t)(pool->bytes / 4096);
+            if (vmalloc_size(pool)) vfree(pool);
+            else palloc_free_page(pool);
+        }
+    }
+    return freed;
+}
+static shrinker_t stelloc_shrinker = { .name = "stelloc", .shrink = stelloc_shrink, .order = 5 };
+
 void stelloc_set_mode(int mode) {
-    if (mode == STELLOC_DUMB || mode == STELLOC_SMART || mode == STELLOC_AGGRESSIVE) {
+    if (mode == STELLOC_DUMB || mode == STELLOC_SMART || mode == STELLOC_AGGRESSIVE || mode == STELLOC_ADAPTIVE) {
         g_mode = mode;
     }
 }
 
 int stelloc_get_mode(void) { return g_mode; }
 
+void stelloc_set_direct_map(bool on) { g_direct = on; }
+
 void stelloc_init_heap() {
-    FreeListHead = 0;
-    g_mode = STELLOC_SMART;
-    TailPtr = 0; TailSize = 0;
-    spinlock_init(&stelloc_lock);
+    for (int i = 0; i < STELLOC_ARENAS; i++) {
+        stelloc_arena_t *a = &arenas[i];
+        spinlock_init(&a->lock);
+        a->fl_bitmap = 0;
+        for (int f = 0; f < (int)FL_COUNT; f++) {
+            a->sl_bitmap[f] = 0;
+            for (int j = 0; j < (int)SL_COUNT; j++) a->bins[f][j] = NULL;
+        }
+        a->remote = NULL;
+        a->pools = NULL;
+        a->allocs = a->frees = a->remote_frees = a->pool_bytes = a->alloc_bytes = 0;
+        a->grow_batch = GROW_PAGES_MIN;
+        a->grow_last_ns = a->grow_mark = 0;
+        a->grows = a->grow_pages = a->grow_up = a->grow_down = a->grow_hold = 0;
+    }
+    g_mode = STELLOC_ADAPTIVE;
 
     vmm_init();
     (void)vheap_init(0xffff900000000000ULL, 16ULL * 1024ULL * 1024ULL * 1024ULL); // 16 GiB
     slab_init();
+    kfence_init();
+    shrinker_register(&stelloc_shrinker);
 }
 
-void *stelloc_allocate(ulong size) {
-    spin_lock(&stelloc_lock);
-    size_t requested = size;
-    size = ALIGN8(size);
-    ulong prev = 0;
-    ulong current = FreeListHead;
-
-    // First-fit search (prefer reusing freed space)
-    while (current != 0) {
-        ulong blockSize = *(ulong *)current;      // full size of free block
-        ulong next = *((ulong *)current + 1);
-        if (blockSize >= size + ALLOC_OVERHEAD) {
-            // Remove current free block entirely from free list
-            if (prev == 0) FreeListHead = next; else *((ulong *)prev + 1) = next;
-
-            // Carve the allocated block at the beginning
-            stelloc_stamp(current, size, requested);
-            void *ret = ulong_to_ptr(current + ALLOC_HEADER_SIZE);
-
-            // Set up tail bump region with the remainder (no free header yet)
-            ulong consumed = ALLOC_OVERHEAD + size;
-            if (blockSize > consumed) {
-                TailPtr = current + consumed;
-                TailSize = blockSize - consumed;
-            } else {
-                TailPtr = 0; TailSize = 0;
-            }
-            // If tail is too small to be useful for another alloc, push it back
-            if (TailSize && TailSize < FREE_HEADER_SIZE + 8) {
-                insert_free_sorted(ulong_to_ptr(TailPtr), TailSize);
-                TailPtr = 0; TailSize = 0;
-            }
-            spin_unlock(&stelloc_lock);
-            return ret;
-        }
-        prev = current;
-        current = next;
-    }
+// Carve 'need' bytes from 'a', or NULL when it has no fitting block.
+// Split the front off free block 'b' (out of the bins) so the caller's bytes
+// start on an 'align' boundary. The gap goes back to the bins; it is always
+// large enough to be a block of its own.
+static tlsf_block_t *block_align(stelloc_arena_t *a, tlsf_block_t *b, ulong align) {
+    ulong user = ptr_to_ulong(block_payload(b)) + ALLOC_HEADER_SIZE;
+    ulong aligned = (user + align - 1) & ~(align - 1);
+    while (aligned != user && aligned - user < BLOCK_HDR_SIZE + BLOCK_MIN_SIZE) aligned += align;
+    ulong gap = aligned - user;
+    if (!gap) return b;
+    tlsf_block_t *carved = (tlsf_block_t *)ulong_to_ptr(ptr_to_ulong(b) + gap);
+    carved->size = (block_size(b) - gap) | (b->size & BLOCK_ARENA_MASK) | BLOCK_FREE;
+    block_set_size(b, gap - BLOCK_HDR_SIZE);
+    block_mark_free(b);
+    bin_insert(a, b);
+    return carved;
+}
 
-    // Next, try the tail bump region if available
-    if (TailSize >= size + ALLOC_OVERHEAD) {
-        ulong header = TailPtr;
-        stelloc_stamp(header, size, requested);
-        void *ret = ulong_to_ptr(header + ALLOC_HEADER_SIZE);
-        TailPtr += ALLOC_OVERHEAD + size;
-        TailSize -= ALLOC_OVERHEAD + size;
-        if (TailSize < FREE_HEADER_SIZE + 8) {
-            if (TailSize >= 8) insert_free_sorted(ulong_to_ptr(TailPtr), TailSize);
-            TailPtr = 0; TailSize = 0;
-        }
-    spin_unlock(&stelloc_lock);
-    return ret;
+// Worst-case extra bytes block_align() may cut from the front of a block.
+static inline ulong align_slack(ulong align) {
+    return align > BLOCK_ALIGN ? align + BLOCK_HDR_SIZE + BLOCK_MIN_SIZE : 0;
+}
+
+static tlsf_block_t *arena_alloc(stelloc_arena_t *a, ulong need, ulong align) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&a->lock);
+    arena_drain_remote(a);
+    tlsf_block_t *b = locate_free(a, need + align_slack(align));
+    if (b) {
+        if (align > BLOCK_ALIGN) b = block_align(a, b, align);
+        block_trim(a, b, need);
+        block_mark_used(b);
+        a->allocs++;
+        a->alloc_bytes += block_size(b);
     }
+    spin_unlock(&a->lock);
+    cpu_irq_restore(irq);
+    return b;
+}
 
-    // No block large enough: grow virtual heap and/or physical supply.
-    // Commit at least one page worth (plus some headroom for metadata).
-    uint64_t need = (uint64_t)(size + ALLOC_OVERHEAD);
-    if (need < 4096) need = 4096;
-    uint64_t va = vheap_commit((size_t)need);
-    if (va) {
-        // Insert the newly committed region as a free block and retry
-        insert_free_sorted((void *)va, (ulong)need);
-    } else {
-        // Fallback: try to grow physical free list as before
-        grow_heap(size + FREE_HEADER_SIZE);
+// ---------------------------------------------------------------------------
+// Large allocations: one vmalloc range each, found again through the vheap
+// page-type map. There is no header, so the trailing guard page is the only
+// overrun check, ALLOC_DEBUG or not.
+
+static uint64_t large_allocs, large_frees, large_bytes;
+
+static inline bool is_large(const void *ptr) {
+    return ((uintptr_t)ptr & 0xFFF) == 0 && vheap_page_type((uint64_t)(uintptr_t)ptr) == VHEAP_PT_LARGE;
+}
+
+static uint64_t zero_committed, zero_reserved;
+
+static void *large_track(void *p) {
+    size_t bytes = vmalloc_size(p);
+    vheap_set_page_type((uint64_t)(uintptr_t)p, bytes >> 12, VHEAP_PT_LARGE);
+    __atomic_fetch_add(&large_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&large_bytes, bytes, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void *large_alloc(size_t size) {
+    void *p = vmalloc(size);
+    if (!p) return NULL;
+#if ALLOC_DEBUG
+    alloc_dbg_fill(p, size, ALLOC_POISON_ALLOC);
+#endif
+    return large_track(p);
+}
+
+// Zeroed pages without a memset by the caller. Reservations cost nothing
+// until touched, but a fault that finds no memory cannot fail the
+// allocation any more: under memory pressure commit up front instead.
+static void *large_alloc_zeroed(size_t size) {
+    void *p = NULL;
+    if (mem_pressure() == MEM_PRESSURE_NONE) {
+        p = vheap_reserve(size);
+        if (p) __atomic_fetch_add(&zero_reserved, 1, __ATOMIC_RELAXED);
     }
-    prev = 0;
-    current = FreeListHead;
-    while (current != 0) {
-        ulong blockSize = *(ulong *)current;
-        ulong next = *((ulong *)current + 1);
-        if (blockSize >= size + ALLOC_OVERHEAD) {
-            if (prev == 0) FreeListHead = next; else *((ulong *)prev + 1) = next;
-            stelloc_stamp(current, size, requested);
-            void *ret = ulong_to_ptr(current + ALLOC_HEADER_SIZE);
-            ulong consumed = ALLOC_OVERHEAD + size;
-            if (blockSize > consumed) {
-                TailPtr = current + consumed;
-                TailSize = blockSize - consumed;
-            } else { TailPtr = 0; TailSize = 0; }
-            if (TailSize && TailSize < FREE_HEADER_SIZE + 8) {
-                insert_free_sorted(ulong_to_ptr(TailPtr), TailSize);
-                TailPtr = 0; TailSize = 0;
-            }
-            spin_unlock(&stelloc_lock);
-            return ret;
-        }
-        prev = current;
-        current = next;
+    if (!p) {
+        p = vzalloc(size);
+        if (p) __atomic_fetch_add(&zero_committed, 1, __ATOMIC_RELAXED);
     }
+    return p ? large_track(p) : NULL;
+}
 
-    // Final attempt from tail after growth
-    if (TailSize >= size + ALLOC_OVERHEAD) {
-        ulong header = TailPtr;
-        stelloc_stamp(header, size, requested);
-        void *ret = ulong_to_ptr(header + ALLOC_HEADER_SIZE);
-        TailPtr += ALLOC_OVERHEAD + size;
-        TailSize -= ALLOC_OVERHEAD + size;
-        if (TailSize < FREE_HEADER_SIZE + 8) {
-            if (TailSize >= 8) insert_free_sorted(ulong_to_ptr(TailPtr), TailSize);
-            TailPtr = 0; TailSize = 0;
-        }
-        spin_unlock(&stelloc_lock);
-        return ret;
+static void large_free(void *ptr) {
+    size_t bytes = vmalloc_size(ptr);
+    __atomic_fetch_add(&large_frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&large_bytes, bytes, __ATOMIC_RELAXED);
+    vfree_now(ptr);
+}
+
+void *stelloc_allocate(ulong size) {
+    return stelloc_allocate_aligned(size, BLOCK_ALIGN);
+}
+
+void *stelloc_allocate_aligned(ulong size, ulong align) {
+    if (align & (align - 1)) return NULL;
+    if (size >= STELLOC_LARGE_THRESHOLD && align <= 4096) return large_alloc(size);
+    if (size == 0 || size > (1UL << FL_INDEX_MAX)) return NULL;
+    if (align < BLOCK_ALIGN) align = BLOCK_ALIGN;
+    size_t requested = size;
+    size = ALIGN16(size);
+    ulong need = size + ALLOC_OVERHEAD;
+    if (need < BLOCK_MIN_SIZE) need = BLOCK_MIN_SIZE;
+
+    stelloc_arena_t *home = local_arena();
+    tlsf_block_t *b = arena_alloc(home, need, align);
+    // Growth happens unlocked, so an interrupt on this CPU can take the new
+    // pool first; grow at most twice before looking elsewhere.
+    for (int attempt = 0; !b && attempt < 2; attempt++) {
+        if (!grow_arena(home, need + align_slack(align))) break;
+        b = arena_alloc(home, need, align);
+    }
+    // Out of memory for new pools: borrow free space from the other arenas.
+    for (int i = 0; !b && i < STELLOC_ARENAS; i++) {
+        if (&arenas[i] != home) b = arena_alloc(&arenas[i], need, align);
     }
+    if (!b) return NULL;
+    void *payload = block_payload(b);
+    stelloc_stamp(payload, size, requested);
+    return (uint8_t *)payload + ALLOC_HEADER_SIZE;
+}
 
-    spin_unlock(&stelloc_lock);
-    return NULL;
+void *stelloc_allocate_zeroed(ulong size) {
+    if (size >= STELLOC_ZERO_PAGES_THRESHOLD) return large_alloc_zeroed(size);
+    void *p = stelloc_allocate(size);
+    if (p) memset(p, 0, size);
+    return p;
 }
 
 void stelloc_free(void *ptr) {
     if (!ptr) return;
-    spin_lock(&stelloc_lock);
-    ulong block = ptr_to_ulong(ptr) - ALLOC_HEADER_SIZE;
-    stelloc_hdr_t *hdr = (stelloc_hdr_t *)block;
-    ulong size = hdr->size;
+    if (is_large(ptr)) { large_free(ptr); return; }
+    stelloc_check_and_poison_free(ptr);
+    tlsf_block_t *b = block_from_payload((uint8_t *)ptr - ALLOC_HEADER_SIZE);
+    stelloc_arena_t *a = block_arena(b);
+    if (a != local_arena()) {
+        arena_push_remote(a, b);
+        return;
+    }
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&a->lock);
+    arena_release(a, b);
+    arena_drain_remote(a);
+    spin_unlock(&a->lock);
+    cpu_irq_restore(irq);
+}
 
-#if ALLOC_DEBUG
-    stelloc_check_and_poison_free(ptr, size);
-#endif
+size_t stelloc_usable_size(void *ptr) {
+    if (!ptr) return 0;
+    if (is_large(ptr)) return vmalloc_size(ptr);
+    return user_size(block_from_payload((uint8_t *)ptr - ALLOC_HEADER_SIZE));
+}
 
-    // Reconstruct full block size with header + redzones
-    ulong full = size + ALLOC_OVERHEAD;
+bool stelloc_resize(void *ptr, ulong size) {
+    if (!ptr || size == 0) return false;
+    if (is_large(ptr)) {
+        // Keep the pages while the new size still uses most of them.
+        size_t cur = vmalloc_size(ptr);
+        return size <= cur && size > cur / 2;
+    }
+    if (size > (1UL << FL_INDEX_MAX)) return false;
+    size_t requested = size;
+    size = ALIGN16(size);
+    ulong need = size + ALLOC_OVERHEAD;
+    if (need < BLOCK_MIN_SIZE) need = BLOCK_MIN_SIZE;
+    void *payload = (uint8_t *)ptr - ALLOC_HEADER_SIZE;
+    tlsf_block_t *b = block_from_payload(payload);
+    stelloc_arena_t *a = block_arena(b);
+
+    // Only the owning CPU touches the arena's bins; elsewhere the block can
+    // only be reused as it stands.
+    if (a != local_arena()) {
+        if (need > (__atomic_load_n(&b->size, __ATOMIC_RELAXED) & BLOCK_SIZE_MASK)) return false;
+        stelloc_restamp(payload, size, requested);
+        return true;
+    }
 
-    // If this block is immediately before the current tail, "rewind" the bump.
-    if (TailPtr != 0 && block + full == TailPtr) {
-        TailPtr = block;
-        TailSize += full;
-        spin_unlock(&stelloc_lock);
-        return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&a->lock);
+    arena_drain_remote(a);
+    ulong cur = block_size(b);
+    if (need > cur) {
+        // Grow into the following free block, if it is large enough.
+        tlsf_block_t *next = block_next(b);
+        if (!block_is_free(next) || cur + BLOCK_HDR_SIZE + block_size(next) < need) {
+            spin_unlock(&a->lock);
+            cpu_irq_restore(irq);
+            return false;
+        }
+        bin_unlink(a, next);
+        block_set_size(b, cur + BLOCK_HDR_SIZE + block_size(next));
+        block_next(b)->size &= ~BLOCK_PREV_FREE;
+    }
+    block_trim(a, b, need);
+    spin_unlock(&a->lock);
+    cpu_irq_restore(irq);
+    stelloc_restamp(payload, size, requested);
+    return true;
+}
+
+void stelloc_dump_stats(void) {
+    for (int i = 0; i < STELLOC_ARENAS; i++) {
+        stelloc_arena_t *a = &arenas[i];
+        if (!a->pool_bytes) continue;
+        info_printf("stelloc: arena %d: %llu KiB in pools, allocs=%llu frees=%llu (remote %llu)\n", i,
+                    (unsigned long long)(a->pool_bytes >> 10), (unsigned long long)a->allocs,
+                    (unsigned long long)a->frees,
+                    (unsigned long long)__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED));
+        info_printf("stelloc: arena %d: %llu grows (%llu pages), batch %u pages, up %llu down %llu hold %llu\n", i,
+                    (unsigned long long)a->grows, (unsigned long long)a->grow_pages, (unsigned)a->grow_batch,
+                    (unsigned long long)a->grow_up, (unsigned long long)a->grow_down,
+                    (unsigned long long)a->grow_hold);
     }
+    uint64_t la = __atomic_load_n(&large_allocs, __ATOMIC_RELAXED);
+    if (la) {
+        info_printf("stelloc: large: %llu KiB live, allocs=%llu frees=%llu\n",
+                    (unsigned long long)(__atomic_load_n(&large_bytes, __ATOMIC_RELAXED) >> 10),
+                    (unsigned long long)la,
+                    (unsigned long long)__atomic_load_n(&large_frees, __ATOMIC_RELAXED));
+        info_printf("stelloc: zeroed: %llu from pre-zeroed frames, %llu demand-zero reservations\n",
+                    (unsigned long long)__atomic_load_n(&zero_committed, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&zero_reserved, __ATOMIC_RELAXED));
+    }
+}
+
+void stelloc_get_growth_stats(stelloc_growth_stats_t *out) {
+    *out = (stelloc_growth_stats_t){ 0 };
+    for (int i = 0; i < STELLOC_ARENAS; i++) {
+        stelloc_arena_t *a = &arenas[i];
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&a->lock);
+        out->grows += a->grows;
+        out->grow_pages += a->grow_pages;
+        out->up += a->grow_up;
+        out->down += a->grow_down;
+        out->hold += a->grow_hold;
+        if (a->grow_batch > out->batch_max) out->batch_max = a->grow_batch;
+        spin_unlock(&a->lock);
+        cpu_irq_restore(irq);
+    }
+}
 
-    // Otherwise insert back into the sorted free list and coalesce.
-    insert_free_sorted(ulong_to_ptr(block), full);
-    spin_unlock(&stelloc_lock);
-}
\ No newline at end of file
+void stelloc_dump_fragmentation(void) {
+    for (int i = 0; i < STELLOC_ARENAS; i++) {
+        stelloc_arena_t *a = &arenas[i];
+        if (!a->pool_bytes) continue;
+        // Blocks still on the remote list are not counted as free until the
+        // owner drains them.
+        ulong free_bytes = 0, largest = 0, blocks = 0;
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&a->lock);
+        for (int f = 0; f < (int)FL_COUNT; f++) {
+            if (!(a->fl_bitmap & (1U << f))) continue;
+            for (int j = 0; j < (int)SL_COUNT; j++) {
+                for (tlsf_block_t *b = a->bins[f][j]; b; b = b->next_free) {
+                    ulong sz = block_size(b);
+                    free_bytes += sz;
+                    if (sz > largest) largest = sz;
+                    blocks++;
+                }
+            }
+        }
+        ulong pool = a->pool_bytes;
+        spin_unlock(&a->lock);
+        cpu_irq_restore(irq);
+        // 0% when all free space is one block, near 100% when it is dust.
+        ulong frag = free_bytes ? 100 - largest * 100 / free_bytes : 0;
+        info_printf("stelloc: arena %d: %llu/%llu KiB free in %llu blocks, largest %llu KiB, fragmentation %llu%%\n", i,
+                    (unsigned long long)(free_bytes >> 10), (unsigned long long)(pool >> 10),
+                    (unsigned long long)blocks, (unsigned long long)(largest >> 10), (unsigned long long)frag);
+    }
+}
@@ -0,0 +1,195 @@
+// Region allocator. Chunks form a list from the newest (the one being
+// carved) back to the first, which also holds the arena header:
+//
+//   arena->head -> chunk N -> ... -> chunk 0 [arena_t | objects...]
+//
+// Each chunk records how far it was filled when the arena moved on, so
+// usage can be reported without per-object bookkeeping. One released
+// chunk of the standard size is kept as a spare, so a scratch region
+// that crosses a chunk boundary on every use does not hit palloc each time.
+
+#include <arena.h>
+#include <palloc.h>
+#include <vheap.h>
+#include <smp.h>
+#include <cpu_local.h>
+#include <string.h>
+
+#define PAGE_SIZE 0x1000ULL
+
+typedef struct arena_chunk {
+    struct arena_chunk *prev;   // older chunk
+    size_t size;                // bytes, header included
+    uintptr_t top;              // fill level once the arena moved on
+    bool vmalloced;
+} arena_chunk_t;
+
+#define CHUNK_HDR (((sizeof(arena_chunk_t)) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena {
+    arena_chunk_t *head;
+    arena_chunk_t *spare;
+    uintptr_t cur, end;
+    uintptr_t base;             // first free byte of chunk 0
+    size_t chunk_size;
+    uint32_t flags;
+};
+
+static arena_t *scratch[SMP_MAX_CPUS];
+
+static inline uintptr_t align_up(uintptr_t v, size_t align) {
+    return (v + align - 1) & ~(uintptr_t)(align - 1);
+}
+
+static inline uintptr_t chunk_start(const arena_chunk_t *c) { return (uintptr_t)c + CHUNK_HDR; }
+static inline uintptr_t chunk_end(const arena_chunk_t *c) { return (uintptr_t)c + c->size; }
+
+static arena_chunk_t *chunk_new(size_t size, uint32_t flags) {
+    arena_chunk_t *c;
+    bool vmalloced = false;
+    if (size == PAGE_SIZE) {
+        c = palloc_allocate_page();
+    } else if (flags & ARENA_ATOMIC) {
+        return NULL;
+    } else {
+        c = vmalloc(size);
+        vmalloced = true;
+    }
+    if (!c) return NULL;
+    c->prev = NULL;
+    c->size = size;
+    c->top = 0;
+    c->vmalloced = vmalloced;
+    return c;
+}
+
+static void chunk_free(arena_chunk_t *c) {
+    if (c->vmalloced) vfree(c);
+    else palloc_free_page(c);
+}
+
+static void chunk_release(arena_t *a, arena_chunk_t *c) {
+    if (!a->spare && c->size == a->chunk_size) a->spare = c;
+    else chunk_free(c);
+}
+
+arena_t *arena_create(size_t chunk_size, uint32_t flags) {
+    if (flags & ARENA_ATOMIC) chunk_size = PAGE_SIZE;
+    else if (!chunk_size) chunk_size = ARENA_DEFAULT_CHUNK;
+    chunk_size = align_up(chunk_size, PAGE_SIZE);
+    arena_chunk_t *c = chunk_new(chunk_size, flags);
+    if (!c) return NULL;
+    arena_t *a = (arena_t *)chunk_start(c);
+    memset(a, 0, sizeof(*a));
+    a->head = c;
+    a->chunk_size = chunk_size;
+    a->flags = flags;
+    a->base = align_up((uintptr_t)(a + 1), ARENA_ALIGN);
+    a->cur = a->base;
+    a->end = chunk_end(c);
+    return a;
+}
+
+static void *alloc_slow(arena_t *a, size_t size, size_t align) {
+    if (size > SIZE_MAX / 2) return NULL;
+    // Chunks are page aligned, so the payload start is CHUNK_HDR-aligned.
+    size_t need = CHUNK_HDR + size + (align > CHUNK_HDR ? align - CHUNK_HDR : 0);
+    arena_chunk_t *c;
+    if (need <= a->chunk_size && a->spare) {
+        c = a->spare;
+        a->spare = NULL;
+        c->top = 0;
+    } else {
+        // An oversized request gets a chunk of its own; the rest of the
+        // current chunk is left unused.
+        c = chunk_new(need <= a->chunk_size ? a->chunk_size : align_up(need, PAGE_SIZE), a->flags);
+        if (!c) return NULL;
+    }
+    a->head->top = a->cur;
+    c->prev = a->head;
+    a->head = c;
+    uintptr_t p = align_up(chunk_start(c), align);
+    a->cur = p + size;
+    a->end = chunk_end(c);
+    return (void *)p;
+}
+
+void *arena_alloc_aligned(arena_t *a, size_t size, size_t align) {
+    if (!a || size == 0) return NULL;
+    if (align < ARENA_ALIGN) align = ARENA_ALIGN;
+    if ((align & (align - 1)) || align > PAGE_SIZE) return NULL;
+    uintptr_t p = align_up(a->cur, align);
+    if (p <= a->end && size <= a->end - p) {
+        a->cur = p + size;
+        return (void *)p;
+    }
+    return alloc_slow(a, size, align);
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+    return arena_alloc_aligned(a, size, ARENA_ALIGN);
+}
+
+arena_mark_t arena_save(arena_t *a) {
+    arena_mark_t m = { a->head, a->cur };
+    return m;
+}
+
+void arena_restore(arena_t *a, arena_mark_t mark) {
+    while (a->head != mark.chunk) {
+        arena_chunk_t *c = a->head;
+        a->head = c->prev;
+        chunk_release(a, c);
+    }
+    a->cur = mark.cur;
+    a->end = chunk_end(a->head);
+}
+
+void arena_reset(arena_t *a) {
+    if (!a) return;
+    arena_chunk_t *first = a->head;
+    while (first->prev) first = first->prev;
+    arena_mark_t m = { first, a->base };
+    arena_restore(a, m);
+}
+
+void arena_destroy(arena_t *a) {
+    if (!a) return;
+    // Chunk 0 holds the arena itself: free it last.
+    arena_chunk_t *c = a->head;
+    if (a->spare) chunk_free(a->spare);
+    while (c->prev) {
+        arena_chunk_t *prev = c->prev;
+        chunk_free(c);
+        c = prev;
+    }
+    chunk_free(c);
+}
+
+size_t arena_used(const arena_t *a) {
+    size_t used = a->cur - (a->head->prev ? chunk_start(a->head) : a->base);
+    for (const arena_chunk_t *c = a->head->prev; c; c = c->prev) {
+        used += c->top - (c->prev ? chunk_start(c) : a->base);
+    }
+    return used;
+}
+
+size_t arena_footprint(const arena_t *a) {
+    size_t bytes = a->spare ? a->spare->size : 0;
+    for (const arena_chunk_t *c = a->head; c; c = c->prev) bytes += c->size;
+    return bytes;
+}
+
+arena_t *arena_scratch_begin(arena_scratch_t *s) {
+    s->irq = cpu_irq_save();
+    arena_t **slot = &scratch[cpu_local_index() % SMP_MAX_CPUS];
+    if (!*slot) *slot = arena_create(PAGE_SIZE, ARENA_ATOMIC);
+    s->arena = *slot;
+    if (s->arena) s->mark = arena_save(s->arena);
+    return s->arena;
+}
+
+void arena_scratch_end(arena_scratch_t *s) {
+    if (s->arena) arena_restore(s->arena, s->mark);
+    cpu_irq_restore(s->irq);
+}
@@ -0,0 +1,901 @@
+// Memory-management microbenchmarks. Each one sets up its own state, reports
+// TSC cycles through info_printf, and cleans up after itself.
+
+#include <mm_bench.h>
+#include <vmm.h>
+#include <vheap.h>
+#include <vrange.h>
+#include <palloc.h>
+#include <boot.h>
+#include <tsc.h>
+#include <lprintf.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <slab.h>
+#include <shrinker.h>
+#include <stelloc.h>
+#include <kfence.h>
+#include <heapprof.h>
+#include <arena.h>
+#include <ioremap.h>
+#include <displaystandard.h>
+#include <acpi.h>
+#include <smp.h>
+#include <timebase.h>
+
+#define PAGE_SIZE 0x1000ULL
+
+// ---------------------------------------------------------------------------
+// PCID: ping-pong between two spaces touching a small working set in each.
+
+#define PCID_BENCH_VA     0x0000004000000000ULL
+#define PCID_BENCH_PAGES  64
+#define PCID_BENCH_ITERS  2000
+
+static bool pcid_bench_map(vmm_space_t *space) {
+    for (uint64_t i = 0; i < PCID_BENCH_PAGES; i++) {
+        void *page = palloc_zero_allocate_page();
+        if (!page) return false;
+        uint64_t pa = (uint64_t)(uintptr_t)page - hhdm_request.response->offset;
+        if (vmm_space_map_page(space, PCID_BENCH_VA + i * PAGE_SIZE, pa,
+                               VMM_P_PRESENT | VMM_P_WRITABLE | VMM_P_NX) != 0) {
+            palloc_free_page(page);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void pcid_bench_touch(void) {
+    for (uint64_t i = 0; i < PCID_BENCH_PAGES; i++) {
+        (void)*(volatile uint64_t *)(uintptr_t)(PCID_BENCH_VA + i * PAGE_SIZE);
+    }
+}
+
+static uint64_t pcid_bench_round(vmm_space_t *a, vmm_space_t *b, bool use_pcid) {
+    vmm_pcid_set_enabled(use_pcid);
+    // Warm both spaces once so the first measured switch is not cold.
+    vmm_space_switch(a); pcid_bench_touch();
+    vmm_space_switch(b); pcid_bench_touch();
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < PCID_BENCH_ITERS; i++) {
+        vmm_space_switch(a); pcid_bench_touch();
+        vmm_space_switch(b); pcid_bench_touch();
+    }
+    uint64_t t1 = rdtsc();
+    vmm_space_switch(vmm_kernel_space());
+    return (t1 - t0) / (2ULL * PCID_BENCH_ITERS);
+}
+
+void mm_bench_pcid_switch(void) {
+    vmm_space_t *a = vmm_space_create();
+    vmm_space_t *b = vmm_space_create();
+    if (!a || !b || !pcid_bench_map(a) || !pcid_bench_map(b)) {
+        error_printf("bench: pcid setup failed\n");
+        goto out;
+    }
+    uint64_t flushing = pcid_bench_round(a, b, false);
+    if (vmm_pcid_supported()) {
+        uint64_t tagged = pcid_bench_round(a, b, true);
+        info_printf("bench: space switch + %u-page touch: %llu cycles flushing, %llu cycles with PCID\n",
+                    (unsigned)PCID_BENCH_PAGES, (unsigned long long)flushing, (unsigned long long)tagged);
+    } else {
+        info_printf("bench: space switch + %u-page touch: %llu cycles (no PCID on this CPU)\n",
+                    (unsigned)PCID_BENCH_PAGES, (unsigned long long)flushing);
+    }
+    vmm_pcid_set_enabled(true);
+out:
+    if (a) { vmm_space_unmap_range(a, PCID_BENCH_VA, PCID_BENCH_PAGES, VMM_UNMAP_FREE); vmm_space_destroy(a); }
+    if (b) { vmm_space_unmap_range(b, PCID_BENCH_VA, PCID_BENCH_PAGES, VMM_UNMAP_FREE); vmm_space_destroy(b); }
+}
+
+// ---------------------------------------------------------------------------
+// Range mapping: same frames, same VA, per-page calls versus one range call.
+
+#define MAP_BENCH_VA    0xFFFF80E000000000ULL  // unused scratch window
+#define MAP_BENCH_PAGES 4096                   // 16 MiB
+
+void mm_bench_map_range(void) {
+    void *page = palloc_allocate_page();
+    if (!page) { error_printf("bench: map_range setup failed\n"); return; }
+    uint64_t pa = (uint64_t)(uintptr_t)page - hhdm_request.response->offset;
+    uint64_t flags = VMM_P_PRESENT | VMM_P_WRITABLE | VMM_P_NX;
+
+    // Populate the page tables once so both passes measure the leaf work.
+    (void)vmm_map_range(MAP_BENCH_VA, pa, MAP_BENCH_PAGES, flags);
+    vmm_unmap_range(MAP_BENCH_VA, MAP_BENCH_PAGES, 0, NULL);
+
+    uint64_t t0 = rdtsc();
+    for (uint64_t i = 0; i < MAP_BENCH_PAGES; i++) {
+        (void)vmm_map_page(MAP_BENCH_VA + i * PAGE_SIZE, pa, flags);
+    }
+    uint64_t t1 = rdtsc();
+    vmm_unmap_range(MAP_BENCH_VA, MAP_BENCH_PAGES, 0, NULL);
+
+    uint64_t t2 = rdtsc();
+    (void)vmm_map_range(MAP_BENCH_VA, pa, MAP_BENCH_PAGES, flags);
+    uint64_t t3 = rdtsc();
+    vmm_unmap_range(MAP_BENCH_VA, MAP_BENCH_PAGES, 0, NULL);
+    palloc_free_page(page);
+
+    info_printf("bench: map %u pages: %llu cycles/page per-page, %llu cycles/page ranged\n",
+                (unsigned)MAP_BENCH_PAGES,
+                (unsigned long long)((t1 - t0) / MAP_BENCH_PAGES),
+                (unsigned long long)((t3 - t2) / MAP_BENCH_PAGES));
+}
+
+// ---------------------------------------------------------------------------
+// vmalloc churn: a window of live 16 KiB allocations, oldest freed first, so
+// the address space only survives if freed ranges are really reused.
+
+#define VMALLOC_BENCH_LIVE  64
+#define VMALLOC_BENCH_ITERS 20000
+
+void mm_bench_vmalloc(void) {
+    void *live[VMALLOC_BENCH_LIVE] = {0};
+    vrange_stats_t before, after;
+    vheap_get_stats(&before);
+
+    uint64_t t0 = rdtsc();
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < VMALLOC_BENCH_ITERS; i++) {
+        uint32_t slot = i % VMALLOC_BENCH_LIVE;
+        vfree(live[slot]);
+        live[slot] = vmalloc(4 * PAGE_SIZE);
+        if (!live[slot]) failed++;
+        else *(volatile uint64_t *)live[slot] = i;
+    }
+    uint64_t t1 = rdtsc();
+    for (uint32_t i = 0; i < VMALLOC_BENCH_LIVE; i++) vfree(live[i]);
+    (void)vheap_purge();
+    vheap_get_stats(&after);
+
+    info_printf("bench: vmalloc/vfree 16KiB: %llu cycles/pair, %llu purges, %u failures, busy %llu -> %llu bytes\n",
+                (unsigned long long)((t1 - t0) / VMALLOC_BENCH_ITERS),
+                (unsigned long long)(after.purges - before.purges), failed,
+                (unsigned long long)before.busy_bytes, (unsigned long long)after.busy_bytes);
+}
+
+// ---------------------------------------------------------------------------
+// Demand paging: touch one page in every 256KiB of a 16 MiB buffer.
+
+#define RESERVE_BENCH_BYTES  (16ULL * 1024 * 1024)
+#define RESERVE_BENCH_STRIDE (256ULL * 1024)
+
+static uint64_t touch_sparse(uint8_t *buf) {
+    uint64_t t0 = rdtsc();
+    for (uint64_t off = 0; off < RESERVE_BENCH_BYTES; off += RESERVE_BENCH_STRIDE) {
+        buf[off] = 1;
+    }
+    return rdtsc() - t0;
+}
+
+void mm_bench_vheap_reserve(void) {
+    vheap_fault_stats_t before, after;
+
+    uint64_t t0 = rdtsc();
+    uint8_t *eager = vmalloc(RESERVE_BENCH_BYTES);
+    uint64_t commit_cycles = rdtsc() - t0;
+    if (!eager) { error_printf("bench: vheap_reserve setup failed\n"); return; }
+    uint64_t eager_touch = touch_sparse(eager);
+    vfree(eager);
+
+    vheap_get_fault_stats(&before);
+    t0 = rdtsc();
+    uint8_t *lazy = vheap_reserve(RESERVE_BENCH_BYTES);
+    uint64_t reserve_cycles = rdtsc() - t0;
+    if (!lazy) { error_printf("bench: vheap_reserve setup failed\n"); return; }
+    uint64_t lazy_touch = touch_sparse(lazy);
+    vheap_get_fault_stats(&after);
+    vfree(lazy);
+    (void)vheap_purge();
+
+    info_printf("bench: 16MiB sparse: vmalloc %llu+%llu cycles (%llu pages), reserve %llu+%llu cycles (%llu faults, %llu pages)\n",
+                (unsigned long long)commit_cycles, (unsigned long long)eager_touch,
+                (unsigned long long)(RESERVE_BENCH_BYTES / PAGE_SIZE),
+                (unsigned long long)reserve_cycles, (unsigned long long)lazy_touch,
+                (unsigned long long)(after.faults - before.faults),
+                (unsigned long long)(after.pages_faulted - before.pages_faulted));
+}
+
+// ---------------------------------------------------------------------------
+// Slab free with a large live set. The pointer array itself comes from
+// vmalloc so it does not disturb the slab caches being measured.
+
+#define SLAB_BENCH_LIVE 100000
+
+void mm_bench_slab_free(void) {
+    void **objs = vmalloc(SLAB_BENCH_LIVE * sizeof(void *));
+    if (!objs) { error_printf("bench: slab_free setup failed\n"); return; }
+
+    uint64_t t0 = rdtsc();
+    uint32_t n = 0;
+    for (; n < SLAB_BENCH_LIVE; n++) {
+        objs[n] = malloc(32 + (n % 4) * 8);
+        if (!objs[n]) break;
+    }
+    uint64_t t1 = rdtsc();
+    // Free every other object first (interleaved with live ones), then the rest.
+    for (uint32_t i = 0; i < n; i += 2) free(objs[i]);
+    for (uint32_t i = 1; i < n; i += 2) free(objs[i]);
+    uint64_t t2 = rdtsc();
+    vfree(objs);
+
+    info_printf("bench: slab %u live objects: malloc %llu cycles/op, free %llu cycles/op\n", n,
+                (unsigned long long)(n ? (t1 - t0) / n : 0),
+                (unsigned long long)(n ? (t2 - t1) / n : 0));
+}
+
+// ---------------------------------------------------------------------------
+// Slab fast path: allocate/free bursts smaller than a magazine so every
+// operation stays on this CPU's loaded magazine.
+
+#define SLAB_PAIR_ITERS 100000
+#define SLAB_PAIR_BURST 16
+
+void mm_bench_slab_pair(void) {
+    void *burst[SLAB_PAIR_BURST];
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < SLAB_PAIR_ITERS; i++) {
+        for (uint32_t k = 0; k < SLAB_PAIR_BURST; k++) burst[k] = malloc(64);
+        for (uint32_t k = 0; k < SLAB_PAIR_BURST; k++) free(burst[k]);
+    }
+    uint64_t t1 = rdtsc();
+    info_printf("bench: slab malloc+free pair (64B, burst %u): %llu cycles\n", (unsigned)SLAB_PAIR_BURST,
+                (unsigned long long)((t1 - t0) / ((uint64_t)SLAB_PAIR_ITERS * SLAB_PAIR_BURST)));
+}
+
+// ---------------------------------------------------------------------------
+// Scaling: the same loop on 1, 2, 4 ... CPUs at once through
+// smp_run_on_cpus(). Every CPU waits at a start line so the loops overlap,
+// and a run lasts as long as its slowest CPU.
+
+typedef struct scale_bench {
+    void (*loop)(void);
+    uint32_t cpus;
+    uint32_t arrived;
+    uint64_t slowest_ns;
+} scale_bench_t;
+
+static void scale_bench_worker(void *arg) {
+    scale_bench_t *b = arg;
+    __atomic_fetch_add(&b->arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&b->arrived, __ATOMIC_ACQUIRE) < b->cpus) __asm__ __volatile__("pause");
+    uint64_t t0 = timebase_monotonic_ns();
+    b->loop();
+    uint64_t dt = timebase_monotonic_ns() - t0;
+    uint64_t cur = __atomic_load_n(&b->slowest_ns, __ATOMIC_RELAXED);
+    while (dt > cur && !__atomic_compare_exchange_n(&b->slowest_ns, &cur, dt, false,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Reports total ops/s for each CPU count, 'ops' being one CPU's loop.
+static void scale_bench_run(const char *name, void (*loop)(void), uint64_t ops) {
+    uint32_t ncpu = smp_cpu_count();
+    for (uint32_t cpus = 1;; cpus = cpus * 2 < ncpu ? cpus * 2 : ncpu) {
+        scale_bench_t b = { .loop = loop, .cpus = cpus };
+        if (!smp_run_on_cpus(cpus, scale_bench_worker, &b)) {
+            error_printf("bench: %s: %u cpus not available\n", name, cpus);
+            return;
+        }
+        uint64_t rate = b.slowest_ns ? ops * cpus * 1000000000ULL / b.slowest_ns : 0;
+        info_printf("bench: %s on %u cpus: %llu ops/s (%llu per cpu)\n", name, cpus,
+                    (unsigned long long)rate, (unsigned long long)(rate / cpus));
+        if (cpus == ncpu) return;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Slab scaling: the slab pair loop on every CPU at once. Each CPU works on
+// its own magazine, so ops/s should grow with the CPU count.
+
+#define SLAB_SCALE_ITERS 20000
+
+static void slab_scale_loop(void) {
+    void *burst[SLAB_PAIR_BURST];
+    for (uint32_t i = 0; i < SLAB_SCALE_ITERS; i++) {
+        for (uint32_t k = 0; k < SLAB_PAIR_BURST; k++) burst[k] = malloc(64);
+        for (uint32_t k = 0; k < SLAB_PAIR_BURST; k++) free(burst[k]);
+    }
+}
+
+void mm_bench_slab_scale(void) {
+    scale_bench_run("slab malloc+free (64B)", slab_scale_loop, (uint64_t)SLAB_SCALE_ITERS * SLAB_PAIR_BURST * 2);
+}
+
+// ---------------------------------------------------------------------------
+// kmem caches: a 200-byte object whose 128-byte table is set up once by the
+// constructor, versus malloc() plus re-initialising it on every allocation.
+
+typedef struct bench_obj {
+    uint64_t table[16];
+    uint8_t payload[72];
+} bench_obj_t;
+
+static void bench_obj_ctor(void *p) {
+    bench_obj_t *o = p;
+    for (int i = 0; i < 16; i++) o->table[i] = (uint64_t)i * 0x9E3779B97F4A7C15ULL;
+}
+
+#define KMEM_BENCH_ITERS 100000
+
+void mm_bench_kmem_cache(void) {
+    static kmem_cache_t *cache;
+    if (!cache) cache = kmem_cache_create("bench-obj", sizeof(bench_obj_t), 0, bench_obj_ctor);
+    if (!cache) { error_printf("bench: kmem_cache setup failed\n"); return; }
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < KMEM_BENCH_ITERS; i++) {
+        bench_obj_t *o = malloc(sizeof(*o));
+        if (!o) break;
+        bench_obj_ctor(o);
+        o->payload[0] = (uint8_t)i;
+        free(o);
+    }
+    uint64_t t1 = rdtsc();
+    for (uint32_t i = 0; i < KMEM_BENCH_ITERS; i++) {
+        bench_obj_t *o = kmem_cache_alloc(cache);
+        if (!o) break;
+        o->payload[0] = (uint8_t)i;
+        kmem_cache_free(cache, o);
+    }
+    uint64_t t2 = rdtsc();
+
+    kmem_cache_stats_t st;
+    kmem_cache_get_stats(cache, &st);
+    info_printf("bench: 200B object: malloc+init %llu cycles, kmem_cache %llu cycles (obj %zu, ctor calls %llu)\n",
+                (unsigned long long)((t1 - t0) / KMEM_BENCH_ITERS),
+                (unsigned long long)((t2 - t1) / KMEM_BENCH_ITERS),
+                st.obj_size, (unsigned long long)st.ctor_calls);
+}
+
+// ---------------------------------------------------------------------------
+// Slab reclaim: 64k objects of 128 bytes, freed again; then a shrinker pass.
+
+#define RECLAIM_BENCH_OBJS 65536
+
+void mm_bench_slab_reclaim(void) {
+    static kmem_cache_t *cache;
+    if (!cache) cache = kmem_cache_create("bench-burst", 128, 0, NULL);
+    void **objs = vmalloc(RECLAIM_BENCH_OBJS * sizeof(void *));
+    if (!cache || !objs) { error_printf("bench: slab_reclaim setup failed\n"); vfree(objs); return; }
+
+    size_t free0 = palloc_get_free_page_count();
+    uint32_t n = 0;
+    for (; n < RECLAIM_BENCH_OBJS; n++) {
+        objs[n] = kmem_cache_alloc(cache);
+        if (!objs[n]) break;
+    }
+    kmem_cache_stats_t peak, after, shrunk;
+    kmem_cache_get_stats(cache, &peak);
+    size_t free1 = palloc_get_free_page_count();
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < n; i++) kmem_cache_free(cache, objs[i]);
+    uint64_t t1 = rdtsc();
+    vfree(objs);
+    (void)vheap_purge();
+    kmem_cache_get_stats(cache, &after);
+    size_t free2 = palloc_get_free_page_count();
+
+    size_t got = shrinker_run((size_t)-1);
+    kmem_cache_get_stats(cache, &shrunk);
+
+    info_printf("bench: slab burst %u objs: %zu pages used, %llu slabs; after free %llu slabs (%llu cycles/free), %zu pages back; shrinker +%zu pages, %llu slabs left\n",
+                n, free0 - free1, (unsigned long long)peak.slabs, (unsigned long long)after.slabs,
+                (unsigned long long)(n ? (t1 - t0) / n : 0), free2 > free1 ? free2 - free1 : 0,
+                got, (unsigned long long)shrunk.slabs);
+}
+
+// ---------------------------------------------------------------------------
+// One-page slabs from the HHDM versus from vheap: cost of growing a cache by
+// many slabs, then of touching every object (TLB reach).
+
+#define DIRECT_BENCH_OBJS 8192
+
+static void slab_direct_pass(kmem_cache_t *cache, void **objs, bool direct, uint64_t *grow, uint64_t *touch,
+                             uint64_t *slabs) {
+    slab_set_direct_map(direct);
+    uint64_t t0 = rdtsc();
+    uint32_t n = 0;
+    for (; n < DIRECT_BENCH_OBJS; n++) {
+        objs[n] = kmem_cache_alloc(cache);
+        if (!objs[n]) break;
+    }
+    uint64_t t1 = rdtsc();
+    for (int r = 0; r < 4; r++) {
+        for (uint32_t i = 0; i < n; i++) (void)*(volatile uint64_t *)objs[i];
+    }
+    uint64_t t2 = rdtsc();
+    kmem_cache_stats_t st;
+    kmem_cache_get_stats(cache, &st);
+    for (uint32_t i = 0; i < n; i++) kmem_cache_free(cache, objs[i]);
+    slab_set_direct_map(true);
+    (void)shrinker_run((size_t)-1);
+    *slabs = st.slabs;
+    *grow = st.slabs ? (t1 - t0) / st.slabs : 0;
+    *touch = n ? (t2 - t1) / (4 * (uint64_t)n) : 0;
+}
+
+void mm_bench_slab_direct(void) {
+    static kmem_cache_t *hhdm, *mapped;
+    if (!hhdm) hhdm = kmem_cache_create("bench-hhdm", 256, 0, NULL);
+    if (!mapped) mapped = kmem_cache_create("bench-vheap", 256, 0, NULL);
+    void **objs = vmalloc(DIRECT_BENCH_OBJS * sizeof(void *));
+    if (!hhdm || !mapped || !objs) { error_printf("bench: slab_direct setup failed\n"); vfree(objs); return; }
+    uint64_t g0, t0, s0, g1, t1, s1;
+    slab_direct_pass(mapped, objs, false, &g0, &t0, &s0);
+    slab_direct_pass(hhdm, objs, true, &g1, &t1, &s1);
+    info_printf("bench: one-page slab growth: vheap %llu slabs at %llu cycles/slab, %llu cycles/touch; HHDM %llu slabs at %llu cycles/slab, %llu cycles/touch\n",
+                (unsigned long long)s0, (unsigned long long)g0, (unsigned long long)t0,
+                (unsigned long long)s1, (unsigned long long)g1, (unsigned long long)t1);
+    vfree(objs);
+}
+
+// ---------------------------------------------------------------------------
+// Size-class fragmentation: trace a mixed workload of awkward sizes and
+// compare the recorded peak footprint under the old and current layouts.
+
+#define FRAG_BENCH_LIVE 8192
+
+static const uint16_t frag_sizes[] = { 24, 40, 72, 136, 200, 320, 520, 600, 1100, 1800, 3000, 5000, 9000 };
+
+void mm_bench_slab_frag(void) {
+    void **objs = vmalloc(FRAG_BENCH_LIVE * sizeof(void *));
+    if (!objs || slab_trace_start(4 * FRAG_BENCH_LIVE) != 0) {
+        error_printf("bench: slab_frag setup failed\n");
+        vfree(objs);
+        return;
+    }
+    const size_t nsizes = sizeof(frag_sizes) / sizeof(frag_sizes[0]);
+    uint32_t seed = 0x2545F491u;
+    for (uint32_t i = 0; i < FRAG_BENCH_LIVE; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        objs[i] = malloc(frag_sizes[(seed >> 16) % nsizes]);
+    }
+    // Churn half of the objects into different sizes
+    for (uint32_t i = 0; i < FRAG_BENCH_LIVE; i += 2) {
+        free(objs[i]);
+        seed = seed * 1664525u + 1013904223u;
+        objs[i] = malloc(frag_sizes[(seed >> 16) % nsizes]);
+    }
+    for (uint32_t i = 0; i < FRAG_BENCH_LIVE; i++) free(objs[i]);
+    slab_trace_stop();
+    vfree(objs);
+    slab_frag_report();
+}
+
+// ---------------------------------------------------------------------------
+// Stelloc latency on a fragmented heap: allocate blocks of mixed sizes, free
+// every other one, then time alloc/free pairs against the holes.
+
+#define STELLOC_BENCH_BLOCKS 4096
+#define STELLOC_BENCH_ITERS  20000
+
+void mm_bench_stelloc(void) {
+    void **blocks = vmalloc(STELLOC_BENCH_BLOCKS * sizeof(void *));
+    if (!blocks) { error_printf("bench: stelloc setup failed\n"); return; }
+    uint32_t seed = 0x9E3779B9u;
+    for (uint32_t i = 0; i < STELLOC_BENCH_BLOCKS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        blocks[i] = stelloc_allocate(64 + (seed >> 16) % 8192);
+    }
+    for (uint32_t i = 0; i < STELLOC_BENCH_BLOCKS; i += 2) { stelloc_free(blocks[i]); blocks[i] = NULL; }
+
+    uint64_t total = 0, worst = 0;
+    for (uint32_t i = 0; i < STELLOC_BENCH_ITERS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        uint64_t t0 = rdtsc();
+        void *p = stelloc_allocate(64 + (seed >> 16) % 8192);
+        stelloc_free(p);
+        uint64_t dt = rdtsc() - t0;
+        total += dt;
+        if (dt > worst) worst = dt;
+    }
+    for (uint32_t i = 1; i < STELLOC_BENCH_BLOCKS; i += 2) stelloc_free(blocks[i]);
+    vfree(blocks);
+    info_printf("bench: stelloc alloc+free on fragmented heap (%u holes): %llu cycles avg, %llu worst\n",
+                (unsigned)(STELLOC_BENCH_BLOCKS / 2), (unsigned long long)(total / STELLOC_BENCH_ITERS),
+                (unsigned long long)worst);
+    stelloc_dump_stats();
+}
+
+// ---------------------------------------------------------------------------
+// Stelloc scaling: bursts of mixed-size stelloc blocks on every CPU at once.
+// CPUs allocate from their own arenas, so ops/s should grow with the CPU
+// count until CPUs start sharing an arena past STELLOC_ARENAS.
+
+#define STELLOC_SCALE_ITERS 4000
+#define STELLOC_SCALE_BURST 16
+
+static void stelloc_scale_loop(void) {
+    void *burst[STELLOC_SCALE_BURST];
+    uint32_t seed = 0x9E3779B9u;
+    for (uint32_t i = 0; i < STELLOC_SCALE_ITERS; i++) {
+        for (uint32_t k = 0; k < STELLOC_SCALE_BURST; k++) {
+            seed = seed * 1664525u + 1013904223u;
+            burst[k] = stelloc_allocate(64 + (seed >> 16) % 8192);
+        }
+        for (uint32_t k = 0; k < STELLOC_SCALE_BURST; k++) stelloc_free(burst[k]);
+    }
+}
+
+void mm_bench_stelloc_scale(void) {
+    scale_bench_run("stelloc alloc+free (64B-8KiB)", stelloc_scale_loop,
+                    (uint64_t)STELLOC_SCALE_ITERS * STELLOC_SCALE_BURST * 2);
+    stelloc_dump_stats();
+}
+
+// ---------------------------------------------------------------------------
+// Stelloc growth: the same allocation burst under the fixed SMART batch and
+// under the adaptive controller. Both bursts stay live until the end, so
+// each one has to grow the heap by itself.
+
+#define GROWTH_BENCH_BLOCKS 2048
+
+static uint64_t growth_bench_burst(void **blocks, stelloc_growth_stats_t *delta) {
+    stelloc_growth_stats_t before;
+    stelloc_get_growth_stats(&before);
+    uint32_t seed = 0x2545F491u;
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < GROWTH_BENCH_BLOCKS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        blocks[i] = stelloc_allocate(1024 + (seed >> 16) % 7168);
+    }
+    uint64_t cycles = rdtsc() - t0;
+    stelloc_get_growth_stats(delta);
+    delta->grows -= before.grows;
+    delta->grow_pages -= before.grow_pages;
+    delta->up -= before.up;
+    delta->down -= before.down;
+    delta->hold -= before.hold;
+    return cycles;
+}
+
+void mm_bench_growth(void) {
+    void **blocks = vmalloc(2 * GROWTH_BENCH_BLOCKS * sizeof(void *));
+    if (!blocks) { error_printf("bench: growth setup failed\n"); return; }
+    int mode = stelloc_get_mode();
+    static const int modes[2] = { STELLOC_SMART, STELLOC_ADAPTIVE };
+    static const char *names[2] = { "smart", "adaptive" };
+    for (int m = 0; m < 2; m++) {
+        stelloc_growth_stats_t d;
+        stelloc_set_mode(modes[m]);
+        uint64_t cycles = growth_bench_burst(blocks + m * GROWTH_BENCH_BLOCKS, &d);
+        info_printf("bench: growth %-8s %u allocs: %llu cycles/alloc, %llu grows (%llu pages), up %llu down %llu, batch now %llu pages\n",
+                    names[m], (unsigned)GROWTH_BENCH_BLOCKS, (unsigned long long)(cycles / GROWTH_BENCH_BLOCKS),
+                    (unsigned long long)d.grows, (unsigned long long)d.grow_pages, (unsigned long long)d.up,
+                    (unsigned long long)d.down, (unsigned long long)d.batch_max);
+    }
+    stelloc_set_mode(mode);
+    for (uint32_t i = 0; i < 2 * GROWTH_BENCH_BLOCKS; i++) stelloc_free(blocks[i]);
+    vfree(blocks);
+}
+
+// ---------------------------------------------------------------------------
+// Large buffers interleaved with small objects: cost of the direct path and
+// how many frames are back in palloc as soon as the buffers are freed.
+
+#define LARGE_BENCH_BUFS  64
+#define LARGE_BENCH_SIZE  (128 * 1024)
+
+void mm_bench_large(void) {
+    void *bufs[LARGE_BENCH_BUFS], *small[LARGE_BENCH_BUFS];
+    uint64_t t_alloc = 0, t_free = 0;
+    uint32_t n = 0;
+    for (; n < LARGE_BENCH_BUFS; n++) {
+        uint64_t t0 = rdtsc();
+        bufs[n] = malloc(LARGE_BENCH_SIZE);
+        t_alloc += rdtsc() - t0;
+        small[n] = malloc(SLAB_MAX_SIZE + 64);
+        if (!bufs[n] || !small[n]) { free(bufs[n]); free(small[n]); break; }
+        memset(bufs[n], 0x5A, 64);
+    }
+    size_t free0 = palloc_get_free_page_count();
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t t0 = rdtsc();
+        free(bufs[i]);
+        t_free += rdtsc() - t0;
+    }
+    size_t free1 = palloc_get_free_page_count();
+    for (uint32_t i = 0; i < n; i++) free(small[i]);
+    info_printf("bench: large %u x %u KiB: %llu cycles/malloc, %llu cycles/free, %zu pages back on free\n",
+                n, (unsigned)(LARGE_BENCH_SIZE >> 10), (unsigned long long)(n ? t_alloc / n : 0),
+                (unsigned long long)(n ? t_free / n : 0), free1 > free0 ? free1 - free0 : 0);
+    stelloc_dump_stats();
+}
+
+// ---------------------------------------------------------------------------
+// realloc growth: append 256 bytes at a time to one buffer, as a log or an
+// environ array would, and count how often the block had to move.
+
+#define REALLOC_BENCH_STEPS 2048
+#define REALLOC_BENCH_STEP  256
+
+void mm_bench_realloc(void) {
+    uint8_t *buf = NULL;
+    uint32_t moves = 0;
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 1; i <= REALLOC_BENCH_STEPS; i++) {
+        uint8_t *grown = realloc(buf, (size_t)i * REALLOC_BENCH_STEP);
+        if (!grown) { error_printf("bench: realloc failed at step %u\n", i); break; }
+        if (grown != buf) moves++;
+        buf = grown;
+        buf[(size_t)i * REALLOC_BENCH_STEP - 1] = (uint8_t)i;
+    }
+    uint64_t t1 = rdtsc();
+    free(buf);
+    info_printf("bench: realloc growth to %u KiB in %u-byte steps: %u moves, %llu cycles/step\n",
+                (unsigned)(REALLOC_BENCH_STEPS * REALLOC_BENCH_STEP / 1024), (unsigned)REALLOC_BENCH_STEP,
+                moves, (unsigned long long)((t1 - t0) / REALLOC_BENCH_STEPS));
+}
+
+// ---------------------------------------------------------------------------
+// calloc: a multi-megabyte buffer of which only a few pages get used, and
+// runs of buffers around the slab and large thresholds once the idle task
+// has zeroed pages ahead, each against malloc + memset. The medium runs time
+// the frees as well: a large block is unmapped on free, with a shootdown to
+// every other online CPU.
+
+#define CALLOC_BENCH_LARGE   (4 * 1024 * 1024)
+#define CALLOC_BENCH_TOUCH   8
+#define CALLOC_BENCH_BUFS    32
+
+static const uint32_t calloc_bench_sizes[] = { 16 * 1024, 32 * 1024, 64 * 1024, 256 * 1024 };
+
+static uint64_t calloc_bench_large(bool zeroed) {
+    uint64_t t0 = rdtsc();
+    uint8_t *p = zeroed ? calloc(1, CALLOC_BENCH_LARGE) : malloc(CALLOC_BENCH_LARGE);
+    if (!p) return 0;
+    if (!zeroed) memset(p, 0, CALLOC_BENCH_LARGE);
+    for (uint32_t i = 0; i < CALLOC_BENCH_TOUCH; i++) p[(size_t)i * (CALLOC_BENCH_LARGE / CALLOC_BENCH_TOUCH)] = 1;
+    uint64_t dt = rdtsc() - t0;
+    free(p);
+    return dt;
+}
+
+// Cycles per buffer for the allocations and for the frees of one run.
+static void calloc_bench_medium(bool zeroed, size_t size, uint64_t *alloc, uint64_t *release) {
+    void *bufs[CALLOC_BENCH_BUFS];
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < CALLOC_BENCH_BUFS; i++) {
+        bufs[i] = zeroed ? calloc(1, size) : malloc(size);
+        if (bufs[i] && !zeroed) memset(bufs[i], 0, size);
+    }
+    uint64_t t1 = rdtsc();
+    for (uint32_t i = 0; i < CALLOC_BENCH_BUFS; i++) free(bufs[i]);
+    uint64_t t2 = rdtsc();
+    *alloc = (t1 - t0) / CALLOC_BENCH_BUFS;
+    *release = (t2 - t1) / CALLOC_BENCH_BUFS;
+}
+
+void mm_bench_calloc(void) {
+    vheap_fault_stats_t f0, f1;
+    uint64_t plain = calloc_bench_large(false);
+    vheap_get_fault_stats(&f0);
+    uint64_t zeroed = calloc_bench_large(true);
+    vheap_get_fault_stats(&f1);
+    info_printf("bench: calloc %u KiB, %u pages touched: malloc+memset %llu cycles, calloc %llu cycles (%llu faults, %llu pages)\n",
+                (unsigned)(CALLOC_BENCH_LARGE >> 10), (unsigned)CALLOC_BENCH_TOUCH, (unsigned long long)plain,
+                (unsigned long long)zeroed, (unsigned long long)(f1.faults - f0.faults),
+                (unsigned long long)(f1.pages_faulted - f0.pages_faulted));
+
+    for (size_t s = 0; s < sizeof(calloc_bench_sizes) / sizeof(calloc_bench_sizes[0]); s++) {
+        size_t size = calloc_bench_sizes[s];
+        uint64_t plain_alloc, plain_free, zero_alloc, zero_free;
+        calloc_bench_medium(false, size, &plain_alloc, &plain_free);
+        size_t filled = palloc_zero_refill(PALLOC_ZERO_POOL_PAGES); // what the idle task would have done
+        calloc_bench_medium(true, size, &zero_alloc, &zero_free);
+        info_printf("bench: calloc %u x %u KiB on %u cpus: malloc+memset %llu+%llu free = %llu cycles/buf, "
+                    "calloc %llu+%llu free = %llu cycles/buf (%zu pages zeroed ahead)\n",
+                    (unsigned)CALLOC_BENCH_BUFS, (unsigned)(size >> 10), smp_cpu_count(),
+                    (unsigned long long)plain_alloc, (unsigned long long)plain_free,
+                    (unsigned long long)(plain_alloc + plain_free),
+                    (unsigned long long)zero_alloc, (unsigned long long)zero_free,
+                    (unsigned long long)(zero_alloc + zero_free), filled);
+    }
+    stelloc_dump_stats();
+}
+
+// ---------------------------------------------------------------------------
+// Heap profiler: malloc/free pair cost with the profiler off and on, from two
+// call sites with different size and lifetime mixes, then the site report.
+
+#define HEAPPROF_BENCH_ITERS    20000
+#define HEAPPROF_BENCH_KEEP     256
+#define HEAPPROF_BENCH_INTERVAL (64 * 1024)
+
+static __attribute__((noinline)) void *heapprof_bench_small(uint32_t i) {
+    return malloc(16 + (i % 8) * 16);
+}
+
+static __attribute__((noinline)) void *heapprof_bench_large(uint32_t i) {
+    return malloc(2048 + (i % 4) * 4096);
+}
+
+static uint64_t heapprof_bench_pass(void **keep) {
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < HEAPPROF_BENCH_ITERS; i++) {
+        // Small objects die at once, large ones live for a while.
+        free(heapprof_bench_small(i));
+        uint32_t k = i % HEAPPROF_BENCH_KEEP;
+        free(keep[k]);
+        keep[k] = heapprof_bench_large(i);
+    }
+    return (rdtsc() - t0) / HEAPPROF_BENCH_ITERS;
+}
+
+void mm_bench_heapprof(void) {
+    void **keep = calloc(HEAPPROF_BENCH_KEEP, sizeof(void *));
+    if (!keep) { error_printf("bench: heapprof: no memory\n"); return; }
+    uint64_t off = heapprof_bench_pass(keep);
+    uint64_t on = 0;
+    if (heapprof_start(HEAPPROF_BENCH_INTERVAL) == 0) {
+        on = heapprof_bench_pass(keep);
+    } else {
+        error_printf("bench: heapprof: start failed\n");
+    }
+    heapprof_stop();
+    info_printf("bench: heapprof %u iterations: %llu cycles/iter off, %llu on (1 sample per %u bytes)\n",
+                (unsigned)HEAPPROF_BENCH_ITERS, (unsigned long long)off, (unsigned long long)on,
+                (unsigned)HEAPPROF_BENCH_INTERVAL);
+    heapprof_report();
+    for (uint32_t k = 0; k < HEAPPROF_BENCH_KEEP; k++) free(keep[k]);
+    free(keep);
+}
+
+// ---------------------------------------------------------------------------
+// Arena: a burst of small objects that die together, through malloc/free
+// and through an arena reset after each burst, plus the per-CPU scratch arena.
+
+#define ARENA_BENCH_OBJS   512
+#define ARENA_BENCH_ROUNDS 64
+
+void mm_bench_arena(void) {
+    void **objs = malloc(ARENA_BENCH_OBJS * sizeof(void *));
+    arena_t *a = arena_create(0, 0);
+    if (!objs || !a) {
+        error_printf("bench: arena: no memory\n");
+        free(objs);
+        arena_destroy(a);
+        return;
+    }
+    uint64_t t0 = rdtsc();
+    for (uint32_t r = 0; r < ARENA_BENCH_ROUNDS; r++) {
+        for (uint32_t i = 0; i < ARENA_BENCH_OBJS; i++) objs[i] = malloc(16 + (i % 16) * 16);
+        for (uint32_t i = 0; i < ARENA_BENCH_OBJS; i++) free(objs[i]);
+    }
+    uint64_t t1 = rdtsc();
+    for (uint32_t r = 0; r < ARENA_BENCH_ROUNDS; r++) {
+        for (uint32_t i = 0; i < ARENA_BENCH_OBJS; i++) objs[i] = arena_alloc(a, 16 + (i % 16) * 16);
+        arena_reset(a);
+    }
+    uint64_t t2 = rdtsc();
+    for (uint32_t r = 0; r < ARENA_BENCH_ROUNDS; r++) {
+        arena_scratch_t sc;
+        arena_t *s = arena_scratch_begin(&sc);
+        if (s) {
+            for (uint32_t i = 0; i < ARENA_BENCH_OBJS; i++) objs[i] = arena_alloc(s, 16 + (i % 16) * 16);
+        }
+        arena_scratch_end(&sc);
+    }
+    uint64_t t3 = rdtsc();
+    uint64_t n = (uint64_t)ARENA_BENCH_ROUNDS * ARENA_BENCH_OBJS;
+    info_printf("bench: arena burst of %u objects: malloc/free %llu cycles/obj, arena %llu, scratch %llu\n",
+                (unsigned)ARENA_BENCH_OBJS, (unsigned long long)((t1 - t0) / n),
+                (unsigned long long)((t2 - t1) / n), (unsigned long long)((t3 - t2) / n));
+    arena_destroy(a);
+    free(objs);
+}
+
+// ---------------------------------------------------------------------------
+// Framebuffer: full console redraw through the bootloader's mapping and
+// through UC, WT and WC aliases of the same frames.
+
+#define FB_BENCH_REDRAWS 4
+
+static uint64_t fb_bench_redraw(void *base) {
+    void *old = displaystandard_set_mapping(base);
+    displaystandard_redraw(); // warm the TLB
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < FB_BENCH_REDRAWS; i++) displaystandard_redraw();
+    uint64_t cycles = (rdtsc() - t0) / FB_BENCH_REDRAWS;
+    displaystandard_set_mapping(old);
+    return cycles;
+}
+
+void mm_bench_fb(void) {
+    uint64_t phys;
+    size_t size;
+    if (!displaystandard_fb_region(&phys, &size)) { error_printf("bench: fb: no framebuffer\n"); return; }
+    void *uc = ioremap_uc(phys, size);
+    void *wt = ioremap_wt(phys, size);
+    void *wc = ioremap_wc(phys, size);
+    if (!uc || !wt || !wc) {
+        error_printf("bench: fb: ioremap failed\n");
+    } else {
+        void *boot = (void *)(uintptr_t)(phys + hhdm_request.response->offset);
+        uint64_t c_boot = fb_bench_redraw(boot);
+        uint64_t c_uc = fb_bench_redraw(uc);
+        uint64_t c_wt = fb_bench_redraw(wt);
+        uint64_t c_wc = fb_bench_redraw(wc);
+        // The boot mapping may be write-back: write its lines out before the
+        // console carries on through WC, or late evictions would overwrite it.
+        __asm__ volatile ("wbinvd" ::: "memory");
+        displaystandard_redraw();
+        info_printf("bench: fb redraw of %zu KiB: %llu cycles boot mapping, %llu UC, %llu WT, %llu WC%s\n",
+                    size >> 10, (unsigned long long)c_boot, (unsigned long long)c_uc,
+                    (unsigned long long)c_wt, (unsigned long long)c_wc,
+                    vmm_pat_supported() ? "" : " (no PAT: WC mapped UC-)");
+    }
+    if (uc) iounmap(uc, size);
+    if (wt) iounmap(wt, size);
+    if (wc) iounmap(wc, size);
+}
+
+// ---------------------------------------------------------------------------
+// ioremap: repeated probing of a live register block (reference only) and
+// full map/unmap cycles of a framebuffer-sized range.
+
+#define IOREMAP_BENCH_PROBES 1000
+#define IOREMAP_BENCH_CYCLES 16
+
+void mm_bench_ioremap(void) {
+    uint64_t lapic = acpi_lapic_phys();
+    uint64_t probe = 0;
+    if (lapic) {
+        uint64_t t0 = rdtsc();
+        for (int i = 0; i < IOREMAP_BENCH_PROBES; i++) {
+            void *p = ioremap_uc(lapic, 0x1000);
+            if (!p) break;
+            iounmap(p, 0x1000);
+        }
+        probe = (rdtsc() - t0) / IOREMAP_BENCH_PROBES;
+    }
+    uint64_t phys;
+    size_t size = 0;
+    uint64_t cycle = 0;
+    if (displaystandard_fb_region(&phys, &size)) {
+        uint64_t t0 = rdtsc();
+        for (int i = 0; i < IOREMAP_BENCH_CYCLES; i++) {
+            void *p = ioremap_wt(phys, size);
+            if (!p) break;
+            iounmap(p, size);
+        }
+        cycle = (rdtsc() - t0) / IOREMAP_BENCH_CYCLES;
+    }
+    info_printf("bench: ioremap LAPIC probe %llu cycles, %zu KiB map+unmap %llu cycles\n",
+                (unsigned long long)probe, size >> 10, (unsigned long long)cycle);
+    ioremap_dump();
+}
+
+void mm_bench_run(void) {
+    info_printf("bench: running memory-management benchmarks...\n");
+    mm_bench_pcid_switch();
+    mm_bench_map_range();
+    mm_bench_vmalloc();
+    mm_bench_vheap_reserve();
+    mm_bench_slab_free();
+    mm_bench_slab_pair();
+    mm_bench_slab_scale();
+    mm_bench_kmem_cache();
+    mm_bench_slab_reclaim();
+    mm_bench_slab_direct();
+    mm_bench_slab_frag();
+    mm_bench_stelloc();
+    mm_bench_stelloc_scale();
+    mm_bench_growth();
+    mm_bench_large();
+    mm_bench_realloc();
+    mm_bench_calloc();
+    mm_bench_heapprof();
+    mm_bench_arena();
+    mm_bench_fb();
+    mm_bench_ioremap();
+    kmem_cache_dump_stats();
+    shrinker_dump();
+    palloc_dump_nodes();
+    kfence_dump_stats();
+}
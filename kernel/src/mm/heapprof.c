@@ -0,0 +1,329 @@
+// Allocation-site heap profiler.
+//
+// Sampling is by bytes, not calls: each CPU counts down from about
+// 'interval' bytes and the allocation that crosses zero is sampled, so big
+// allocations are nearly always seen and a flood of tiny ones costs one
+// sample per interval. A sample stands for 'interval' bytes (its own size
+// when larger); the estimated columns of the report scale by that weight.
+//
+// Two open-addressed tables, both vmalloc'd by the first start and protected
+// by one lock: call sites keyed by return address, and sampled live objects
+// keyed by pointer. A free looks the pointer up to retire the sample, charge
+// its lifetime and drop the site's live bytes. Nearly all freed pointers were
+// never sampled, so a free first probes the live table without the lock and
+// only locks on a hit. The tables are cleared, not replaced, by later starts
+// so that probe never reads freed memory.
+
+#include <heapprof.h>
+#include <slab.h>
+#include <stelloc.h>
+#include <vheap.h>
+#include <lock.h>
+#include <smp.h>
+#include <cpu_local.h>
+#include <timebase.h>
+#include <tsc.h>
+#include <symbols.h>
+#include <lprintf.h>
+#include <string.h>
+
+#define HEAPPROF_SITES      1024    // power of two
+#define HEAPPROF_LIVE       16384   // power of two
+#define HEAPPROF_TOP        16      // sites shown by the report
+
+typedef struct heapprof_site {
+    void *ip;                       // NULL: unused entry
+    uint64_t samples, frees;
+    uint64_t live_bytes;            // estimated
+    uint64_t total_bytes;           // estimated
+    uint64_t lifetime[HEAPPROF_LIFETIME_BUCKETS];
+} heapprof_site_t;
+
+typedef struct heapprof_live {
+    uintptr_t ptr;                  // 0: unused entry
+    uint64_t weight;
+    uint64_t t_ns;
+    uint32_t site;
+} heapprof_live_t;
+
+bool heapprof_enabled;
+static spinlock_t prof_lock;
+static heapprof_site_t *sites;
+static heapprof_live_t *live;
+static heapprof_site_t overflow_site; // samples from sites past the table
+static uint32_t nr_sites, nr_live;
+static uint64_t dropped;              // samples lost to a full live table
+static size_t prof_interval;
+static uint64_t start_ns, stop_ns;
+static uint64_t countdown[SMP_MAX_CPUS];
+
+static inline uint32_t hash_ptr(uintptr_t v) {
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    return (uint32_t)v;
+}
+
+int heapprof_start(size_t interval) {
+    if (heapprof_enabled || interval == 0) return -1;
+    heapprof_site_t *s = NULL;
+    heapprof_live_t *l = NULL;
+    if (!sites) {
+        s = vmalloc(HEAPPROF_SITES * sizeof(heapprof_site_t));
+        l = vmalloc(HEAPPROF_LIVE * sizeof(heapprof_live_t));
+        if (!s || !l) {
+            if (s) vfree(s);
+            if (l) vfree(l);
+            return -1;
+        }
+        memset(s, 0, HEAPPROF_SITES * sizeof(heapprof_site_t));
+        memset(l, 0, HEAPPROF_LIVE * sizeof(heapprof_live_t));
+    }
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&prof_lock);
+    if (!sites) {
+        sites = s;
+        __atomic_store_n(&live, l, __ATOMIC_RELEASE);
+        s = NULL;
+        l = NULL;
+    } else {
+        // A free still finishing from the last run may be probing live[].
+        memset(sites, 0, HEAPPROF_SITES * sizeof(heapprof_site_t));
+        for (uint32_t i = 0; i < HEAPPROF_LIVE; i++) __atomic_store_n(&live[i].ptr, 0, __ATOMIC_RELAXED);
+    }
+    memset(&overflow_site, 0, sizeof(overflow_site));
+    nr_sites = nr_live = 0;
+    dropped = 0;
+    prof_interval = interval;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) countdown[i] = interval;
+    start_ns = timebase_monotonic_ns();
+    stop_ns = 0;
+    spin_unlock(&prof_lock);
+    cpu_irq_restore(irq);
+
+    // Lost a race with another first start; vfree may shoot down TLBs.
+    if (s) vfree(s);
+    if (l) vfree(l);
+    __atomic_store_n(&heapprof_enabled, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void heapprof_stop(void) {
+    if (!__atomic_exchange_n(&heapprof_enabled, false, __ATOMIC_ACQ_REL)) return;
+    stop_ns = timebase_monotonic_ns();
+}
+
+// Per-CPU byte countdown; a race with an interrupt on this CPU only skews
+// the sampling rate. The reload is jittered by up to +-1/4 so periodic
+// allocation patterns do not alias with the interval.
+static bool should_sample(size_t size) {
+    uint64_t *c = &countdown[cpu_local_index() % SMP_MAX_CPUS];
+    if (*c > size) { *c -= size; return false; }
+    uint64_t next = prof_interval;
+    if (next >= 4) next += (rdtsc() % (next / 2)) - next / 4;
+    *c = next ? next : 1;
+    return true;
+}
+
+static uint32_t site_index_locked(void *ip) {
+    uint32_t mask = HEAPPROF_SITES - 1;
+    for (uint32_t i = hash_ptr((uintptr_t)ip) & mask, n = 0; n < HEAPPROF_SITES; i = (i + 1) & mask, n++) {
+        if (sites[i].ip == ip) return i;
+        if (!sites[i].ip) {
+            // Keep the table at most 3/4 full so probes stay short.
+            if (nr_sites >= HEAPPROF_SITES / 4 * 3) break;
+            sites[i].ip = ip;
+            nr_sites++;
+            return i;
+        }
+    }
+    return HEAPPROF_SITES;
+}
+
+static inline heapprof_site_t *site_at(uint32_t idx) {
+    return idx < HEAPPROF_SITES ? &sites[idx] : &overflow_site;
+}
+
+static heapprof_live_t *live_find_locked(uintptr_t ptr) {
+    uint32_t mask = HEAPPROF_LIVE - 1;
+    for (uint32_t i = hash_ptr(ptr) & mask;; i = (i + 1) & mask) {
+        if (live[i].ptr == ptr) return &live[i];
+        if (!live[i].ptr) return NULL;
+    }
+}
+
+// Unlocked lookup for the free path. A writer moving entries under the lock
+// can make this miss a sampled pointer, which loses that one sample; the
+// probe is bounded since the table may change underneath it.
+static bool live_probe(uintptr_t ptr) {
+    heapprof_live_t *l = __atomic_load_n(&live, __ATOMIC_ACQUIRE);
+    if (!l || !__atomic_load_n(&nr_live, __ATOMIC_RELAXED)) return false;
+    uint32_t mask = HEAPPROF_LIVE - 1;
+    for (uint32_t i = hash_ptr(ptr) & mask, n = 0; n < HEAPPROF_LIVE; i = (i + 1) & mask, n++) {
+        uintptr_t v = __atomic_load_n(&l[i].ptr, __ATOMIC_RELAXED);
+        if (v == ptr) return true;
+        if (!v) return false;
+    }
+    return false;
+}
+
+// Linear probing with backward-shift deletion, so no tombstones pile up.
+static void live_remove_locked(heapprof_live_t *e) {
+    uint32_t mask = HEAPPROF_LIVE - 1;
+    uint32_t hole = (uint32_t)(e - live);
+    for (uint32_t i = (hole + 1) & mask; live[i].ptr; i = (i + 1) & mask) {
+        uint32_t home = hash_ptr(live[i].ptr) & mask;
+        // Move entry i into the hole unless its home lies in (hole, i].
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            live[hole] = live[i];
+            hole = i;
+        }
+    }
+    live[hole].ptr = 0;
+    nr_live--;
+}
+
+static uint32_t lifetime_bucket(uint64_t ns) {
+    uint32_t b = 0;
+    for (uint64_t limit = 1000; b < HEAPPROF_LIFETIME_BUCKETS - 1 && ns >= limit; limit *= 10) b++;
+    return b;
+}
+
+void heapprof_record_alloc(void *ptr, size_t size, void *site) {
+    if (!ptr || !should_sample(size)) return;
+    uint64_t now = timebase_monotonic_ns();
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&prof_lock);
+    if (sites) {
+        uint64_t weight = size > prof_interval ? size : prof_interval;
+        uint32_t idx = site_index_locked(site);
+        heapprof_site_t *s = site_at(idx);
+        s->samples++;
+        s->total_bytes += weight;
+        if (nr_live < HEAPPROF_LIVE / 4 * 3 && !live_find_locked((uintptr_t)ptr)) {
+            uint32_t mask = HEAPPROF_LIVE - 1;
+            uint32_t i = hash_ptr((uintptr_t)ptr) & mask;
+            while (live[i].ptr) i = (i + 1) & mask;
+            live[i].ptr = (uintptr_t)ptr;
+            live[i].weight = weight;
+            live[i].t_ns = now;
+            live[i].site = idx;
+            nr_live++;
+            s->live_bytes += weight;
+        } else {
+            dropped++;
+        }
+    }
+    spin_unlock(&prof_lock);
+    cpu_irq_restore(irq);
+}
+
+void heapprof_record_free(void *ptr) {
+    if (!ptr || !live_probe((uintptr_t)ptr)) return;
+    uint64_t now = timebase_monotonic_ns();
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&prof_lock);
+    heapprof_live_t *e = (live && nr_live) ? live_find_locked((uintptr_t)ptr) : NULL;
+    if (e) {
+        heapprof_site_t *s = site_at(e->site);
+        s->frees++;
+        s->live_bytes -= e->weight;
+        s->lifetime[lifetime_bucket(now - e->t_ns)]++;
+        live_remove_locked(e);
+    }
+    spin_unlock(&prof_lock);
+    cpu_irq_restore(irq);
+}
+
+void heapprof_record_retag(void *ptr, void *site) {
+    if (!ptr) return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&prof_lock);
+    heapprof_live_t *e = (live && nr_live) ? live_find_locked((uintptr_t)ptr) : NULL;
+    if (e) {
+        heapprof_site_t *from = site_at(e->site);
+        uint32_t idx = site_index_locked(site);
+        heapprof_site_t *to = site_at(idx);
+        if (to != from) {
+            from->samples--;
+            from->total_bytes -= e->weight;
+            from->live_bytes -= e->weight;
+            to->samples++;
+            to->total_bytes += e->weight;
+            to->live_bytes += e->weight;
+            e->site = idx;
+        }
+    }
+    spin_unlock(&prof_lock);
+    cpu_irq_restore(irq);
+}
+
+static void print_site(const heapprof_site_t *s, uint64_t elapsed_ms) {
+    const struct ksym *sym = s->ip ? symbol_lookup((uintptr_t)s->ip) : NULL;
+    // KiB/s over the profiling window
+    uint64_t rate = elapsed_ms ? (s->total_bytes * 1000 / elapsed_ms) >> 10 : 0;
+    if (sym) {
+        info_printf("heapprof: %p <%s+0x%llx>\n", s->ip, sym->name,
+                    (unsigned long long)((uintptr_t)s->ip - (sym->addr + symbols_get_slide())));
+    } else {
+        info_printf("heapprof: %p%s\n", s->ip, s->ip ? "" : " (site table full)");
+    }
+    info_printf("heapprof:   live %llu KiB, %llu KiB total at %llu KiB/s, samples %llu (%llu freed)\n",
+                (unsigned long long)(s->live_bytes >> 10), (unsigned long long)(s->total_bytes >> 10),
+                (unsigned long long)rate, (unsigned long long)s->samples, (unsigned long long)s->frees);
+    if (!s->frees) return;
+    const uint64_t *h = s->lifetime;
+    info_printf("heapprof:   lifetime <1us %llu <10us %llu <100us %llu <1ms %llu <10ms %llu <100ms %llu <1s %llu >=1s %llu\n",
+                (unsigned long long)h[0], (unsigned long long)h[1], (unsigned long long)h[2],
+                (unsigned long long)h[3], (unsigned long long)h[4], (unsigned long long)h[5],
+                (unsigned long long)h[6], (unsigned long long)h[7]);
+}
+
+void heapprof_report(void) {
+    static heapprof_site_t top[HEAPPROF_TOP + 1];
+    size_t ntop = 0;
+    uint32_t total_sites, total_live;
+    uint64_t lost, live_sum = 0, elapsed_ms;
+
+    // Pick the sites with the most live bytes under the lock, print after
+    // dropping it: the console is slow and other CPUs spin on this lock.
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&prof_lock);
+    if (!sites) {
+        spin_unlock(&prof_lock);
+        cpu_irq_restore(irq);
+        info_printf("heapprof: no profile recorded\n");
+        return;
+    }
+    for (uint32_t i = 0; i < HEAPPROF_SITES; i++) {
+        const heapprof_site_t *s = &sites[i];
+        if (!s->ip) continue;
+        live_sum += s->live_bytes;
+        size_t pos = ntop < HEAPPROF_TOP ? ntop++ : HEAPPROF_TOP;
+        if (pos == HEAPPROF_TOP && s->live_bytes <= top[HEAPPROF_TOP - 1].live_bytes) continue;
+        while (pos > 0 && top[pos - 1].live_bytes < s->live_bytes) {
+            if (pos < HEAPPROF_TOP) top[pos] = top[pos - 1];
+            pos--;
+        }
+        top[pos] = *s;
+    }
+    live_sum += overflow_site.live_bytes;
+    if (overflow_site.samples) top[ntop++] = overflow_site;
+    total_sites = nr_sites;
+    total_live = nr_live;
+    lost = dropped;
+    uint64_t end = stop_ns ? stop_ns : timebase_monotonic_ns();
+    elapsed_ms = (end - start_ns) / 1000000ULL;
+    spin_unlock(&prof_lock);
+    cpu_irq_restore(irq);
+
+    info_printf("heapprof: %u sites, %u live samples, ~%llu KiB live, interval %zu bytes, %llu ms%s\n",
+                (unsigned)total_sites, (unsigned)total_live, (unsigned long long)(live_sum >> 10), prof_interval,
+                (unsigned long long)elapsed_ms, heapprof_enabled ? " (running)" : "");
+    if (lost) info_printf("heapprof: %llu samples not tracked (live table full)\n", (unsigned long long)lost);
+    for (size_t i = 0; i < ntop; i++) print_site(&top[i], elapsed_ms);
+
+    kmem_cache_dump_fragmentation();
+    stelloc_dump_fragmentation();
+}
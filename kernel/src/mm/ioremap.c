@@ -1,38 +1,234 @@
+// MMIO mappings. Virtual space comes from a vrange window; every live
+// mapping is recorded with its physical range, memory type and a reference
+// count, so mapping a range that is already covered with the same type hands
+// back the existing VA. The last iounmap() unmaps the pages and returns the
+// VA to the window.
+//
+// Ranges of at least 2MiB are placed so that VA and PA agree modulo 2MiB and
+// their aligned middle is mapped with 2MiB pages: a framebuffer or PCIe
+// config window then costs a few PDEs instead of a page table per 2MiB.
+
 #include <ioremap.h>
 #include <vmm.h>
-#include <palloc.h>
+#include <vrange.h>
+#include <lock.h>
+#include <cpu_local.h>
 #include <lprintf.h>
 
-// Simple bump-pointer VM region for MMIO: 0xFFFF80C000000000 .. 0xFFFF80FFFF000000 (arbitrary)
 #define IOR_BASE  0xFFFF80C000000000ULL
-#define IOR_SIZE  (256ULL * 1024 * 1024) // 256 MiB window to start
+#define IOR_SIZE  (16ULL * 1024 * 1024 * 1024) // below the KFENCE pool
+#define IOR_MAX_MAPS 128
 
-static uint64_t ior_next = IOR_BASE;
-static const uint64_t ior_end = IOR_BASE + IOR_SIZE;
+#define PAGE_SIZE  0x1000ULL
+#define LARGE_SIZE 0x200000ULL
 
-void* ioremap(uint64_t phys, size_t size) {
+typedef struct ior_map {
+    uint64_t phys;      // page-aligned start of the mapped physical range
+    uint64_t len;       // bytes, page multiple
+    uint64_t va;        // VA of 'phys'
+    uint64_t range;     // vrange allocation holding 'va'
+    uint64_t cache;     // VMM_CACHE_* bits
+    uint32_t refs;      // 0: slot unused
+    uint32_t large;     // 2MiB pages in the mapping
+} ior_map_t;
+
+static vrange_t ior_range;
+static bool ior_ready;
+static spinlock_t ior_lock;
+static ior_map_t ior_maps[IOR_MAX_MAPS];
+static uint64_t ior_reused, ior_created, ior_removed;
+
+static inline uint64_t align_up(uint64_t x, uint64_t a) { return (x + (a - 1)) & ~(a - 1); }
+
+static const char *cache_name(uint64_t cache) {
+    switch (cache) {
+        case VMM_CACHE_WB: return "WB";
+        case VMM_CACHE_WT: return "WT";
+        case VMM_CACHE_UC_MINUS: return "UC-";
+        case VMM_CACHE_UC: return "UC";
+        case VMM_CACHE_WC: return "WC";
+        default: return "?";
+    }
+}
+
+// Caller holds ior_lock.
+static bool ior_init_locked(void) {
+    if (ior_ready) return true;
+    if (vrange_init(&ior_range, "ioremap", IOR_BASE, IOR_SIZE, 1) != 0) return false;
+    // Released MMIO ranges are unmapped straight away rather than batched:
+    // a stale mapping of a device that has moved on is not worth the saving.
+    ior_range.lazy_limit = 1;
+    ior_ready = true;
+    return true;
+}
+
+// Live mapping covering [pa, pa + len) with memory type 'cache'. Caller
+// holds ior_lock.
+static ior_map_t *find_covering(uint64_t pa, uint64_t len, uint64_t cache) {
+    for (size_t i = 0; i < IOR_MAX_MAPS; i++) {
+        ior_map_t *m = &ior_maps[i];
+        if (m->refs && m->cache == cache && pa >= m->phys && pa + len <= m->phys + m->len) return m;
+    }
+    return NULL;
+}
+
+// Map [pa, pa + len) at 'va' (congruent modulo 2MiB when len allows large
+// pages). Returns the number of 2MiB pages used, or -1.
+static long map_pages(uint64_t va, uint64_t pa, uint64_t len, uint64_t cache) {
+    uint64_t flags = VMM_P_PRESENT | VMM_P_WRITABLE | VMM_P_NX | cache;
+    uint64_t lo = align_up(pa, LARGE_SIZE);
+    uint64_t hi = (pa + len) & ~(LARGE_SIZE - 1);
+    if (len < LARGE_SIZE || hi <= lo) {
+        return vmm_map_range(va, pa, (size_t)(len >> 12), flags) ? -1 : 0;
+    }
+    long large = (long)((hi - lo) / LARGE_SIZE);
+    if (lo > pa && vmm_map_range(va, pa, (size_t)((lo - pa) >> 12), flags)) return -1;
+    if (vmm_map_large(va + (lo - pa), lo, (size_t)large, flags)) {
+        // A page table in the way that still maps something: use 4KiB pages.
+        if (vmm_map_range(va + (lo - pa), lo, (size_t)((hi - lo) >> 12), flags)) return -1;
+        large = 0;
+    }
+    if (pa + len > hi && vmm_map_range(va + (hi - pa), hi, (size_t)((pa + len - hi) >> 12), flags)) return -1;
+    return large;
+}
+
+static void* ioremap_prot(uint64_t phys, size_t size, uint64_t cache) {
     if (size == 0) return (void*)(uintptr_t)(phys + 0ULL); // degenerate
     // Align to 4K
     uint64_t pa = phys & ~0xFFFULL;
     uint64_t off = (uint64_t)phys & 0xFFFULL;
     uint64_t len = (size + off + 0xFFFULL) & ~0xFFFULL;
-    if (ior_next + len > ior_end) {
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&ior_lock);
+    if (!ior_init_locked()) {
+        spin_unlock(&ior_lock);
+        cpu_irq_restore(irq);
+        error_printf("ioremap: cannot set up the VM window\n");
+        return 0;
+    }
+    ior_map_t *m = find_covering(pa, len, cache);
+    if (m) {
+        m->refs++;
+        ior_reused++;
+        uint64_t va = m->va + (pa - m->phys) + off;
+        spin_unlock(&ior_lock);
+        cpu_irq_restore(irq);
+        return (void*)(uintptr_t)va;
+    }
+    spin_unlock(&ior_lock);
+    cpu_irq_restore(irq);
+
+    // Page-table edits and the vrange may shoot down TLBs: not under ior_lock.
+    uint64_t head = len >= LARGE_SIZE ? (pa & (LARGE_SIZE - 1)) : 0;
+    uint64_t range = vrange_alloc(&ior_range, (size_t)(head + len), len >= LARGE_SIZE ? LARGE_SIZE : PAGE_SIZE);
+    if (!range) {
         error_printf("ioremap: out of VM window (need %llu bytes)\n", (unsigned long long)len);
         return 0;
     }
-    uint64_t va = ior_next;
-    for (uint64_t i = 0; i < len; i += 0x1000ULL) {
-        int rc = vmm_map_page(va + i, pa + i, VMM_P_PRESENT | VMM_P_WRITABLE | VMM_P_NX);
-        if (rc) {
-            error_printf("ioremap: map fail pa=%#016llx va=%#016llx rc=%d\n", (unsigned long long)(pa+i), (unsigned long long)(va+i), rc);
-            return 0;
+    uint64_t va = range + head;
+    long large = map_pages(va, pa, len, cache);
+    if (large < 0) {
+        error_printf("ioremap: map fail pa=%#016llx va=%#016llx\n", (unsigned long long)pa, (unsigned long long)va);
+        (void)vrange_release(&ior_range, range, 0);
+        return 0;
+    }
+
+    irq = cpu_irq_save();
+    spin_lock(&ior_lock);
+    // Another CPU may have mapped the same range meanwhile; keep one.
+    m = find_covering(pa, len, cache);
+    if (m) {
+        m->refs++;
+        ior_reused++;
+    } else {
+        for (size_t i = 0; i < IOR_MAX_MAPS && !m; i++) {
+            if (!ior_maps[i].refs) m = &ior_maps[i];
+        }
+        if (m) {
+            *m = (ior_map_t){ .phys = pa, .len = len, .va = va, .range = range, .cache = cache,
+                              .refs = 1, .large = (uint32_t)large };
+            ior_created++;
+            range = 0;
         }
     }
-    ior_next += len;
-    debug_printf("ioremap: phys=%#016llx size=%llu -> va=%#016llx\n", (unsigned long long)phys, (unsigned long long)size, (unsigned long long)(va + off));
-    return (void*)(uintptr_t)(va + off);
+    uint64_t ret = m ? m->va + (pa - m->phys) + off : 0;
+    spin_unlock(&ior_lock);
+    cpu_irq_restore(irq);
+
+    if (range) (void)vrange_release(&ior_range, range, 0);
+    if (!m) {
+        error_printf("ioremap: more than %u live mappings\n", (unsigned)IOR_MAX_MAPS);
+        return 0;
+    }
+    debug_printf("ioremap: phys=%#016llx size=%llu %s -> va=%#016llx\n", (unsigned long long)phys,
+                 (unsigned long long)size, cache_name(cache), (unsigned long long)ret);
+    return (void*)(uintptr_t)ret;
+}
+
+void* ioremap(uint64_t phys, size_t size) {
+    return ioremap_prot(phys, size, VMM_CACHE_UC);
+}
+
+void* ioremap_uc(uint64_t phys, size_t size) {
+    return ioremap_prot(phys, size, VMM_CACHE_UC);
+}
+
+void* ioremap_wc(uint64_t phys, size_t size) {
+    // Without PAT the WC encoding would mean WT; UC- lets MTRRs still pick WC.
+    return ioremap_prot(phys, size, vmm_pat_supported() ? VMM_CACHE_WC : VMM_CACHE_UC_MINUS);
+}
+
+void* ioremap_wt(uint64_t phys, size_t size) {
+    return ioremap_prot(phys, size, VMM_CACHE_WT);
 }
 
 void iounmap(void* virt, size_t size) {
-    (void)virt; (void)size; // TODO: unmap when vmm_get/unmap exists
+    if (!virt || size == 0) return;
+    uint64_t va = (uint64_t)(uintptr_t)virt;
+    if (va < IOR_BASE || va >= IOR_BASE + IOR_SIZE) return; // not ours (e.g. degenerate size-0 mapping)
+    uint64_t range = 0;
+    bool found = false;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&ior_lock);
+    for (size_t i = 0; i < IOR_MAX_MAPS; i++) {
+        ior_map_t *m = &ior_maps[i];
+        if (!m->refs || va < m->va || va >= m->va + m->len) continue;
+        found = true;
+        if (--m->refs == 0) {
+            range = m->range;
+            ior_removed++;
+        }
+        break;
+    }
+    spin_unlock(&ior_lock);
+    cpu_irq_restore(irq);
+    if (!found) {
+        error_printf("iounmap: no mapping at va=%#016llx size=%llu\n", (unsigned long long)va, (unsigned long long)size);
+        return;
+    }
+    // MMIO frames are not palloc memory: the release drops the PTEs only.
+    if (range) (void)vrange_release(&ior_range, range, 0);
+}
+
+void ioremap_dump(void) {
+    uint32_t live = 0;
+    uint64_t small = 0, large = 0;
+    for (size_t i = 0; i < IOR_MAX_MAPS; i++) {
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&ior_lock);
+        ior_map_t m = ior_maps[i];
+        spin_unlock(&ior_lock);
+        cpu_irq_restore(irq);
+        if (!m.refs) continue;
+        live++;
+        large += m.large;
+        small += m.len / PAGE_SIZE - (uint64_t)m.large * (LARGE_SIZE / PAGE_SIZE);
+        info_printf("ioremap:   %#016llx+%#llx %-3s refs %u -> %#016llx (%u x 2MiB)\n",
+                    (unsigned long long)m.phys, (unsigned long long)m.len, cache_name(m.cache),
+                    (unsigned)m.refs, (unsigned long long)m.va, (unsigned)m.large);
+    }
+    info_printf("ioremap: %u live mappings, %llu 4KiB + %llu 2MiB pages; %llu created, %llu reused, %llu removed\n",
+                (unsigned)live, (unsigned long long)small, (unsigned long long)large,
+                (unsigned long long)ior_created, (unsigned long long)ior_reused, (unsigned long long)ior_removed);
 }
@@ -0,0 +1,264 @@
+// Sampled guarded allocations. The pool lives in its own VA window:
+//
+//   | guard | slot 0 | guard | slot 1 | guard | ... | slot N-1 | guard |
+//
+// Each slot owns one frame, mapped only while an object lives in it. Objects
+// on even slots end at the page end (overflows hit the next guard), odd
+// slots start at the page start (underflows hit the previous guard); the
+// rest of the page is filled with a canary checked on free. Freed slots go
+// to the tail of a FIFO so a page stays unmapped, and a use-after-free stays
+// detectable, for as long as possible.
+
+#include <kfence.h>
+#include <vmm.h>
+#include <palloc.h>
+#include <boot.h>
+#include <lock.h>
+#include <smp.h>
+#include <cpu_local.h>
+#include <lprintf.h>
+#include <symbols.h>
+#include <string.h>
+
+#define PAGE_SIZE 0x1000ULL
+#define KFENCE_CANARY 0xAA
+#define KFENCE_MIN_ALIGN 16
+
+enum { SLOT_FREE, SLOT_ALLOCATED, SLOT_BUSY }; // BUSY: mapping change in flight
+
+typedef struct kfence_slot {
+    uint64_t pa;
+    uint64_t obj;          // object address (kept after free for reports)
+    size_t size;
+    void *alloc_site;
+    void *free_site;
+    uint32_t state;
+    struct kfence_slot *next; // free FIFO
+} kfence_slot_t;
+
+static kfence_slot_t slots[KFENCE_SLOTS];
+static kfence_slot_t *free_head, *free_tail;
+static spinlock_t kfence_lock;
+static bool kfence_ready;
+uint32_t kfence_interval;
+static uint32_t countdown[SMP_MAX_CPUS];
+static struct { uint64_t allocs, frees, misses, reports; } stats;
+
+static inline uint64_t slot_page(const kfence_slot_t *s) {
+    return KFENCE_POOL_BASE + (2 * (uint64_t)(s - slots) + 1) * PAGE_SIZE;
+}
+
+static void print_site(const char *what, void *ip) {
+    const struct ksym *sym = ip ? symbol_lookup((uintptr_t)ip) : NULL;
+    if (sym) {
+        error_printf("kfence:   %s at %p <%s+0x%llx>\n", what, ip, sym->name,
+                     (unsigned long long)((uintptr_t)ip - (sym->addr + symbols_get_slide())));
+    } else {
+        error_printf("kfence:   %s at %p\n", what, ip);
+    }
+}
+
+static void report_slot(const kfence_slot_t *s) {
+    error_printf("kfence:   object %p, %zu bytes, slot %u (%s)\n", (void *)(uintptr_t)s->obj, s->size,
+                 (unsigned)(s - slots), s->state == SLOT_FREE ? "freed" : "allocated");
+    print_site("allocated", s->alloc_site);
+    if (s->state == SLOT_FREE) print_site("freed", s->free_site);
+}
+
+static void kfence_fail(const char *msg, const void *ptr, const kfence_slot_t *s, void *site) {
+    __atomic_fetch_add(&stats.reports, 1, __ATOMIC_RELAXED);
+    error_printf("kfence: %s at %p\n", msg, ptr);
+    print_site("caller", site);
+    if (s) report_slot(s);
+    __asm__ __volatile__("cli; hlt");
+    for (;;) { __asm__ __volatile__("hlt"); }
+}
+
+void kfence_init(void) {
+    spinlock_init(&kfence_lock);
+    free_head = free_tail = NULL;
+    uint64_t hhdm = hhdm_request.response->offset;
+    size_t n = 0;
+    for (; n < KFENCE_SLOTS; n++) {
+        void *page = palloc_allocate_page();
+        if (!page) break;
+        kfence_slot_t *s = &slots[n];
+        s->pa = (uint64_t)(uintptr_t)page - hhdm;
+        s->state = SLOT_FREE;
+        s->next = NULL;
+        if (free_tail) free_tail->next = s; else free_head = s;
+        free_tail = s;
+    }
+    if (n == 0) {
+        error_printf("kfence: no memory for the pool, sampling disabled\n");
+        return;
+    }
+    kfence_ready = true;
+    kfence_set_interval(KFENCE_SAMPLE_INTERVAL);
+    info_printf("kfence: %zu guarded slots, sampling 1 in %u allocations\n", n, (unsigned)kfence_interval);
+}
+
+void kfence_set_interval(uint32_t interval) {
+    __atomic_store_n(&kfence_interval, kfence_ready ? interval : 0, __ATOMIC_RELAXED);
+}
+
+bool kfence_sample_slow(void) {
+    uint32_t interval = __atomic_load_n(&kfence_interval, __ATOMIC_RELAXED);
+    if (!interval) return false;
+    // Per-CPU countdown; a race with an interrupt on this CPU only skews
+    // the sampling rate.
+    uint32_t *c = &countdown[cpu_local_index() % SMP_MAX_CPUS];
+    uint32_t left = *c;
+    if (left == 0 || left > interval) left = interval;
+    if (--left) { *c = left; return false; }
+    *c = interval;
+    return true;
+}
+
+void *kfence_alloc(size_t size, size_t align, void *caller) {
+    if (!kfence_ready || size == 0 || size > PAGE_SIZE) return NULL;
+    if (align < KFENCE_MIN_ALIGN) align = KFENCE_MIN_ALIGN;
+    if ((align & (align - 1)) || align > PAGE_SIZE) return NULL;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&kfence_lock);
+    kfence_slot_t *s = free_head;
+    if (s) {
+        free_head = s->next;
+        if (!free_head) free_tail = NULL;
+        s->state = SLOT_BUSY;
+    } else {
+        stats.misses++;
+    }
+    spin_unlock(&kfence_lock);
+    cpu_irq_restore(irq);
+    if (!s) return NULL;
+
+    // Mapped outside the lock: the page was not present, so nothing needs
+    // shooting down, but vmm may still allocate page tables.
+    uint64_t page = slot_page(s);
+    uint64_t obj = page;
+    if (vmm_map_range(page, s->pa, 1, VMM_P_PRESENT | VMM_P_WRITABLE | VMM_P_NX) == 0) {
+        if (((s - slots) & 1) == 0) obj = (page + PAGE_SIZE - size) & ~(uint64_t)(align - 1);
+        memset((void *)(uintptr_t)page, KFENCE_CANARY, PAGE_SIZE);
+    } else {
+        obj = 0;
+    }
+
+    irq = cpu_irq_save();
+    spin_lock(&kfence_lock);
+    if (obj) {
+        s->obj = obj;
+        s->size = size;
+        s->alloc_site = caller;
+        s->free_site = NULL;
+        s->state = SLOT_ALLOCATED;
+        stats.allocs++;
+    } else {
+        s->state = SLOT_FREE;
+        s->next = free_head;
+        free_head = s;
+        if (!free_tail) free_tail = s;
+    }
+    spin_unlock(&kfence_lock);
+    cpu_irq_restore(irq);
+    return (void *)(uintptr_t)obj;
+}
+
+// Slot whose data page holds 'va', or NULL for a guard page.
+static kfence_slot_t *slot_of(uint64_t va) {
+    uint64_t page = (va - KFENCE_POOL_BASE) / PAGE_SIZE;
+    if ((page & 1) == 0) return NULL;
+    return &slots[page / 2];
+}
+
+static bool canary_intact(const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != KFENCE_CANARY) return false;
+    }
+    return true;
+}
+
+void kfence_free(void *ptr, void *caller) {
+    uint64_t va = (uint64_t)(uintptr_t)ptr;
+    kfence_slot_t *s = slot_of(va);
+    if (!s || s->obj != va) kfence_fail("invalid free", ptr, s, caller);
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&kfence_lock);
+    uint32_t state = s->state;
+    if (state == SLOT_ALLOCATED) s->state = SLOT_BUSY;
+    spin_unlock(&kfence_lock);
+    cpu_irq_restore(irq);
+    if (state != SLOT_ALLOCATED) kfence_fail("double free", ptr, s, caller);
+
+    uint64_t page = slot_page(s);
+    const uint8_t *base = (const uint8_t *)(uintptr_t)page;
+    size_t tail = (size_t)(page + PAGE_SIZE - (va + s->size));
+    if (!canary_intact(base, (size_t)(va - page)) || !canary_intact((const uint8_t *)ptr + s->size, tail)) {
+        kfence_fail("out-of-bounds write next to object", ptr, s, caller);
+    }
+
+    // Unmapped (and shot down) outside the lock: other CPUs may be spinning
+    // on it with interrupts off.
+    vmm_unmap_range(page, 1, 0, NULL);
+
+    irq = cpu_irq_save();
+    spin_lock(&kfence_lock);
+    s->free_site = caller;
+    s->state = SLOT_FREE;
+    s->next = NULL;
+    if (free_tail) free_tail->next = s; else free_head = s;
+    free_tail = s;
+    stats.frees++;
+    spin_unlock(&kfence_lock);
+    cpu_irq_restore(irq);
+}
+
+size_t kfence_usable_size(void *ptr) {
+    kfence_slot_t *s = slot_of((uint64_t)(uintptr_t)ptr);
+    return s ? s->size : 0;
+}
+
+bool kfence_handle_fault(uint64_t va, uint64_t err_code, uint64_t rip) {
+    if (!kfence_owns((void *)(uintptr_t)va)) return false;
+    __atomic_fetch_add(&stats.reports, 1, __ATOMIC_RELAXED);
+    const char *access = (err_code & 2) ? "write" : "read";
+    kfence_slot_t *s = slot_of(va);
+    if (s) {
+        error_printf("kfence: %s %s at %p\n", s->state == SLOT_FREE ? "use-after-free" : "invalid", access,
+                     (void *)(uintptr_t)va);
+    } else {
+        // Guard page: blame the nearer live neighbour.
+        uint64_t page = (va - KFENCE_POOL_BASE) / PAGE_SIZE;
+        kfence_slot_t *left = page >= 2 ? &slots[page / 2 - 1] : NULL;
+        kfence_slot_t *right = page / 2 < KFENCE_SLOTS ? &slots[page / 2] : NULL;
+        if (left && left->state != SLOT_ALLOCATED) left = NULL;
+        if (right && right->state != SLOT_ALLOCATED) right = NULL;
+        if (left && right) {
+            uint64_t dl = va - (left->obj + left->size);
+            uint64_t dr = right->obj - va;
+            if (dl <= dr) right = NULL; else left = NULL;
+        }
+        s = left ? left : right;
+        if (s == left && s) {
+            error_printf("kfence: out-of-bounds %s at %p, %llu bytes past the object\n", access,
+                         (void *)(uintptr_t)va, (unsigned long long)(va - (s->obj + s->size)));
+        } else if (s) {
+            error_printf("kfence: out-of-bounds %s at %p, %llu bytes before the object\n", access,
+                         (void *)(uintptr_t)va, (unsigned long long)(s->obj - va));
+        } else {
+            error_printf("kfence: %s of guard page at %p\n", access, (void *)(uintptr_t)va);
+        }
+    }
+    print_site("faulting access", (void *)(uintptr_t)rip);
+    if (s) report_slot(s);
+    return true;
+}
+
+void kfence_dump_stats(void) {
+    if (!kfence_ready) return;
+    info_printf("kfence: interval %u, allocs=%llu frees=%llu pool-full=%llu reports=%llu\n",
+                (unsigned)kfence_interval, (unsigned long long)stats.allocs, (unsigned long long)stats.frees,
+                (unsigned long long)stats.misses, (unsigned long long)stats.reports);
+}
@@ -0,0 +1,146 @@
+// Shrinker registry: hands memory back to palloc under pressure.
+
+#include <shrinker.h>
+#include <palloc.h>
+#include <lock.h>
+#include <cpu_local.h>
+#include <lprintf.h>
+#include <sched.h>
+#include <timer.h>
+
+static shrinker_t *shrinkers;
+static spinlock_t shrinker_lock;   // registry; also held while shrinkers run
+static volatile uint32_t pressure;
+static volatile bool reclaimd_running;
+static struct {
+    uint64_t background, background_pages;
+    uint64_t direct, direct_pages;
+} reclaim_stats;
+
+void shrinker_register(shrinker_t *s) {
+    if (!s || !s->shrink) return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shrinker_lock);
+    shrinker_t **pp = &shrinkers;
+    while (*pp && (*pp)->order <= s->order) pp = &(*pp)->next;
+    s->next = *pp;
+    *pp = s;
+    spin_unlock(&shrinker_lock);
+    cpu_irq_restore(irq);
+}
+
+void shrinker_unregister(shrinker_t *s) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shrinker_lock);
+    for (shrinker_t **pp = &shrinkers; *pp; pp = &(*pp)->next) {
+        if (*pp == s) { *pp = s->next; break; }
+    }
+    spin_unlock(&shrinker_lock);
+    cpu_irq_restore(irq);
+}
+
+size_t shrinker_run(size_t target) {
+    // One shrinker pass at a time; a nested or concurrent request simply
+    // benefits from the pass already in progress.
+    if (!spin_trylock(&shrinker_lock)) return 0;
+    size_t freed = 0;
+    for (shrinker_t *s = shrinkers; s && freed < target; s = s->next) {
+        size_t n = s->shrink(target - freed, s->ctx);
+        s->runs++;
+        s->freed += n;
+        freed += n;
+    }
+    spin_unlock(&shrinker_lock);
+    return freed;
+}
+
+void shrinker_kick(void) {
+    __atomic_store_n(&pressure, 1, __ATOMIC_RELEASE);
+}
+
+size_t shrinker_poll(void) {
+    if (!__atomic_load_n(&pressure, __ATOMIC_ACQUIRE)) return 0;
+    size_t free_pages = palloc_get_free_page_count();
+    size_t high = palloc_high_watermark();
+    if (free_pages >= high) {
+        __atomic_store_n(&pressure, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (!__atomic_exchange_n(&pressure, 0, __ATOMIC_ACQ_REL)) return 0;
+    size_t freed = shrinker_run(high - free_pages);
+    debug_printf("shrinker: freed %zu pages (free %zu, high %zu)\n", freed, free_pages, high);
+    return freed;
+}
+
+size_t shrinker_reclaim_direct(void) {
+    if (!__atomic_load_n(&reclaimd_running, __ATOMIC_ACQUIRE)) return shrinker_poll();
+    size_t free_pages = palloc_get_free_page_count();
+    if (free_pages >= palloc_min_watermark()) return 0;
+    size_t freed = shrinker_run(palloc_high_watermark() - free_pages);
+    __atomic_fetch_add(&reclaim_stats.direct, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&reclaim_stats.direct_pages, freed, __ATOMIC_RELAXED);
+    return freed;
+}
+
+mem_pressure_t mem_pressure(void) {
+    size_t free_pages = palloc_get_free_page_count();
+    if (free_pages == 0) return MEM_PRESSURE_OOM;
+    if (free_pages < palloc_min_watermark()) return MEM_PRESSURE_MIN;
+    if (free_pages < palloc_low_watermark()) return MEM_PRESSURE_LOW;
+    return MEM_PRESSURE_NONE;
+}
+
+const char *mem_pressure_name(mem_pressure_t level) {
+    switch (level) {
+    case MEM_PRESSURE_NONE: return "none";
+    case MEM_PRESSURE_LOW:  return "low";
+    case MEM_PRESSURE_MIN:  return "min";
+    case MEM_PRESSURE_OOM:  return "oom";
+    }
+    return "?";
+}
+
+// Background reclaim. Polls the pressure flag every ~10 ms, and every tick
+// while the shrinkers are still making progress below the low watermark.
+static void reclaimd(void *arg) {
+    (void)arg;
+    uint32_t idle_ticks = timer_hz() / 100;
+    if (idle_ticks == 0) idle_ticks = 1;
+    mem_pressure_t last = MEM_PRESSURE_NONE;
+    for (;;) {
+        size_t freed = shrinker_poll();
+        if (freed) {
+            reclaim_stats.background++;
+            reclaim_stats.background_pages += freed;
+        }
+        mem_pressure_t level = mem_pressure();
+        if (level != last) {
+            info_printf("reclaim: pressure %s -> %s, %zu pages free\n", mem_pressure_name(last),
+                        mem_pressure_name(level), palloc_get_free_page_count());
+            last = level;
+        }
+        task_sleep_ticks(freed && level != MEM_PRESSURE_NONE ? 1 : idle_ticks);
+    }
+}
+
+void shrinker_start_reclaimd(void) {
+    if (reclaimd_running) return;
+    if (task_create("reclaimd", reclaimd, NULL, 0) < 0) {
+        error_printf("shrinker: failed to start the reclaim task\n");
+        return;
+    }
+    __atomic_store_n(&reclaimd_running, true, __ATOMIC_RELEASE);
+}
+
+void shrinker_dump(void) {
+    info_printf("shrinker: watermarks min=%zu low=%zu high=%zu, %zu pages free (pressure %s)\n",
+                palloc_min_watermark(), palloc_low_watermark(), palloc_high_watermark(),
+                palloc_get_free_page_count(), mem_pressure_name(mem_pressure()));
+    info_printf("shrinker: background reclaim %llu runs/%llu pages, direct %llu runs/%llu pages\n",
+                (unsigned long long)reclaim_stats.background, (unsigned long long)reclaim_stats.background_pages,
+                (unsigned long long)reclaim_stats.direct, (unsigned long long)reclaim_stats.direct_pages);
+    for (shrinker_t *s = shrinkers; s; s = s->next) {
+        info_printf("shrinker: %-12s order=%d runs=%llu freed=%llu pages\n", s->name, s->order,
+                    (unsigned long long)s->runs, (unsigned long long)s->freed);
+    }
+}
@@ -3,23 +3,112 @@
 #include <vmm.h>
 #include <palloc.h>
 #include <lock.h>
+#include <smp.h>
+#include <cpu_local.h>
 #include <alloc_debug.h>
+#include <lprintf.h>
+#include <string.h>
+#include <shrinker.h>
 
 #define PAGE_SIZE 4096ULL
 #define SLAB_MIN_ALIGN 8U
 
+// Every slab is page aligned with its header at the base and its pages
+// tagged VHEAP_PT_SLAB, so ownership and the owning cache are found from the
+// pointer alone. Multi-page slabs are vheap ranges tagged in the vheap
+// page-type map; one-page slabs are by default palloc frames used through
+// the HHDM and tagged in the palloc page-type map, which costs no page-table
+// edit and no TLB entry beyond the direct map's large pages.
+#define SLAB_MAGIC 0x51AB51ABu
+
+struct slab_cache;
+
 typedef struct slab_header {
     struct slab_header *next;
+    struct slab_header *prev;
+    struct slab_cache *cache;
+    uint32_t magic;
     uint16_t obj_size;
     uint16_t obj_per_slab;
     uint16_t free_count;
     uint16_t first_free_index; // head of free index list (intrusive in objects)
+    uint32_t obj_offset;       // start of the object area from the header
+    uint32_t pages;            // slab span in pages (1..SLAB_MAX_PAGES)
+    bool direct;               // HHDM frame from palloc rather than vheap
 } slab_header_t;
 
+// Multi-page slabs tag each page with its index in the low nibble of the
+// vheap page type, so the header is found from any interior pointer.
+#define SLAB_MAX_PAGES 16
+// Target bound on the unused tail of a slab, as a fraction (1/8 = 12.5%).
+#define SLAB_WASTE_SHIFT 3
+
+// Magazine layer (Bonwick & Adams, "Magazines and Vmem"). Each CPU keeps a
+// loaded and a previous magazine per cache and serves allocations from them
+// with interrupts disabled but no lock. The previous magazine is always
+// either full or empty, so a miss on both means the CPU has allocated or
+// freed a full magazine's worth since it last visited the depot. The depot
+// holds full and empty magazines under a per-cache lock and is refilled from
+// the slab layer a magazine at a time.
+#define SLAB_MAG_ROUNDS 30
+
+// Large objects get shorter magazines so per-CPU caching stays bounded.
+static inline uint32_t mag_rounds_for(size_t obj_size) {
+    if (obj_size <= 256) return SLAB_MAG_ROUNDS;
+    if (obj_size <= 1024) return 16;
+    if (obj_size <= 4096) return 8;
+    return 4;
+}
+
+// Reclaim hysteresis. A cache keeps up to SLAB_EMPTY_LIMIT completely free
+// slabs to absorb the next burst and releases any beyond that; the depot
+// keeps up to SLAB_DEPOT_FULL_LIMIT full magazines and drains the excess
+// back into the slabs so memory can flow back after a burst. The shrinker
+// ignores both limits and takes everything that is idle.
+#define SLAB_EMPTY_LIMIT      2
+#define SLAB_DEPOT_FULL_LIMIT 8
+
+typedef struct slab_mag {
+    struct slab_mag *next;
+    uint32_t rounds;
+    uint32_t _pad;
+    void *objs[SLAB_MAG_ROUNDS];
+} slab_mag_t; // 256 bytes, 16 per page
+
+typedef struct slab_cpu {
+    slab_mag_t *loaded;
+    slab_mag_t *previous;
+    uint64_t allocs;         // counted here so the fast path stays lock-free
+    uint64_t frees;
+} slab_cpu_t;
+
+// One object cache. The malloc size classes and every kmem_cache_create()
+// cache share this structure; only malloc caches use the ALLOC_DEBUG layout.
 typedef struct slab_cache {
+    spinlock_t lock;         // protects the slab lists and the counters below
     slab_header_t *partial;
     slab_header_t *full;
+    slab_header_t *empty;    // completely free slabs kept for reuse
+    uint32_t nr_empty;
+    uint32_t empty_limit;
     uint16_t obj_size;
+    uint16_t align;          // object alignment inside a slab
+    uint16_t slab_pages;     // pages per slab
+    uint16_t obj_per_slab;
+    uint32_t mag_rounds;     // magazine capacity used by this cache
+    bool malloc_cache;
+    void (*ctor)(void *);
+    char name[24];
+    struct slab_cache *next_cache;
+    uint64_t slabs;          // live slab pages
+    uint64_t slabs_freed;    // slab pages handed back to vheap
+    uint64_t refills;        // trips from the magazines to the slab layer
+    uint64_t ctor_calls;
+    spinlock_t depot_lock;   // protects the depot lists
+    slab_mag_t *depot_full;
+    slab_mag_t *depot_empty;
+    uint32_t nr_depot_full;
+    slab_cpu_t *cpu;         // SMP_MAX_CPUS entries
 } slab_cache_t;
 
 #if ALLOC_DEBUG
@@ -35,19 +124,42 @@ static inline size_t slab_overhead(void) {
 static inline size_t slab_overhead(void) { return 0; }
 #endif
 
+// malloc size classes: powers of two plus the midpoints between them from
+// 32 up, so the rounding loss for any request is at most about a third.
+// Classes above 2 KiB use multi-page slabs.
 static slab_cache_t caches[] = {
-    { .obj_size = 8 }, { .obj_size = 16 }, { .obj_size = 32 }, { .obj_size = 64 },
-    { .obj_size = 128 }, { .obj_size = 256 }, { .obj_size = 512 }, { .obj_size = 1024 },
+    { .obj_size = 8 },    { .obj_size = 16 },   { .obj_size = 32 },   { .obj_size = 48 },
+    { .obj_size = 64 },   { .obj_size = 96 },   { .obj_size = 128 },  { .obj_size = 192 },
+    { .obj_size = 256 },  { .obj_size = 384 },  { .obj_size = 512 },  { .obj_size = 768 },
+    { .obj_size = 1024 }, { .obj_size = 1536 }, { .obj_size = 2048 }, { .obj_size = 3072 },
+    { .obj_size = 4096 }, { .obj_size = 6144 }, { .obj_size = 8192 }, { .obj_size = 12288 },
+    { .obj_size = 16384 },
 };
 
-static inline size_t cache_count(void) { return sizeof(caches)/sizeof(caches[0]); }
-static spinlock_t slab_lock;
+// Class lookup for sizes up to 1024 in 8-byte steps; larger sizes scan the
+// few remaining classes.
+#define SLAB_SMALL_MAX 1024U
+static uint8_t small_index[SLAB_SMALL_MAX / 8 + 1];
+
+// Every cache, malloc classes first, for statistics.
+static slab_cache_t *cache_list;
+static spinlock_t cache_list_lock;
+
+#define SLAB_CACHE_COUNT (sizeof(caches)/sizeof(caches[0]))
+static slab_cpu_t cpu_mags[SLAB_CACHE_COUNT][SMP_MAX_CPUS];
+
+static inline size_t cache_count(void) { return SLAB_CACHE_COUNT; }
+
+// Spare magazines, carved from palloc pages.
+static slab_mag_t *mag_spare;
+static spinlock_t mag_lock;
 
 static inline size_t align_up_sz(size_t x, size_t a) { return (x + (a-1)) & ~(a-1); }
 
 static inline slab_cache_t *pick_cache(size_t size) {
     if (size == 0 || size > SLAB_MAX_SIZE) return NULL;
-    for (size_t i = 0; i < cache_count(); i++) {
+    if (size <= SLAB_SMALL_MAX) return &caches[small_index[(size + 7) / 8]];
+    for (size_t i = small_index[SLAB_SMALL_MAX / 8]; i < cache_count(); i++) {
         if (size <= caches[i].obj_size) return &caches[i];
     }
     return &caches[cache_count()-1];
@@ -55,19 +167,75 @@ static inline slab_cache_t *pick_cache(size_t size) {
 
 static inline uint64_t align_up(uint64_t x, uint64_t a) { return (x + (a-1)) & ~(a-1); }
 
+size_t slab_header_size(size_t align) {
+    if (align < 16) align = 16; // keep a reasonable minimum for header alignment
+    return align_up_sz(sizeof(slab_header_t), align);
+}
+
+// Pick the slab span for 'obj_size': the smallest page count whose unused
+// tail is within 1/2^SLAB_WASTE_SHIFT of the slab, or the least wasteful
+// span if none is.
+static void size_slab(size_t obj_size, size_t align, uint16_t *pages_out, uint16_t *count_out) {
+    size_t hdr = slab_header_size(align);
+    size_t best_pages = 1, best_waste = (size_t)-1;
+    for (size_t p = 1; p <= SLAB_MAX_PAGES; p++) {
+        size_t span = p * PAGE_SIZE;
+        if (span < hdr + obj_size) continue;
+        size_t count = (span - hdr) / obj_size;
+        size_t waste = span - hdr - count * obj_size;
+        if (waste <= (span >> SLAB_WASTE_SHIFT)) { best_pages = p; break; }
+        // Compare waste as a fraction of the span
+        if (best_waste == (size_t)-1 || waste * best_pages * PAGE_SIZE < best_waste * span) {
+            best_pages = p;
+            best_waste = waste;
+        }
+    }
+    size_t count = (best_pages * PAGE_SIZE - hdr) / obj_size;
+    if (count > UINT16_MAX) count = UINT16_MAX;
+    *pages_out = (uint16_t)best_pages;
+    *count_out = (uint16_t)count;
+}
+
+static bool slab_direct = true;
+
+void slab_set_direct_map(bool on) { slab_direct = on; }
+
+// A one-page slab straight from palloc, or 0. The frame is tagged before the
+// header exists; its magic is still clear, so slab_of() rejects it until then.
+static uint64_t direct_slab_page(void) {
+    void *page = palloc_allocate_page();
+    if (!page) return 0;
+    if (!palloc_set_page_type(page, 1, VHEAP_PT_SLAB)) {
+        // Beyond the page-type map: use vheap after all.
+        palloc_free_page(page);
+        return 0;
+    }
+    return (uint64_t)(uintptr_t)page;
+}
+
 static slab_header_t *new_slab(slab_cache_t *c) {
-    // Allocate and map one page for a slab
-    uint64_t va = vheap_commit(PAGE_SIZE);
+    // Allocate and map the pages for a slab
+    bool direct = false;
+    uint64_t va = 0;
+    if (c->slab_pages == 1 && slab_direct) {
+        va = direct_slab_page();
+        direct = va != 0;
+    }
+    if (!va) va = vheap_commit((size_t)c->slab_pages * PAGE_SIZE);
     if (!va) return NULL;
     slab_header_t *sl = (slab_header_t *)va;
     // Layout: | slab_header | objects[...]
-    // Align object region to at least the object size to guarantee alignment
-    size_t hdr_align = c->obj_size;
-    if (hdr_align < 16) hdr_align = 16; // keep a reasonable minimum for header alignment
-    uint64_t hdr_sz = align_up(sizeof(slab_header_t), hdr_align);
-    uint16_t count = (uint16_t)((PAGE_SIZE - hdr_sz) / c->obj_size);
-    if (count == 0) return NULL;
+    // Align the object region to the cache alignment so every object
+    // inherits it.
+    uint64_t hdr_sz = slab_header_size(c->align);
+    uint16_t count = c->obj_per_slab;
     sl->next = NULL;
+    sl->prev = NULL;
+    sl->cache = c;
+    sl->magic = SLAB_MAGIC;
+    sl->obj_offset = (uint32_t)hdr_sz;
+    sl->pages = c->slab_pages;
+    sl->direct = direct;
     sl->obj_size = (uint16_t)c->obj_size;
     sl->obj_per_slab = count;
     sl->free_count = count;
@@ -79,42 +247,126 @@ static slab_header_t *new_slab(slab_cache_t *c) {
         uint16_t *slot = (uint16_t *)(base + (size_t)i * c->obj_size);
         *slot = (uint16_t)(i + 1); // next index; last will be count
     }
+    for (uint32_t p = 0; p < c->slab_pages && !direct; p++) {
+        vheap_set_page_type(va + p * PAGE_SIZE, 1, (uint8_t)(VHEAP_PT_SLAB | p));
+    }
     return sl;
 }
 
+static inline void list_push(slab_header_t **head, slab_header_t *sl) {
+    sl->prev = NULL;
+    sl->next = *head;
+    if (*head) (*head)->prev = sl;
+    *head = sl;
+}
+
+static inline void list_remove(slab_header_t **head, slab_header_t *sl) {
+    if (sl->prev) sl->prev->next = sl->next; else *head = sl->next;
+    if (sl->next) sl->next->prev = sl->prev;
+    sl->next = sl->prev = NULL;
+}
+
+// Header of the slab holding 'ptr', or NULL if 'ptr' is not in a slab page.
+static inline slab_header_t *slab_of(const void *ptr) {
+    uint64_t page = (uint64_t)(uintptr_t)ptr & ~(PAGE_SIZE - 1);
+    uint8_t type = vheap_page_type(page);
+    if (type == VHEAP_PT_NONE) type = palloc_page_type((const void *)(uintptr_t)page);
+    if ((type & VHEAP_PT_TYPE_MASK) != VHEAP_PT_SLAB) return NULL;
+    page -= (uint64_t)(type & VHEAP_PT_AUX_MASK) * PAGE_SIZE;
+    slab_header_t *sl = (slab_header_t *)(uintptr_t)page;
+    return sl->magic == SLAB_MAGIC ? sl : NULL;
+}
+
+// Fill in the derived geometry of a cache.
+static void setup_geometry(slab_cache_t *c) {
+    size_slab(c->obj_size, c->align, &c->slab_pages, &c->obj_per_slab);
+    c->mag_rounds = mag_rounds_for(c->obj_size);
+}
+
+static void register_cache(slab_cache_t *c) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&cache_list_lock);
+    slab_cache_t **tail = &cache_list;
+    while (*tail) tail = &(*tail)->next_cache;
+    c->next_cache = NULL;
+    *tail = c;
+    spin_unlock(&cache_list_lock);
+    cpu_irq_restore(irq);
+}
+
+// ---------------------------------------------------------------------------
+// Shrinker: under memory pressure, drain each depot's full magazines and
+// release every empty slab, ignoring the hysteresis limits. Locks are only
+// tried, since pressure can be polled from inside a slab refill. Per-CPU
+// magazines are left alone.
+
+static size_t slab_shrink(size_t target, void *ctx);
+static shrinker_t slab_shrinker = { .name = "slab", .shrink = slab_shrink, .order = 0 };
+
 void slab_init(void) {
-    spinlock_init(&slab_lock);
+    spinlock_init(&mag_lock);
+    spinlock_init(&cache_list_lock);
+    mag_spare = NULL;
+    cache_list = NULL;
     for (size_t i = 0; i < cache_count(); i++) {
-        caches[i].partial = NULL;
-        caches[i].full = NULL;
+        slab_cache_t *c = &caches[i];
+        spinlock_init(&c->lock);
+        spinlock_init(&c->depot_lock);
+        c->partial = NULL;
+        c->full = NULL;
+        c->empty = NULL;
+        c->nr_empty = 0;
+        c->empty_limit = SLAB_EMPTY_LIMIT;
+        c->nr_depot_full = 0;
+        // Natural alignment up to a cache line; every class is a multiple
+        // of 8 and those from 16 up keep at least 16-byte alignment.
+        c->align = (uint16_t)(c->obj_size & -c->obj_size);
+        if (c->align > 64) c->align = 64;
+        setup_geometry(c);
+        c->malloc_cache = true;
+        c->ctor = NULL;
+        snprintf(c->name, sizeof(c->name), "kmalloc-%u", (unsigned)c->obj_size);
+        c->slabs = c->slabs_freed = c->refills = c->ctor_calls = 0;
+        c->depot_full = NULL;
+        c->depot_empty = NULL;
+        c->cpu = cpu_mags[i];
+        register_cache(c);
+    }
+    for (size_t sz = 0, i = 0; sz <= SLAB_SMALL_MAX; sz += 8) {
+        while (caches[i].obj_size < sz) i++;
+        small_index[sz / 8] = (uint8_t)i;
     }
+    shrinker_register(&slab_shrinker);
 }
 
-static inline bool in_slab(slab_header_t *sl, void *ptr) {
-    uint8_t *begin = (uint8_t *)sl;
-    uint8_t *end = begin + PAGE_SIZE;
-    return (uint8_t *)ptr >= begin && (uint8_t *)ptr < end;
+// ---------------------------------------------------------------------------
+// Slab layer: raw objects from the slab lists. Caller holds c->lock.
+
+// Add a fresh slab to 'c'. The lock is dropped around new_slab(): vmalloc
+// may purge and wait for TLB shootdown acks, and a CPU spinning on c->lock
+// with interrupts off would never give one.
+static bool slab_grow_locked(slab_cache_t *c) {
+    spin_unlock(&c->lock);
+    slab_header_t *sl = new_slab(c);
+    spin_lock(&c->lock);
+    if (!sl) return false;
+    c->slabs++;
+    list_push(&c->partial, sl);
+    return true;
 }
 
-void *slab_alloc(size_t size) {
-    size_t requested = size;
-    size = align_up_sz(size, SLAB_MIN_ALIGN);
-    size_t need = size + slab_overhead();
-    slab_cache_t *c = pick_cache(need);
-    if (!c) return NULL;
-    spin_lock(&slab_lock);
+// Pop a raw object, or NULL when no slab has one free (see slab_grow_locked).
+static void *slab_pop_locked(slab_cache_t *c) {
     slab_header_t *sl = c->partial;
-    if (!sl) {
-        // Grab a new slab
-        sl = new_slab(c);
-        if (!sl) { spin_unlock(&slab_lock); return NULL; }
-        sl->next = c->partial;
-        c->partial = sl;
-    }
-    // Compute object base (align header to obj size like new_slab)
-    size_t hdr_align = sl->obj_size < 16 ? 16 : sl->obj_size;
-    uint64_t hdr_sz = align_up(sizeof(slab_header_t), hdr_align);
-    uint8_t *base = (uint8_t *)sl + hdr_sz;
+    if (!sl && c->empty) {
+        // Reuse a cached empty slab before asking vheap for a page
+        sl = c->empty;
+        list_remove(&c->empty, sl);
+        c->nr_empty--;
+        list_push(&c->partial, sl);
+    }
+    if (!sl) return NULL;
+    uint8_t *base = (uint8_t *)sl + sl->obj_offset;
 
     // Pop from free list (index stored at object start)
     uint16_t idx = sl->first_free_index;
@@ -124,11 +376,309 @@ void *slab_alloc(size_t size) {
 
     if (sl->free_count == 0) {
         // Move to full list
-        c->partial = sl->next;
-        sl->next = c->full;
-        c->full = sl;
+        list_remove(&c->partial, sl);
+        list_push(&c->full, sl);
+    }
+    return obj;
+}
+
+// Return 'obj' to its slab. A slab that becomes completely free is kept on
+// the empty list up to the cache limit; past that it is unlinked and chained
+// onto '*release' for the caller to hand back once c->lock is dropped.
+static void slab_push_locked(slab_cache_t *c, void *obj, slab_header_t **release) {
+    slab_header_t *sl = slab_of(obj);
+    uint16_t idx = (uint16_t)(((uint8_t *)obj - ((uint8_t *)sl + sl->obj_offset)) / c->obj_size);
+    *(uint16_t *)obj = sl->first_free_index;
+    sl->first_free_index = idx;
+    // If was in full, move back to partial
+    if (sl->free_count++ == 0) {
+        list_remove(&c->full, sl);
+        list_push(&c->partial, sl);
+    }
+    if (sl->free_count == sl->obj_per_slab) {
+        list_remove(&c->partial, sl);
+        if (c->nr_empty < c->empty_limit) {
+            list_push(&c->empty, sl);
+            c->nr_empty++;
+        } else {
+            c->slabs--;
+            c->slabs_freed++;
+            sl->next = *release;
+            *release = sl;
+        }
+    }
+}
+
+// Free every slab on 'list'. Returns the pages released; '*lazy' (if not
+// NULL) gets the part that went to the vheap lazy list rather than straight
+// back to palloc.
+static size_t release_slabs(slab_header_t *list, size_t *lazy) {
+    size_t pages = 0, deferred = 0;
+    while (list) {
+        slab_header_t *next = list->next;
+        size_t n = list->pages;
+        list->magic = 0;
+        if (list->direct) {
+            palloc_set_page_type(list, 1, VHEAP_PT_NONE);
+            palloc_free_page(list);
+        } else {
+            vfree(list); // also clears the page type
+            deferred += n;
+        }
+        pages += n;
+        list = next;
+    }
+    if (lazy) *lazy = deferred;
+    return pages;
+}
+
+// ---------------------------------------------------------------------------
+// Depot
+
+static slab_mag_t *mag_new(void) {
+    spin_lock(&mag_lock);
+    if (!mag_spare) {
+        slab_mag_t *page = (slab_mag_t *)palloc_allocate_page();
+        if (!page) { spin_unlock(&mag_lock); return NULL; }
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(slab_mag_t); i++) {
+            page[i].next = mag_spare;
+            mag_spare = &page[i];
+        }
+    }
+    slab_mag_t *m = mag_spare;
+    mag_spare = m->next;
+    spin_unlock(&mag_lock);
+    m->next = NULL;
+    m->rounds = 0;
+    return m;
+}
+
+static slab_mag_t *depot_take(slab_cache_t *c, slab_mag_t **list) {
+    spin_lock(&c->depot_lock);
+    slab_mag_t *m = *list;
+    if (m) *list = m->next;
+    spin_unlock(&c->depot_lock);
+    if (m) m->next = NULL;
+    return m;
+}
+
+static void depot_give(slab_cache_t *c, slab_mag_t **list, slab_mag_t *m) {
+    spin_lock(&c->depot_lock);
+    m->next = *list;
+    *list = m;
+    spin_unlock(&c->depot_lock);
+}
+
+// Push every round of 'm' back into the slabs. Caller holds c->lock.
+static void mag_drain_locked(slab_cache_t *c, slab_mag_t *m, slab_header_t **release) {
+    while (m->rounds) slab_push_locked(c, m->objs[--m->rounds], release);
+}
+
+// Hand a full magazine to the depot. Past the depot limit its objects go
+// straight back to the slabs instead and only the empty shell is kept.
+static void depot_give_full(slab_cache_t *c, slab_mag_t *m) {
+    spin_lock(&c->depot_lock);
+    if (c->nr_depot_full < SLAB_DEPOT_FULL_LIMIT) {
+        m->next = c->depot_full;
+        c->depot_full = m;
+        c->nr_depot_full++;
+        spin_unlock(&c->depot_lock);
+        return;
+    }
+    spin_unlock(&c->depot_lock);
+
+    slab_header_t *release = NULL;
+    spin_lock(&c->lock);
+    mag_drain_locked(c, m, &release);
+    spin_unlock(&c->lock);
+    release_slabs(release, NULL);
+    depot_give(c, &c->depot_empty, m);
+}
+
+static slab_mag_t *depot_take_full(slab_cache_t *c) {
+    spin_lock(&c->depot_lock);
+    slab_mag_t *m = c->depot_full;
+    if (m) { c->depot_full = m->next; c->nr_depot_full--; }
+    spin_unlock(&c->depot_lock);
+    if (m) m->next = NULL;
+    return m;
+}
+
+// Fill 'm' from the slab layer in one lock round trip (two or more only when
+// the cache has to grow). Objects in
+// the slab layer are raw (their first bytes hold the free-list link), so a
+// constructor runs as they leave it; from then on they cycle through the
+// magazines in constructed state.
+static void mag_fill(slab_cache_t *c, slab_mag_t *m) {
+    uint32_t first = m->rounds;
+    spin_lock(&c->lock);
+    while (m->rounds < c->mag_rounds) {
+        void *obj = slab_pop_locked(c);
+        if (!obj) {
+            if (!slab_grow_locked(c)) break;
+            continue;
+        }
+        m->objs[m->rounds++] = obj;
     }
-    void *ret = (void *)obj;
+    c->refills++;
+    if (c->ctor) c->ctor_calls += m->rounds - first;
+    spin_unlock(&c->lock);
+    if (c->ctor) {
+        for (uint32_t i = first; i < m->rounds; i++) c->ctor(m->objs[i]);
+    }
+}
+
+static size_t slab_shrink(size_t target, void *ctx) {
+    (void)ctx;
+    size_t released = 0, lazy = 0;
+    for (slab_cache_t *c = cache_list; c && released < target; c = c->next_cache) {
+        slab_mag_t *full = NULL;
+        // The allocation paths spin on these locks with interrupts off: never
+        // get preempted while holding one.
+        uint64_t irq = cpu_irq_save();
+        if (spin_trylock(&c->depot_lock)) {
+            full = c->depot_full;
+            c->depot_full = NULL;
+            c->nr_depot_full = 0;
+            spin_unlock(&c->depot_lock);
+        }
+        slab_header_t *release = NULL;
+        if (spin_trylock(&c->lock)) {
+            for (slab_mag_t *m = full; m; m = m->next) mag_drain_locked(c, m, &release);
+            while (c->empty) {
+                slab_header_t *sl = c->empty;
+                list_remove(&c->empty, sl);
+                c->nr_empty--;
+                c->slabs--;
+                c->slabs_freed++;
+                sl->next = release;
+                release = sl;
+            }
+            spin_unlock(&c->lock);
+        }
+        // Hand the magazines back: empty if drained, otherwise untouched.
+        while (full) {
+            slab_mag_t *m = full;
+            full = m->next;
+            if (m->rounds) {
+                spin_lock(&c->depot_lock);
+                m->next = c->depot_full;
+                c->depot_full = m;
+                c->nr_depot_full++;
+                spin_unlock(&c->depot_lock);
+            } else {
+                depot_give(c, &c->depot_empty, m);
+            }
+        }
+        cpu_irq_restore(irq);
+        size_t deferred;
+        released += release_slabs(release, &deferred);
+        lazy += deferred;
+    }
+    // vfree()d slabs sit on the vheap lazy list; purge so palloc sees them.
+    // They are already counted, so only report what the purge adds on top.
+    size_t purged = vheap_purge();
+    return released + (purged > lazy ? purged - lazy : 0);
+}
+
+// ---------------------------------------------------------------------------
+// CPU layer. Interrupts stay disabled while the per-CPU magazines are in use,
+// so neither an ISR nor a task switch can observe them half-updated.
+
+static void *cache_alloc_obj(slab_cache_t *c) {
+    uint64_t irq = cpu_irq_save();
+    slab_cpu_t *pc = &c->cpu[cpu_local_index() % SMP_MAX_CPUS];
+    void *obj = NULL;
+    for (;;) {
+        if (pc->loaded && pc->loaded->rounds) {
+            obj = pc->loaded->objs[--pc->loaded->rounds];
+            break;
+        }
+        if (pc->previous && pc->previous->rounds) {
+            slab_mag_t *t = pc->loaded; pc->loaded = pc->previous; pc->previous = t;
+            continue;
+        }
+        slab_mag_t *full = depot_take_full(c);
+        if (full) {
+            if (pc->previous) depot_give(c, &c->depot_empty, pc->previous);
+            pc->previous = pc->loaded;
+            pc->loaded = full;
+            continue;
+        }
+        // Depot is dry: refill a magazine straight from the slabs.
+        if (!pc->loaded) pc->loaded = depot_take(c, &c->depot_empty);
+        if (!pc->loaded) pc->loaded = mag_new();
+        if (!pc->loaded) {
+            spin_lock(&c->lock);
+            obj = slab_pop_locked(c);
+            if (!obj && slab_grow_locked(c)) obj = slab_pop_locked(c);
+            if (obj && c->ctor) c->ctor_calls++;
+            spin_unlock(&c->lock);
+            if (obj && c->ctor) c->ctor(obj);
+            break;
+        }
+        mag_fill(c, pc->loaded);
+        if (!pc->loaded->rounds) break; // out of memory
+    }
+    if (obj) pc->allocs++;
+    cpu_irq_restore(irq);
+    return obj;
+}
+
+static void cache_free_obj(slab_cache_t *c, void *obj) {
+    uint64_t irq = cpu_irq_save();
+    slab_cpu_t *pc = &c->cpu[cpu_local_index() % SMP_MAX_CPUS];
+    for (;;) {
+        if (pc->loaded && pc->loaded->rounds < c->mag_rounds) {
+            pc->loaded->objs[pc->loaded->rounds++] = obj;
+            break;
+        }
+        if (pc->previous && pc->previous->rounds == 0) {
+            slab_mag_t *t = pc->loaded; pc->loaded = pc->previous; pc->previous = t;
+            continue;
+        }
+        slab_mag_t *empty = depot_take(c, &c->depot_empty);
+        if (!empty) empty = mag_new();
+        if (!empty) {
+            slab_header_t *release = NULL;
+            spin_lock(&c->lock);
+            slab_push_locked(c, obj, &release);
+            spin_unlock(&c->lock);
+            release_slabs(release, NULL);
+            break;
+        }
+        if (pc->previous) depot_give_full(c, pc->previous);
+        pc->previous = pc->loaded;
+        pc->loaded = empty;
+    }
+    pc->frees++;
+    cpu_irq_restore(irq);
+}
+
+bool slab_class_info(size_t index, slab_class_info_t *out) {
+    if (index >= cache_count()) return false;
+    out->obj_size = caches[index].obj_size;
+    out->slab_pages = caches[index].slab_pages;
+    out->obj_per_slab = caches[index].obj_per_slab;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// malloc front end
+
+// Offset of the caller's bytes inside a malloc object.
+static inline size_t slab_front(void) {
+#if ALLOC_DEBUG
+    return sizeof(slab_dbg_t) + ALLOC_REDZONE_SIZE;
+#else
+    return 0;
+#endif
+}
+
+static void *slab_alloc_from(slab_cache_t *c, size_t requested) {
+    void *obj = cache_alloc_obj(c);
+    if (!obj) return NULL;
+    void *ret = obj;
 #if ALLOC_DEBUG
     slab_dbg_t *dbg = (slab_dbg_t *)obj;
     dbg->magic = ALLOC_DBG_MAGIC;
@@ -141,94 +691,81 @@ void *slab_alloc(size_t size) {
     size_t payload_len = c->obj_size - sizeof(slab_dbg_t) - (2 * ALLOC_REDZONE_SIZE);
     alloc_dbg_fill(payload, payload_len, ALLOC_POISON_ALLOC);
     ret = payload;
+#else
+    (void)requested;
 #endif
-    spin_unlock(&slab_lock);
     return ret;
 }
 
+void *slab_alloc(size_t size) {
+    size_t need = align_up_sz(size, SLAB_MIN_ALIGN) + slab_overhead();
+    slab_cache_t *c = pick_cache(need);
+    if (!c) return NULL;
+    return slab_alloc_from(c, size);
+}
+
+void *slab_alloc_aligned(size_t size, size_t align) {
+    if (align <= SLAB_MIN_ALIGN) return slab_alloc(size);
+    // Debug framing puts the caller's bytes at a fixed offset into the slot.
+    if (slab_front() & (align - 1)) return NULL;
+    size_t need = align_up_sz(size, SLAB_MIN_ALIGN) + slab_overhead();
+    slab_cache_t *c = pick_cache(need);
+    if (!c) return NULL;
+    // Classes are naturally aligned up to a cache line: walk up to the first
+    // one whose objects satisfy 'align'.
+    for (size_t i = (size_t)(c - caches); i < cache_count(); i++) {
+        if (caches[i].align >= align) return slab_alloc_from(&caches[i], size);
+    }
+    return NULL;
+}
+
 void slab_free(void *ptr) {
     if (!ptr) return;
-    spin_lock(&slab_lock);
-    // Find which cache this pointer could belong to by scanning partial+full lists
-    for (size_t k = 0; k < cache_count(); k++) {
-        slab_cache_t *c = &caches[k];
-        slab_header_t **lists[2] = { &c->partial, &c->full };
-        for (int li = 0; li < 2; li++) {
-            slab_header_t *prev = NULL;
-            for (slab_header_t *sl = *lists[li]; sl != NULL; prev = sl, sl = sl->next) {
-                uint8_t *obj_start = (uint8_t *)ptr;
+    slab_header_t *sl = slab_of(ptr);
+    if (!sl) return;
+    slab_cache_t *c = sl->cache;
+    if (!c->malloc_cache) { kmem_cache_free(c, ptr); return; }
+    uint8_t *obj_start = (uint8_t *)ptr;
 #if ALLOC_DEBUG
-                obj_start -= (sizeof(slab_dbg_t) + ALLOC_REDZONE_SIZE);
+    obj_start -= (sizeof(slab_dbg_t) + ALLOC_REDZONE_SIZE);
 #endif
-                if (!in_slab(sl, obj_start)) continue;
-                // Compute index and push back to free list
-                size_t hdr_align = sl->obj_size < 16 ? 16 : sl->obj_size;
-                uint64_t hdr_sz = align_up(sizeof(slab_header_t), hdr_align);
-                uint8_t *base = (uint8_t *)sl + hdr_sz;
-                size_t offset = (uint8_t *)obj_start - base;
-                if (offset % c->obj_size != 0) { spin_unlock(&slab_lock); return; } // invalid ptr
-                uint16_t idx = (uint16_t)(offset / c->obj_size);
+    uint8_t *base = (uint8_t *)sl + sl->obj_offset;
+    if (obj_start < base) return; // points into the header
+    size_t offset = (size_t)(obj_start - base);
+    if (offset % c->obj_size != 0) return; // invalid ptr
+    if (offset / c->obj_size >= sl->obj_per_slab) return;
 
 #if ALLOC_DEBUG
-                slab_dbg_t *dbg = (slab_dbg_t *)obj_start;
-                if (dbg->magic != ALLOC_DBG_MAGIC) {
-                    alloc_debug_fail("slab free: magic corrupt", ptr);
-                }
-                uint8_t *front = obj_start + sizeof(slab_dbg_t);
-                uint8_t *payload = front + ALLOC_REDZONE_SIZE;
-                uint8_t *back = obj_start + sl->obj_size - ALLOC_REDZONE_SIZE;
-                if (!alloc_dbg_check(front, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE)) {
-                    alloc_debug_fail("slab free: front redzone corrupt", ptr);
-                }
-                if (!alloc_dbg_check(back, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE)) {
-                    alloc_debug_fail("slab free: back redzone corrupt", ptr);
-                }
-                size_t payload_len = sl->obj_size - sizeof(slab_dbg_t) - (2 * ALLOC_REDZONE_SIZE);
-                alloc_dbg_fill(payload, payload_len, ALLOC_POISON_FREE);
+    slab_dbg_t *dbg = (slab_dbg_t *)obj_start;
+    if (dbg->magic != ALLOC_DBG_MAGIC) {
+        alloc_debug_fail("slab free: magic corrupt", ptr);
+    }
+    uint8_t *front = obj_start + sizeof(slab_dbg_t);
+    uint8_t *payload = front + ALLOC_REDZONE_SIZE;
+    uint8_t *back = obj_start + sl->obj_size - ALLOC_REDZONE_SIZE;
+    if (!alloc_dbg_check(front, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE)) {
+        alloc_debug_fail("slab free: front redzone corrupt", ptr);
+    }
+    if (!alloc_dbg_check(back, ALLOC_REDZONE_SIZE, ALLOC_REDZONE_BYTE)) {
+        alloc_debug_fail("slab free: back redzone corrupt", ptr);
+    }
+    size_t payload_len = sl->obj_size - sizeof(slab_dbg_t) - (2 * ALLOC_REDZONE_SIZE);
+    alloc_dbg_fill(payload, payload_len, ALLOC_POISON_FREE);
+    dbg->magic = 0; // catch double frees
 #endif
 
-                *(uint16_t *)obj_start = sl->first_free_index;
-                sl->first_free_index = idx;
-                sl->free_count++;
-
-                // If was in full, move back to partial
-                if (li == 1) {
-                    if (prev) prev->next = sl->next; else *lists[li] = sl->next;
-                    sl->next = c->partial; c->partial = sl;
-                }
-                // Optional: if slab becomes empty, we could release the page back to vheap/palloc.
-                spin_unlock(&slab_lock);
-                return;
-            }
-        }
-    }
-    spin_unlock(&slab_lock);
+    cache_free_obj(c, obj_start);
 }
 
 bool slab_owns(void *ptr) {
-    if (!ptr) return false;
-    spin_lock(&slab_lock);
-    for (size_t k = 0; k < cache_count(); k++) {
-        slab_cache_t *c = &caches[k];
-        for (slab_header_t *sl = c->partial; sl; sl = sl->next) if (in_slab(sl, ptr)) { spin_unlock(&slab_lock); return true; }
-        for (slab_header_t *sl = c->full; sl; sl = sl->next) if (in_slab(sl, ptr)) { spin_unlock(&slab_lock); return true; }
-    }
-    spin_unlock(&slab_lock);
-    return false;
+    return ptr && slab_of(ptr) != NULL;
 }
 
 size_t slab_usable_size(void *ptr) {
     if (!ptr) return 0;
-    size_t result = 0;
-    spin_lock(&slab_lock);
-    for (size_t k = 0; k < cache_count(); k++) {
-        slab_cache_t *c = &caches[k];
-        for (slab_header_t *sl = c->partial; sl; sl = sl->next) if (in_slab(sl, ptr)) { result = c->obj_size; goto out; }
-        for (slab_header_t *sl = c->full; sl; sl = sl->next) if (in_slab(sl, ptr)) { result = c->obj_size; goto out; }
-    }
-out:
-    spin_unlock(&slab_lock);
-    if (result == 0) return 0;
+    slab_header_t *sl = slab_of(ptr);
+    if (!sl) return 0;
+    size_t result = sl->obj_size;
 #if ALLOC_DEBUG
     size_t overhead = slab_overhead();
     if (result <= overhead) return 0;
@@ -236,3 +773,138 @@ out:
 #endif
     return result;
 }
+
+// ---------------------------------------------------------------------------
+// Typed object caches
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (size == 0) return NULL;
+    if (align < SLAB_MIN_ALIGN) align = SLAB_MIN_ALIGN;
+    if (align & (align - 1)) return NULL;
+    size_t obj_size = align_up_sz(size, align);
+    if (obj_size > KMEM_CACHE_MAX_SIZE || align > PAGE_SIZE) return NULL;
+
+    // The cache and its per-CPU array come from one vmalloc block.
+    size_t bytes = sizeof(slab_cache_t) + sizeof(slab_cpu_t) * SMP_MAX_CPUS;
+    slab_cache_t *c = vmalloc(bytes);
+    if (!c) return NULL;
+    memset(c, 0, bytes);
+    spinlock_init(&c->lock);
+    spinlock_init(&c->depot_lock);
+    c->obj_size = (uint16_t)obj_size;
+    c->align = (uint16_t)align;
+    setup_geometry(c);
+    c->malloc_cache = false;
+    c->ctor = ctor;
+    c->empty_limit = SLAB_EMPTY_LIMIT;
+    strncpy(c->name, name ? name : "cache", sizeof(c->name) - 1);
+    c->cpu = (slab_cpu_t *)(c + 1);
+    register_cache(c);
+    return c;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *c) {
+    if (!c) return NULL;
+    return cache_alloc_obj(c);
+}
+
+void kmem_cache_free(kmem_cache_t *c, void *obj) {
+    if (!c || !obj) return;
+    slab_header_t *sl = slab_of(obj);
+    if (!sl || sl->cache != c) {
+#if ALLOC_DEBUG
+        alloc_debug_fail("kmem_cache_free: object not from this cache", obj);
+#endif
+        return;
+    }
+    size_t offset = (size_t)((uint8_t *)obj - ((uint8_t *)sl + sl->obj_offset));
+    if (offset % c->obj_size != 0) return; // interior pointer
+    cache_free_obj(c, obj);
+}
+
+void kmem_cache_get_stats(kmem_cache_t *c, kmem_cache_stats_t *out) {
+    if (!c || !out) return;
+    memset(out, 0, sizeof(*out));
+    out->name = c->name;
+    out->obj_size = c->obj_size;
+    out->align = c->align;
+    out->slab_pages = c->slab_pages;
+    out->obj_per_slab = c->obj_per_slab;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&c->lock);
+    out->slabs = c->slabs;
+    out->slabs_freed = c->slabs_freed;
+    out->empty_slabs = c->nr_empty;
+    out->refills = c->refills;
+    out->ctor_calls = c->ctor_calls;
+    spin_unlock(&c->lock);
+    cpu_irq_restore(irq);
+    // Per-CPU counters are read racily; the sum is a snapshot.
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        out->allocs += __atomic_load_n(&c->cpu[i].allocs, __ATOMIC_RELAXED);
+        out->frees += __atomic_load_n(&c->cpu[i].frees, __ATOMIC_RELAXED);
+    }
+    out->active = out->allocs >= out->frees ? out->allocs - out->frees : 0;
+}
+
+void kmem_cache_dump_stats(void) {
+    for (slab_cache_t *c = cache_list; c; c = c->next_cache) {
+        kmem_cache_stats_t st;
+        kmem_cache_get_stats(c, &st);
+        if (!st.allocs && !st.slabs) continue;
+        info_printf("slab: %-16s obj=%zu align=%zu pages=%zu/%zu objs active=%llu allocs=%llu slabs=%llu (empty %llu, freed %llu) refills=%llu ctor=%llu\n",
+                    st.name, st.obj_size, st.align, st.slab_pages, st.obj_per_slab,
+                    (unsigned long long)st.active,
+                    (unsigned long long)st.allocs, (unsigned long long)st.slabs,
+                    (unsigned long long)st.empty_slabs, (unsigned long long)st.slabs_freed,
+                    (unsigned long long)st.refills, (unsigned long long)st.ctor_calls);
+    }
+}
+
+void kmem_cache_dump_fragmentation(void) {
+    for (slab_cache_t *c = cache_list; c; c = c->next_cache) {
+        kmem_cache_stats_t st;
+        kmem_cache_get_stats(c, &st);
+        if (!st.slabs) continue;
+        // Free slots still on the slab free lists; the rest of the capacity
+        // not in use sits in the per-CPU magazines and the depot.
+        uint64_t partial = 0, slab_free = 0;
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&c->lock);
+        for (slab_header_t *sl = c->partial; sl; sl = sl->next) {
+            partial++;
+            slab_free += sl->free_count;
+        }
+        slab_free += (uint64_t)c->nr_empty * c->obj_per_slab;
+        spin_unlock(&c->lock);
+        cpu_irq_restore(irq);
+        uint64_t capacity = st.slabs * st.obj_per_slab;
+        uint64_t active = st.active < capacity ? st.active : capacity;
+        uint64_t cached = capacity - active > slab_free ? capacity - active - slab_free : 0;
+        info_printf("slab: %-16s %llu/%llu slots used (%llu%%), %llu slabs: %llu partial, %llu empty; free %llu in slabs, %llu cached\n",
+                    st.name, (unsigned long long)active, (unsigned long long)capacity,
+                    (unsigned long long)(capacity ? active * 100 / capacity : 0), (unsigned long long)st.slabs,
+                    (unsigned long long)partial, (unsigned long long)st.empty_slabs,
+                    (unsigned long long)slab_free, (unsigned long long)cached);
+    }
+}
+
+void kmem_cache_set_empty_limit(kmem_cache_t *c, uint32_t limit) {
+    if (!c) return;
+    slab_header_t *release = NULL;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&c->lock);
+    c->empty_limit = limit;
+    while (c->nr_empty > limit) {
+        slab_header_t *sl = c->empty;
+        list_remove(&c->empty, sl);
+        c->nr_empty--;
+        c->slabs--;
+        c->slabs_freed++;
+        sl->next = release;
+        release = sl;
+    }
+    spin_unlock(&c->lock);
+    cpu_irq_restore(irq);
+    release_slabs(release, NULL);
+}
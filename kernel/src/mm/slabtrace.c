@@ -0,0 +1,200 @@
+// Allocation trace recorder and slab fragmentation report.
+//
+// The recorder appends one event per malloc()/free() to a vmalloc'd buffer.
+// The report replays the events through a model of each slab layout: live
+// objects per class, slabs needed to hold them (fully packed, so this is a
+// lower bound on what the real caches keep) and the bytes that spill to
+// stelloc. The "old" layout is the original one: power-of-two classes
+// 8..1024, one page per slab, the header padded to the object size.
+
+#include <slab.h>
+#include <vheap.h>
+#include <lprintf.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PAGE_SIZE 4096ULL
+
+typedef struct trace_event {
+    uint64_t ptr;
+    uint64_t size;     // 0 for a free
+} trace_event_t;
+
+bool slab_tracing;
+static trace_event_t *trace_buf;
+static size_t trace_cap;
+static size_t trace_len;   // next slot; may run past trace_cap when full
+
+int slab_trace_start(size_t capacity) {
+    if (slab_tracing || capacity == 0) return -1;
+    if (trace_buf) { vfree(trace_buf); trace_buf = NULL; }
+    trace_buf = vmalloc(capacity * sizeof(trace_event_t));
+    if (!trace_buf) return -1;
+    trace_cap = capacity;
+    trace_len = 0;
+    __atomic_store_n(&slab_tracing, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void slab_trace_stop(void) {
+    __atomic_store_n(&slab_tracing, false, __ATOMIC_RELEASE);
+}
+
+void slab_trace_record(void *ptr, size_t size) {
+    if (!ptr) return;
+    size_t i = __atomic_fetch_add(&trace_len, 1, __ATOMIC_RELAXED);
+    if (i >= trace_cap) {
+        __atomic_store_n(&slab_tracing, false, __ATOMIC_RELAXED);
+        return;
+    }
+    trace_buf[i].ptr = (uint64_t)(uintptr_t)ptr;
+    trace_buf[i].size = size;
+}
+
+// ---------------------------------------------------------------------------
+// Layout models
+
+#define MODEL_MAX_CLASSES 32
+
+typedef struct frag_model {
+    const char *name;
+    size_t nclasses;
+    size_t obj_size[MODEL_MAX_CLASSES];
+    size_t slab_pages[MODEL_MAX_CLASSES];
+    size_t obj_per_slab[MODEL_MAX_CLASSES];
+    uint64_t live[MODEL_MAX_CLASSES];
+    uint64_t requested;    // live bytes asked for from slab classes
+    uint64_t slot_bytes, large_bytes, slab_pages_used;
+    // Sampled when slab pages + large bytes peak
+    uint64_t peak_footprint, peak_requested, peak_slot, peak_pages, peak_large;
+} frag_model_t;
+
+// Stelloc block: 8-byte aligned payload after an 8-byte size header.
+static inline uint64_t large_cost(size_t size) { return ((size + 7) & ~7ULL) + 8; }
+
+static void model_old(frag_model_t *m) {
+    memset(m, 0, sizeof(*m));
+    m->name = "pow2/1-page";
+    for (size_t sz = 8; sz <= 1024; sz <<= 1) {
+        size_t i = m->nclasses++;
+        m->obj_size[i] = sz;
+        m->slab_pages[i] = 1;
+        m->obj_per_slab[i] = (PAGE_SIZE - slab_header_size(sz)) / sz;
+    }
+}
+
+static void model_current(frag_model_t *m) {
+    memset(m, 0, sizeof(*m));
+    m->name = "current";
+    slab_class_info_t ci;
+    for (size_t i = 0; i < MODEL_MAX_CLASSES && slab_class_info(i, &ci); i++) {
+        m->obj_size[i] = ci.obj_size;
+        m->slab_pages[i] = ci.slab_pages;
+        m->obj_per_slab[i] = ci.obj_per_slab;
+        m->nclasses++;
+    }
+}
+
+static inline uint64_t slabs_for(const frag_model_t *m, size_t c, uint64_t live) {
+    return (live + m->obj_per_slab[c] - 1) / m->obj_per_slab[c];
+}
+
+// Apply one allocation (sign 1) or free (sign -1) of 'size' bytes.
+static void model_apply(frag_model_t *m, size_t size, int sign) {
+    size_t rounded = (size + 7) & ~(size_t)7;
+    size_t c = 0;
+    while (c < m->nclasses && m->obj_size[c] < rounded) c++;
+    if (c == m->nclasses) {
+        if (sign > 0) m->large_bytes += large_cost(size);
+        else m->large_bytes -= large_cost(size);
+    } else {
+        uint64_t before = slabs_for(m, c, m->live[c]);
+        if (sign > 0) {
+            m->live[c]++;
+            m->slot_bytes += m->obj_size[c];
+            m->requested += size;
+        } else {
+            m->live[c]--;
+            m->slot_bytes -= m->obj_size[c];
+            m->requested -= size;
+        }
+        uint64_t after = slabs_for(m, c, m->live[c]);
+        m->slab_pages_used += (after - before) * m->slab_pages[c];
+    }
+
+    uint64_t footprint = m->slab_pages_used * PAGE_SIZE + m->large_bytes;
+    if (footprint > m->peak_footprint) {
+        m->peak_footprint = footprint;
+        m->peak_requested = m->requested;
+        m->peak_slot = m->slot_bytes;
+        m->peak_pages = m->slab_pages_used;
+        m->peak_large = m->large_bytes;
+    }
+}
+
+static void model_print(const frag_model_t *m) {
+    uint64_t waste_pct = m->peak_slot ? 100 * (m->peak_slot - m->peak_requested) / m->peak_slot : 0;
+    info_printf("slab: frag %-12s peak %llu KiB (slabs %llu pages, large %llu KiB), in-slab slot %llu KiB, internal waste %llu%%\n",
+                m->name, (unsigned long long)(m->peak_footprint >> 10),
+                (unsigned long long)m->peak_pages, (unsigned long long)(m->peak_large >> 10),
+                (unsigned long long)(m->peak_slot >> 10), (unsigned long long)waste_pct);
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+
+typedef struct live_entry {
+    uint64_t ptr;      // 0 empty, 1 deleted
+    uint64_t size;
+} live_entry_t;
+
+static inline size_t hash_ptr(uint64_t p, size_t mask) {
+    return (size_t)((p >> 3) * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+}
+
+void slab_frag_report(void) {
+    if (slab_tracing) slab_trace_stop();
+    size_t n = trace_len < trace_cap ? trace_len : trace_cap;
+    if (!trace_buf || n == 0) {
+        info_printf("slab: frag report: no trace recorded\n");
+        return;
+    }
+    size_t slots = 16;
+    while (slots < 2 * n) slots <<= 1;
+    live_entry_t *table = vmalloc(slots * sizeof(live_entry_t));
+    frag_model_t *models = vmalloc(2 * sizeof(frag_model_t));
+    if (!table || !models) {
+        error_printf("slab: frag report: out of memory\n");
+        vfree(table);
+        vfree(models);
+        return;
+    }
+    memset(table, 0, slots * sizeof(live_entry_t));
+    model_old(&models[0]);
+    model_current(&models[1]);
+
+    size_t mask = slots - 1, unmatched = 0;
+    for (size_t i = 0; i < n; i++) {
+        const trace_event_t *ev = &trace_buf[i];
+        size_t h = hash_ptr(ev->ptr, mask);
+        if (ev->size) {
+            // Reuse the first deleted slot on the probe path
+            while (table[h].ptr > 1) h = (h + 1) & mask;
+            table[h].ptr = ev->ptr;
+            table[h].size = ev->size;
+            for (int m = 0; m < 2; m++) model_apply(&models[m], ev->size, 1);
+            continue;
+        }
+        while (table[h].ptr && table[h].ptr != ev->ptr) h = (h + 1) & mask;
+        if (!table[h].ptr) { unmatched++; continue; } // allocated before the trace
+        for (int m = 0; m < 2; m++) model_apply(&models[m], table[h].size, -1);
+        table[h].ptr = 1;
+    }
+
+    info_printf("slab: frag report over %zu events%s (%zu frees of untraced blocks)\n",
+                n, trace_len > trace_cap ? " (trace truncated)" : "", unmatched);
+    for (int m = 0; m < 2; m++) model_print(&models[m]);
+    vfree(table);
+    vfree(models);
+}
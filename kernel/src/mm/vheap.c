@@ -1,36 +1,276 @@
 #include <vheap.h>
+#include <vrange.h>
 #include <vmm.h>
 #include <palloc.h>
 #include <boot.h>
+#include <lock.h>
+#include <cpu_local.h>
+#include <shrinker.h>
 
+// The vheap window is carved up by a range allocator so freed stacks, slab
+// pages and stelloc extensions give their address space and frames back.
+// Every allocation is followed by one unmapped guard page.
+static vrange_t heap;
 static uint64_t heap_base = 0;
 static uint64_t heap_size = 0;
-static uint64_t heap_commit = 0;
+
+// Page-type map: a directory of palloc pages, each holding one type byte for
+// 4096 pages (16 MiB) of the window. Leaves are created on first use and
+// never freed, so readers need no lock.
+#define PT_LEAF_PAGES 4096ULL
+static uint8_t *page_types[VHEAP_MAX_BYTES / (PT_LEAF_PAGES * 0x1000ULL)];
+static spinlock_t page_type_lock;
+
+// Demand paging. Faults are serialized so two CPUs touching the same cluster
+// cannot both install a frame for one page.
+static spinlock_t fault_lock;
+static vheap_fault_stats_t fault_stats;
 
 static inline uint64_t align_up(uint64_t x, uint64_t a) { return (x + (a-1)) & ~(a-1); }
 
+// Lazily freed ranges pin their frames until a purge; give them up under
+// memory pressure.
+static size_t vheap_shrink(size_t target, void *ctx) {
+    (void)target; (void)ctx;
+    return vrange_purge(&heap);
+}
+static shrinker_t vheap_shrinker = { .name = "vheap-lazy", .shrink = vheap_shrink, .order = 10 };
+
 int vheap_init(uint64_t base_va, uint64_t size_bytes) {
-    heap_base = align_up(base_va, 0x1000);
-    heap_size = size_bytes & ~0xFFFULL;
-    heap_commit = heap_base;
-    if (!heap_size) return -1;
+    if (heap_base) return 0;
+    if (size_bytes > VHEAP_MAX_BYTES) size_bytes = VHEAP_MAX_BYTES;
+    if (vrange_init(&heap, "vheap", base_va, size_bytes, 1) != 0) return -1;
+    spinlock_init(&fault_lock);
+    spinlock_init(&page_type_lock);
+    heap_base = heap.base;
+    heap_size = heap.size;
+    shrinker_register(&vheap_shrinker);
     return 0;
 }
 
-uint64_t vheap_commit(size_t bytes) {
+static uint8_t *page_type_leaf(uint64_t idx, bool create) {
+    uint8_t **slot = &page_types[idx / PT_LEAF_PAGES];
+    uint8_t *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (leaf || !create) return leaf;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&page_type_lock);
+    leaf = *slot;
+    if (!leaf) {
+        leaf = (uint8_t *)palloc_zero_allocate_page();
+        __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&page_type_lock);
+    cpu_irq_restore(irq);
+    return leaf;
+}
+
+void vheap_set_page_type(uint64_t va, size_t npages, uint8_t type) {
+    if (heap_base == 0 || va < heap_base) return;
+    uint64_t idx = (va - heap_base) >> 12;
+    uint64_t limit = heap_size >> 12;
+    for (size_t i = 0; i < npages && idx < limit; i++, idx++) {
+        uint8_t *leaf = page_type_leaf(idx, type != VHEAP_PT_NONE);
+        if (!leaf) {
+            // Nothing was ever tagged here; skip the rest of this leaf.
+            uint64_t skip = PT_LEAF_PAGES - (idx % PT_LEAF_PAGES) - 1;
+            i += skip; idx += skip;
+            continue;
+        }
+        leaf[idx % PT_LEAF_PAGES] = type;
+    }
+}
+
+uint8_t vheap_page_type(uint64_t va) {
+    if (va < heap_base || va >= heap_base + heap_size) return VHEAP_PT_NONE;
+    uint64_t idx = (va - heap_base) >> 12;
+    uint8_t *leaf = page_type_leaf(idx, false);
+    return leaf ? leaf[idx % PT_LEAF_PAGES] : VHEAP_PT_NONE;
+}
+
+// Frames are gathered in batches and handed to vmm_map_pages() so each page
+// table is walked once per batch rather than once per page.
+#define COMMIT_BATCH 64
+
+static void *alloc_frame(bool zero) {
+    void *page = zero ? palloc_zero_allocate_page() : palloc_allocate_page();
+    // Lazily released ranges still pin their frames; reclaim them and retry.
+    if (!page && vrange_purge(&heap)) page = zero ? palloc_zero_allocate_page() : palloc_allocate_page();
+    return page;
+}
+
+static void *vmalloc_frames(size_t bytes, bool zero) {
     bytes = (size_t)align_up(bytes, 0x1000);
-    if (heap_base == 0 || bytes == 0) return 0;
-    if ((heap_commit + bytes) > (heap_base + heap_size)) return 0;
-
-    uint64_t va = heap_commit;
-    for (uint64_t off = 0; off < bytes; off += 0x1000) {
-        void *page = palloc_allocate_page();
-        if (!page) return 0;
-        uint64_t pa = (uint64_t)(uintptr_t)page - hhdm_request.response->offset;
-        if (vmm_map_page(va + off, pa, VMM_P_PRESENT|VMM_P_WRITABLE) != 0) return 0;
+    if (heap_base == 0 || bytes == 0) return NULL;
+    // A safe point for reclaim: callers never hold an mm lock here.
+    (void)shrinker_reclaim_direct();
+    uint64_t va = vrange_alloc(&heap, bytes, 0x1000);
+    if (!va) return NULL;
+
+    uint64_t frames[COMMIT_BATCH];
+    uint64_t hhdm = hhdm_request.response->offset;
+    for (uint64_t off = 0; off < bytes; ) {
+        size_t n = 0;
+        while (n < COMMIT_BATCH && off + (uint64_t)n * 0x1000 < bytes) {
+            void *page = alloc_frame(zero);
+            if (!page) break;
+            frames[n++] = (uint64_t)(uintptr_t)page - hhdm;
+        }
+        if (n == 0 || vmm_map_pages(va + off, frames, n, VMM_P_PRESENT|VMM_P_WRITABLE) != 0) {
+            for (size_t i = 0; i < n; i++) palloc_free_page((void *)(uintptr_t)(frames[i] + hhdm));
+            // Do not leave a half-committed range behind.
+            if (off) vmm_unmap_range(va, (size_t)(off >> 12), VMM_UNMAP_FREE, NULL);
+            (void)vrange_release(&heap, va, 0);
+            return NULL;
+        }
+        off += (uint64_t)n * 0x1000;
+    }
+    vheap_set_page_type(va, bytes >> 12, VHEAP_PT_VMALLOC);
+    return (void *)(uintptr_t)va;
+}
+
+void *vmalloc(size_t bytes) {
+    return vmalloc_frames(bytes, false);
+}
+
+void *vzalloc(size_t bytes) {
+    return vmalloc_frames(bytes, true);
+}
+
+void vfree(void *ptr) {
+    if (!ptr) return;
+    uint64_t va = (uint64_t)(uintptr_t)ptr;
+    size_t bytes = vmalloc_size(ptr);
+    if (!bytes) return;
+    vheap_set_page_type(va, bytes >> 12, VHEAP_PT_NONE);
+    (void)vrange_release(&heap, va, VMM_UNMAP_FREE);
+}
+
+void vfree_now(void *ptr) {
+    if (!ptr) return;
+    uint64_t va = (uint64_t)(uintptr_t)ptr;
+    size_t bytes = vmalloc_size(ptr);
+    if (!bytes) return;
+    vheap_set_page_type(va, bytes >> 12, VHEAP_PT_NONE);
+    // The range is still ours until it is released, so nobody else can map
+    // into it while the frames go back.
+    (void)vmm_unmap_range(va, bytes >> 12, VMM_UNMAP_FREE, NULL);
+    (void)vrange_release(&heap, va, 0);
+}
+
+size_t vmalloc_size(const void *ptr) {
+    uint64_t start, size;
+    if (!ptr || !vrange_lookup(&heap, (uint64_t)(uintptr_t)ptr, &start, &size)) return 0;
+    if (start != (uint64_t)(uintptr_t)ptr) return 0;
+    return (size_t)size;
+}
+
+size_t vheap_purge(void) {
+    return heap_base ? vrange_purge(&heap) : 0;
+}
+
+void vheap_get_stats(vrange_stats_t *out) {
+    if (heap_base) vrange_get_stats(&heap, out);
+}
+
+void *vheap_reserve(size_t bytes) {
+    if (heap_base == 0 || bytes == 0) return NULL;
+    uint64_t va = vrange_alloc(&heap, bytes, 0x1000);
+    if (va) {
+        vheap_set_page_type(va, align_up(bytes, 0x1000) >> 12, VHEAP_PT_VMALLOC);
+        __atomic_fetch_add(&fault_stats.reserved_bytes, align_up(bytes, 0x1000), __ATOMIC_RELAXED);
+    }
+    return (void *)(uintptr_t)va;
+}
+
+// Back every non-present page in [va, va + npages pages) with a zeroed frame.
+// Runs of absent pages are mapped with one vmm_map_pages() call each.
+// Caller holds fault_lock. Returns the number of pages mapped, or -1 when
+// memory ran out before the first page.
+static long populate_locked(uint64_t va, size_t npages) {
+    uint64_t frames[VHEAP_FAULT_CLUSTER];
+    uint64_t hhdm = hhdm_request.response->offset;
+    long mapped = 0;
+    size_t i = 0;
+    while (i < npages) {
+        uint64_t pa;
+        if (vmm_translate(va + i * 0x1000ULL, &pa)) { i++; continue; }
+        uint64_t run_va = va + i * 0x1000ULL;
+        size_t n = 0;
+        while (i < npages && n < VHEAP_FAULT_CLUSTER && !vmm_translate(va + i * 0x1000ULL, &pa)) {
+            void *page = palloc_zero_allocate_page();
+            if (!page) break;
+            frames[n++] = (uint64_t)(uintptr_t)page - hhdm;
+            i++;
+        }
+        if (n == 0 || vmm_map_pages(run_va, frames, n, VMM_P_PRESENT|VMM_P_WRITABLE|VMM_P_NX) != 0) {
+            for (size_t k = 0; k < n; k++) palloc_free_page((void *)(uintptr_t)(frames[k] + hhdm));
+            return mapped ? mapped : -1;
+        }
+        mapped += (long)n;
+    }
+    return mapped;
+}
+
+int vheap_populate(uint64_t va, size_t bytes) {
+    uint64_t start, size;
+    uint64_t first = va & ~0xFFFULL;
+    uint64_t end = align_up(va + bytes, 0x1000);
+    if (!vrange_lookup(&heap, first, &start, &size) || end > start + size) return -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&fault_lock);
+    long rc = populate_locked(first, (size_t)((end - first) >> 12));
+    spin_unlock(&fault_lock);
+    cpu_irq_restore(irq);
+    if (rc > 0) __atomic_fetch_add(&fault_stats.pages_populated, (uint64_t)rc, __ATOMIC_RELAXED);
+    return rc < 0 ? -1 : 0;
+}
+
+int vheap_handle_fault(uint64_t va, uint64_t err_code) {
+    if (heap_base == 0 || (err_code & 1ULL)) return -1; // only non-present faults
+    if (va < heap_base || va >= heap_base + heap_size) return -1;
+    uint64_t start, size;
+    if (!vrange_lookup(&heap, va, &start, &size)) {
+        __atomic_fetch_add(&fault_stats.bad_faults, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    // Map the aligned cluster around the fault, clipped to the allocation.
+    // Close to running out, map only the page that faulted.
+    uint64_t span = (uint64_t)VHEAP_FAULT_CLUSTER * 0x1000ULL;
+    if (mem_pressure() >= MEM_PRESSURE_MIN) span = 0x1000ULL;
+    uint64_t lo = va & ~(span - 1);
+    uint64_t hi = lo + span;
+    if (lo < start) lo = start;
+    if (hi > start + size) hi = start + size;
+
+    spin_lock(&fault_lock); // #PF runs with interrupts off
+    long rc = populate_locked(lo, (size_t)((hi - lo) >> 12));
+    spin_unlock(&fault_lock);
+
+    __atomic_fetch_add(&fault_stats.faults, 1, __ATOMIC_RELAXED);
+    if (rc < 0) {
+        // Another CPU may have won the race for this very page.
+        uint64_t pa;
+        if (vmm_translate(va, &pa)) return 0;
+        __atomic_fetch_add(&fault_stats.oom_faults, 1, __ATOMIC_RELAXED);
+        return -1;
     }
-    heap_commit += bytes;
-    return va;
+    __atomic_fetch_add(&fault_stats.pages_faulted, (uint64_t)rc, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void vheap_get_fault_stats(vheap_fault_stats_t *out) {
+    if (!out) return;
+    out->faults = __atomic_load_n(&fault_stats.faults, __ATOMIC_RELAXED);
+    out->pages_faulted = __atomic_load_n(&fault_stats.pages_faulted, __ATOMIC_RELAXED);
+    out->pages_populated = __atomic_load_n(&fault_stats.pages_populated, __ATOMIC_RELAXED);
+    out->bad_faults = __atomic_load_n(&fault_stats.bad_faults, __ATOMIC_RELAXED);
+    out->oom_faults = __atomic_load_n(&fault_stats.oom_faults, __ATOMIC_RELAXED);
+    out->reserved_bytes = __atomic_load_n(&fault_stats.reserved_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t vheap_commit(size_t bytes) {
+    return (uint64_t)(uintptr_t)vmalloc(bytes);
 }
 
 void vheap_bounds(uint64_t* base_va, uint64_t* size_bytes) {
@@ -41,8 +281,7 @@ void vheap_bounds(uint64_t* base_va, uint64_t* size_bytes) {
 int vheap_map_one(uint64_t va) {
     if (heap_base == 0) return -1;
     if (va < heap_base || va >= (heap_base + heap_size)) return -1;
-    void *page = palloc_allocate_page();
-    if (!page) return -1;
-    uint64_t pa = (uint64_t)(uintptr_t)page - hhdm_request.response->offset;
-    return vmm_map_page(va & ~0xFFFULL, pa, VMM_P_PRESENT|VMM_P_WRITABLE);
+    // Only pages inside a live allocation may be faulted back in; guard pages
+    // and free space must keep faulting.
+    return vheap_populate(va & ~0xFFFULL, 0x1000);
 }
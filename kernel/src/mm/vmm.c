@@ -2,21 +2,150 @@
 #include <boot.h>
 #include <palloc.h>
 #include <lprintf.h>
+#include <lock.h>
+#include <isr.h>
+#include <lapic.h>
+#include <smp.h>
+#include <cpu_local.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 
-static volatile uint64_t *pml4 = 0; // HHDM-mapped pointer to current PML4
+static volatile uint64_t *pml4 = 0; // HHDM-mapped pointer to the kernel PML4
+static spinlock_t vmm_lock;          // serialises page-table edits and the space list
+
+static vmm_space_t kernel_space;
+static vmm_space_t *space_list = &kernel_space;
+
+#define CR4_PGE   (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+#define CR3_NOFLUSH (1ULL << 63)
+#define PCID_MAX  4095
+
+#define MSR_IA32_PAT 0x277
+// PA0..PA7, one byte each; see VMM_CACHE_* in vmm.h.
+#define PAT_LAYOUT   0x0007010500070406ULL
+
+static bool pcid_supported = false;  // CPUID says yes and CR4.PCIDE is set
+static bool pcid_use = false;        // switches may keep TLB entries
+static bool pat_supported = false;   // CPUID says yes; IA32_PAT is programmed per CPU
+static spinlock_t pcid_lock;
+static uint16_t pcid_next = 1;       // 0 is the kernel space
+static _Atomic uint64_t pcid_generation = 1;
+static uint64_t cpu_pcid_gen[SMP_MAX_CPUS];  // generation each CPU last flushed for
+static vmm_space_t *cpu_space[SMP_MAX_CPUS]; // space loaded on each CPU
+
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// CPUs that have loaded the kernel page tables and can hold stale entries.
+static _Atomic uint64_t vmm_active_cpus[SMP_MAX_CPUS / 64];
+
+// Single in-flight shootdown; the initiator holds shootdown_lock until every
+// target has acknowledged, so the batch pointer stays valid for the handlers.
+static spinlock_t shootdown_lock;
+static const vmm_flush_t *volatile shootdown_batch;
+static _Atomic uint32_t shootdown_pending;
+static _Atomic uint8_t shootdown_req[SMP_MAX_CPUS];
 
 static inline uint64_t read_cr3(void) {
     uint64_t val; __asm__ volatile ("mov %%cr3,%0" : "=r"(val)); return val;
 }
 
+static inline void write_cr3(uint64_t val) {
+    __asm__ volatile ("mov %0,%%cr3" :: "r"(val) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t val; __asm__ volatile ("mov %%cr4,%0" : "=r"(val)); return val;
+}
+
+static inline void write_cr4(uint64_t val) {
+    __asm__ volatile ("mov %0,%%cr4" :: "r"(val) : "memory");
+}
+
+static inline void invlpg(uint64_t va) {
+    __asm__ volatile ("invlpg (%0)" :: "r"(va) : "memory");
+}
+
 static inline void *phys_to_virt(uint64_t phys) {
     return (void *)(phys + hhdm_request.response->offset);
 }
 
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile ("wrmsr" :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static void tlb_shootdown_isr(isr_frame_t *f);
+static void flush_everything(void);
+
+static bool cpu_has_pcid(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (ecx & (1u << 17)) != 0;
+}
+
+static bool cpu_has_pat(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & (1u << 16)) != 0;
+}
+
+// Every CPU must hold the same PAT. Entries 0-5 are the values the
+// bootloader already set and no mapping uses 6-7 yet, so no cached line
+// changes type and a TLB flush is enough; no cache disable or wbinvd.
+static void program_pat(void) {
+    if (rdmsr(MSR_IA32_PAT) == PAT_LAYOUT) return;
+    wrmsr(MSR_IA32_PAT, PAT_LAYOUT);
+    flush_everything();
+}
+
+// Per-CPU paging features: global pages always, PCIDs when the CPU has them.
+// CR4.PCIDE may only be set while CR3[11:0] is zero, which holds for the
+// kernel PML4 loaded at this point.
+static void enable_paging_features(void) {
+    uint64_t cr4 = read_cr4() | CR4_PGE;
+    if (pcid_supported) cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+    if (pat_supported) program_pat();
+}
+
 void vmm_init(void) {
     uint64_t cr3 = read_cr3();
     uint64_t pml4_phys = cr3 & ~0xFFFULL;
     pml4 = (volatile uint64_t *)phys_to_virt(pml4_phys);
+    static bool registered = false;
+    if (!registered) {
+        spinlock_init(&vmm_lock);
+        spinlock_init(&shootdown_lock);
+        spinlock_init(&pcid_lock);
+        isr_register(LAPIC_TLB_VECTOR, tlb_shootdown_isr);
+        kernel_space.pml4_phys = pml4_phys;
+        kernel_space.pml4 = pml4;
+        kernel_space.pcid = 0;
+        kernel_space.next = NULL;
+        pcid_supported = cpu_has_pcid() && (cr3 & 0xFFFULL) == 0;
+        pcid_use = pcid_supported;
+        pat_supported = cpu_has_pat();
+        enable_paging_features();
+        info_printf("vmm: PCID %s, PAT %s\n", pcid_supported ? "enabled" : "not supported",
+                    pat_supported ? "enabled (WC available)" : "not supported");
+        registered = true;
+    }
+    vmm_cpu_online(0);
+}
+
+void vmm_cpu_online(uint32_t cpu_index) {
+    if (cpu_index >= SMP_MAX_CPUS) return;
+    if (cpu_index != 0) enable_paging_features(); // APs inherit nothing from the BSP's CR4
+    cpu_pcid_gen[cpu_index] = atomic_load_explicit(&pcid_generation, memory_order_acquire);
+    cpu_space[cpu_index] = &kernel_space;
+    atomic_fetch_or_explicit(&vmm_active_cpus[cpu_index / 64], 1ULL << (cpu_index % 64),
+                             memory_order_release);
 }
 
 static inline volatile uint64_t *ensure_table(volatile uint64_t *parent, size_t idx, uint64_t flags) {
@@ -29,27 +158,536 @@ static inline volatile uint64_t *ensure_table(volatile uint64_t *parent, size_t
         uint64_t phys = (uint64_t)(uintptr_t)page - hhdm_request.response->offset;
         parent[idx] = phys | (flags & (VMM_P_PRESENT|VMM_P_WRITABLE|VMM_P_USER));
         entry = parent[idx];
+    } else if (entry & VMM_P_HUGE) {
+        return 0; // already covered by a large page; never treat it as a table
     }
     uint64_t child_phys = entry & ~0xFFFULL;
     return (volatile uint64_t *)phys_to_virt(child_phys);
 }
 
-int vmm_map_page(uint64_t va, uint64_t pa, uint64_t flags) {
-    if (!pml4) vmm_init();
+// Next-level table behind a present, non-huge entry, or NULL.
+static inline volatile uint64_t *next_table(uint64_t entry) {
+    if (!(entry & VMM_P_PRESENT) || (entry & VMM_P_HUGE)) return 0;
+    return (volatile uint64_t *)phys_to_virt(entry & PTE_ADDR_MASK);
+}
+
+// Top-level table for 'va': kernel-half entries always live in the kernel
+// PML4. A new kernel PML4 slot is copied into every other space so the upper
+// half stays identical everywhere. Caller holds vmm_lock.
+static volatile uint64_t *ensure_pdpt(vmm_space_t *space, uint64_t va, uint64_t flags) {
     size_t pml4_i = (va >> 39) & 0x1FF;
-    size_t pdpt_i = (va >> 30) & 0x1FF;
-    size_t pd_i   = (va >> 21) & 0x1FF;
-    size_t pt_i   = (va >> 12) & 0x1FF;
-
-    volatile uint64_t *pdpt = ensure_table(pml4, pml4_i, VMM_P_PRESENT|VMM_P_WRITABLE);
-    if (!pdpt) return -1;
-    volatile uint64_t *pd   = ensure_table(pdpt, pdpt_i, VMM_P_PRESENT|VMM_P_WRITABLE);
-    if (!pd) return -1;
-    volatile uint64_t *pt   = ensure_table(pd, pd_i, VMM_P_PRESENT|VMM_P_WRITABLE);
-    if (!pt) return -1;
-
-    pt[pt_i] = (pa & ~0xFFFULL) | (flags & ~(0ULL)) | VMM_P_PRESENT;
-    // Invalidate TLB for VA (local)
-    __asm__ volatile ("invlpg (%0)" :: "r"(va) : "memory");
+    if (va >= VMM_KERNEL_BASE) {
+        bool fresh = !(pml4[pml4_i] & VMM_P_PRESENT);
+        volatile uint64_t *pdpt = ensure_table(pml4, pml4_i, VMM_P_PRESENT|VMM_P_WRITABLE);
+        if (pdpt && fresh) {
+            for (vmm_space_t *s = space_list; s; s = s->next) {
+                if (s != &kernel_space) s->pml4[pml4_i] = pml4[pml4_i];
+            }
+        }
+        return pdpt;
+    }
+    return ensure_table(space->pml4, pml4_i, flags);
+}
+
+static int update_range(volatile uint64_t *root, uint64_t va, size_t npages, int op,
+                        uint32_t opts, uint64_t prot, vmm_flush_t *flush);
+enum { RANGE_UNMAP, RANGE_PROTECT };
+
+// Map 'npages' pages at 'va', either to a contiguous run starting at 'pa' or
+// to the frames in 'pa_list'. Each page-table level is resolved once per
+// 512-entry table and the leaves are filled in a tight loop. Only entries
+// that were already present need invalidating; they are queued on 'flush'.
+// On failure the pages mapped so far are removed again. Caller holds vmm_lock.
+static int map_range_locked(vmm_space_t *space, uint64_t va, uint64_t pa, const uint64_t *pa_list,
+                            size_t npages, uint64_t flags, vmm_flush_t *flush) {
+    uint64_t table_flags = VMM_P_PRESENT|VMM_P_WRITABLE|(flags & VMM_P_USER);
+    // Kernel-half leaves are global so invlpg reaches them under any PCID.
+    if (va >= VMM_KERNEL_BASE) flags |= VMM_P_GLOBAL;
+    flags |= VMM_P_PRESENT;
+
+    size_t done = 0;
+    while (done < npages) {
+        uint64_t cur = va + (uint64_t)done * 0x1000ULL;
+        volatile uint64_t *pdpt = ensure_pdpt(space, cur, table_flags);
+        volatile uint64_t *pd = pdpt ? ensure_table(pdpt, (cur >> 30) & 0x1FF, table_flags) : 0;
+        volatile uint64_t *pt = pd ? ensure_table(pd, (cur >> 21) & 0x1FF, table_flags) : 0;
+        if (!pt) {
+            if (done) {
+                volatile uint64_t *root = va >= VMM_KERNEL_BASE ? pml4 : space->pml4;
+                (void)update_range(root, va, done, RANGE_UNMAP, 0, 0, flush);
+            }
+            return -1;
+        }
+        size_t pt_i = (cur >> 12) & 0x1FF;
+        size_t n = 512 - pt_i;
+        if (n > npages - done) n = npages - done;
+        for (size_t k = 0; k < n; k++) {
+            uint64_t frame = pa_list ? pa_list[done + k] : pa + (uint64_t)(done + k) * 0x1000ULL;
+            uint64_t old = pt[pt_i + k];
+            pt[pt_i + k] = (frame & PTE_ADDR_MASK) | flags;
+            if (old & VMM_P_PRESENT) vmm_flush_add(flush, cur + (uint64_t)k * 0x1000ULL);
+        }
+        done += n;
+    }
     return 0;
 }
+
+static int map_common(vmm_space_t *space, uint64_t va, uint64_t pa, const uint64_t *pa_list,
+                      size_t npages, uint64_t flags) {
+    if (!pml4) vmm_init();
+    if (npages == 0) return 0;
+    vmm_flush_t flush;
+    vmm_flush_init(&flush);
+    if (va < VMM_KERNEL_BASE) flush.space = space;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmm_lock);
+    int rc = map_range_locked(space, va & ~0xFFFULL, pa, pa_list, npages, flags, &flush);
+    spin_unlock(&vmm_lock);
+    cpu_irq_restore(irq);
+
+    // Nothing to do for fresh mappings: non-present entries are never cached.
+    vmm_flush_commit(&flush);
+    return rc;
+}
+
+int vmm_map_page(uint64_t va, uint64_t pa, uint64_t flags) {
+    return map_common(vmm_space_current(), va, pa, NULL, 1, flags);
+}
+
+int vmm_map_range(uint64_t va, uint64_t pa_start, size_t npages, uint64_t flags) {
+    return map_common(vmm_space_current(), va, pa_start, NULL, npages, flags);
+}
+
+int vmm_map_pages(uint64_t va, const uint64_t *pa_list, size_t npages, uint64_t flags) {
+    return map_common(vmm_space_current(), va, 0, pa_list, npages, flags);
+}
+
+bool vmm_translate(uint64_t va, uint64_t *pa_out) {
+    if (!pml4) vmm_init();
+    volatile uint64_t *root = va >= VMM_KERNEL_BASE ? pml4 : vmm_space_current()->pml4;
+    volatile uint64_t *pdpt = next_table(root[(va >> 39) & 0x1FF]);
+    if (!pdpt) return false;
+    uint64_t e = pdpt[(va >> 30) & 0x1FF];
+    if ((e & VMM_P_PRESENT) && (e & VMM_P_HUGE)) {
+        if (pa_out) *pa_out = (e & PTE_ADDR_MASK & ~0x3FFFFFFFULL) | (va & 0x3FFFFFFFULL);
+        return true;
+    }
+    volatile uint64_t *pd = next_table(e);
+    if (!pd) return false;
+    e = pd[(va >> 21) & 0x1FF];
+    if ((e & VMM_P_PRESENT) && (e & VMM_P_HUGE)) {
+        if (pa_out) *pa_out = (e & PTE_ADDR_MASK & ~0x1FFFFFULL) | (va & 0x1FFFFFULL);
+        return true;
+    }
+    volatile uint64_t *pt = next_table(e);
+    if (!pt) return false;
+    e = pt[(va >> 12) & 0x1FF];
+    if (!(e & VMM_P_PRESENT)) return false;
+    if (pa_out) *pa_out = (e & PTE_ADDR_MASK) | (va & 0xFFFULL);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Flush batching and cross-CPU shootdown
+
+void vmm_flush_init(vmm_flush_t *flush) {
+    flush->count = 0;
+    flush->full = false;
+    flush->free_pages = NULL;
+    flush->space = NULL;
+}
+
+void vmm_flush_add(vmm_flush_t *flush, uint64_t va) {
+    if (flush->full) return;
+    if (flush->count == VMM_FLUSH_BATCH) { flush->full = true; return; }
+    flush->va[flush->count++] = va & ~0xFFFULL;
+}
+
+void vmm_flush_all(vmm_flush_t *flush) {
+    flush->full = true;
+}
+
+// Drop every TLB entry, global ones and all PCIDs included.
+static void flush_everything(void) {
+    uint64_t cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    }
+}
+
+static void flush_local(const vmm_flush_t *flush) {
+    uint32_t me = cpu_local_index();
+    if (flush->space) {
+        // Lower-half entries are tagged with the space's PCID; they can only
+        // be dropped here while it is loaded. Elsewhere tlb_gen catches up
+        // on the next switch.
+        if (me >= SMP_MAX_CPUS || cpu_space[me] != flush->space) return;
+        flush->space->cpu_seen_gen[me] = atomic_load_explicit(&flush->space->tlb_gen, memory_order_acquire);
+        if (flush->full) {
+            write_cr3(read_cr3() & ~CR3_NOFLUSH); // flushes the current PCID only
+            return;
+        }
+    } else if (flush->full) {
+        // Kernel-half leaves are global, which a CR3 reload would keep.
+        flush_everything();
+        return;
+    }
+    for (size_t i = 0; i < flush->count; i++) invlpg(flush->va[i]);
+}
+
+// Service a shootdown addressed to this CPU, if any. Called from the IPI
+// handler and from spin loops that may run with interrupts disabled.
+static void shootdown_service(void) {
+    uint32_t me = cpu_local_index();
+    if (me >= SMP_MAX_CPUS) return;
+    if (!atomic_exchange_explicit(&shootdown_req[me], 0, memory_order_acquire)) return;
+    flush_local(shootdown_batch);
+    atomic_fetch_sub_explicit(&shootdown_pending, 1, memory_order_release);
+}
+
+static void tlb_shootdown_isr(isr_frame_t *f) {
+    (void)f;
+    shootdown_service();
+    lapic_eoi();
+}
+
+static void shootdown_others(const vmm_flush_t *flush) {
+    uint32_t me = cpu_local_index();
+    while (!spin_trylock(&shootdown_lock)) {
+        // Another CPU is shooting down; it may be waiting on us.
+        shootdown_service();
+        cpu_relax();
+    }
+    shootdown_batch = flush;
+    atomic_store_explicit(&shootdown_pending, 0, memory_order_relaxed);
+    // Kernel-half entries may be cached anywhere; lower-half ones only on
+    // CPUs running the space right now (the rest flush when switching in).
+    _Atomic uint64_t *targets = flush->space ? flush->space->active : vmm_active_cpus;
+    for (uint32_t w = 0; w < SMP_MAX_CPUS / 64; w++) {
+        uint64_t mask = atomic_load_explicit(&targets[w], memory_order_seq_cst);
+        while (mask) {
+            uint32_t bit = (uint32_t)__builtin_ctzll(mask);
+            mask &= mask - 1;
+            uint32_t cpu = w * 64 + bit;
+            if (cpu == me) continue;
+            uint32_t apic = smp_cpu_lapic_id(cpu);
+            if (apic == UINT32_MAX) continue;
+            atomic_fetch_add_explicit(&shootdown_pending, 1, memory_order_relaxed);
+            atomic_store_explicit(&shootdown_req[cpu], 1, memory_order_release);
+            if (!lapic_send_ipi(apic, LAPIC_TLB_VECTOR)) {
+                // No LAPIC yet: nobody else can be running kernel code.
+                atomic_store_explicit(&shootdown_req[cpu], 0, memory_order_relaxed);
+                atomic_fetch_sub_explicit(&shootdown_pending, 1, memory_order_relaxed);
+            }
+        }
+    }
+    while (atomic_load_explicit(&shootdown_pending, memory_order_acquire) != 0) cpu_relax();
+    spin_unlock(&shootdown_lock);
+}
+
+void vmm_flush_commit(vmm_flush_t *flush) {
+    if (!flush->full && flush->count == 0 && !flush->free_pages) return;
+    if (flush->full || flush->count) {
+        // Publish the invalidation before looking at who runs the space, so a
+        // concurrent vmm_space_switch() either sees the new generation or is
+        // visible in 'active' and gets an IPI.
+        if (flush->space) atomic_fetch_add_explicit(&flush->space->tlb_gen, 1, memory_order_seq_cst);
+        flush_local(flush);
+        shootdown_others(flush);
+    }
+    // Frames are only safe to reuse once no TLB can still reach them.
+    void *page = flush->free_pages;
+    while (page) {
+        void *next = *(void **)page;
+        palloc_free_page(page);
+        page = next;
+    }
+    vmm_flush_init(flush);
+}
+
+// ---------------------------------------------------------------------------
+// Unmap / protect
+
+static void retire_frame(vmm_flush_t *flush, uint64_t pa) {
+    void *page = phys_to_virt(pa & PTE_ADDR_MASK);
+    *(void **)page = flush->free_pages;
+    flush->free_pages = page;
+}
+
+// Walk [va, va + npages*4K) and edit present leaf entries. Non-present upper
+// levels are skipped a whole table at a time.
+static int update_range(volatile uint64_t *root, uint64_t va, size_t npages, int op,
+                        uint32_t opts, uint64_t prot, vmm_flush_t *flush) {
+    uint64_t end = va + (uint64_t)npages * 0x1000ULL;
+    int rc = 0;
+    while (va < end) {
+        volatile uint64_t *pdpt = next_table(root[(va >> 39) & 0x1FF]);
+        if (!pdpt) { va = (va + (1ULL << 39)) & ~((1ULL << 39) - 1); continue; }
+        uint64_t pdpte = pdpt[(va >> 30) & 0x1FF];
+        if (!(pdpte & VMM_P_PRESENT)) { va = (va + (1ULL << 30)) & ~((1ULL << 30) - 1); continue; }
+        if (pdpte & VMM_P_HUGE) { rc = -1; break; } // 1GiB pages are never split
+        volatile uint64_t *pd = next_table(pdpte);
+        size_t pd_i = (va >> 21) & 0x1FF;
+        uint64_t pde = pd[pd_i];
+        if (!(pde & VMM_P_PRESENT)) { va = (va + (1ULL << 21)) & ~((1ULL << 21) - 1); continue; }
+        if (pde & VMM_P_HUGE) {
+            // Whole 2MiB page inside the range: edit the PDE itself.
+            if ((va & 0x1FFFFFULL) || end - va < 0x200000ULL) { rc = -1; break; }
+            if (op == RANGE_UNMAP) {
+                pd[pd_i] = 0;
+                if (opts & VMM_UNMAP_FREE) {
+                    for (uint64_t off = 0; off < 0x200000ULL; off += 0x1000ULL)
+                        retire_frame(flush, (pde & PTE_ADDR_MASK & ~0x1FFFFFULL) + off);
+                }
+            } else {
+                pd[pd_i] = (pde & ~VMM_PROT_MASK) | (prot & VMM_PROT_MASK);
+            }
+            vmm_flush_all(flush);
+            va += 0x200000ULL;
+            continue;
+        }
+        volatile uint64_t *pt = next_table(pde);
+        // Tight loop over the leaf entries that live in this page table.
+        uint64_t table_end = (va + 0x200000ULL) & ~0x1FFFFFULL;
+        if (table_end > end) table_end = end;
+        for (; va < table_end; va += 0x1000ULL) {
+            size_t pt_i = (va >> 12) & 0x1FF;
+            uint64_t pte = pt[pt_i];
+            if (!(pte & VMM_P_PRESENT)) continue;
+            if (op == RANGE_UNMAP) {
+                pt[pt_i] = 0;
+                if (opts & VMM_UNMAP_FREE) retire_frame(flush, pte);
+            } else {
+                uint64_t npte = (pte & ~VMM_PROT_MASK) | (prot & VMM_PROT_MASK);
+                if (npte == pte) continue;
+                pt[pt_i] = npte;
+            }
+            vmm_flush_add(flush, va);
+        }
+    }
+    return rc;
+}
+
+static int edit_range(vmm_space_t *space, uint64_t va, size_t npages, int op, uint32_t opts,
+                      uint64_t prot, vmm_flush_t *flush) {
+    if (!pml4) vmm_init();
+    if (npages == 0) return 0;
+    vmm_flush_t local;
+    vmm_flush_t *batch = flush;
+    if (!batch) { vmm_flush_init(&local); batch = &local; }
+    bool lower = va < VMM_KERNEL_BASE;
+    if (lower) {
+        // A batch covers one kind of entry; kernel-half users pass NULL.
+        if (batch->space && batch->space != space) return -1;
+        batch->space = space;
+    }
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmm_lock);
+    int rc = update_range(lower ? space->pml4 : pml4, va & ~0xFFFULL, npages, op, opts, prot, batch);
+    spin_unlock(&vmm_lock);
+    cpu_irq_restore(irq);
+
+    // Commit outside vmm_lock so page faults on other CPUs cannot stall the shootdown.
+    if (!flush) vmm_flush_commit(&local);
+    return rc;
+}
+
+int vmm_unmap_range(uint64_t va, size_t npages, uint32_t opts, vmm_flush_t *flush) {
+    return edit_range(vmm_space_current(), va, npages, RANGE_UNMAP, opts, 0, flush);
+}
+
+int vmm_protect_range(uint64_t va, size_t npages, uint64_t flags, vmm_flush_t *flush) {
+    return edit_range(vmm_space_current(), va, npages, RANGE_PROTECT, 0, flags, flush);
+}
+
+// ---------------------------------------------------------------------------
+// 2MiB kernel mappings
+
+static int map_large_locked(uint64_t va, uint64_t pa, size_t count, uint64_t flags, vmm_flush_t *flush) {
+    // Bit 7 is PAT in a 4KiB leaf but PS in a PDE; PAT moves to bit 12.
+    uint64_t leaf = (flags & ~VMM_P_PAT) | VMM_P_PRESENT | VMM_P_HUGE | VMM_P_GLOBAL;
+    if (flags & VMM_P_PAT) leaf |= VMM_P_PAT_LARGE;
+    size_t done = 0;
+    for (; done < count; done++) {
+        uint64_t cur = va + (uint64_t)done * 0x200000ULL;
+        volatile uint64_t *pdpt = ensure_pdpt(&kernel_space, cur, VMM_P_PRESENT|VMM_P_WRITABLE);
+        volatile uint64_t *pd = pdpt ? ensure_table(pdpt, (cur >> 30) & 0x1FF, VMM_P_PRESENT|VMM_P_WRITABLE) : 0;
+        if (!pd) break;
+        size_t pd_i = (cur >> 21) & 0x1FF;
+        uint64_t old = pd[pd_i];
+        volatile uint64_t *pt = next_table(old);
+        if (pt) {
+            bool empty = true;
+            for (size_t k = 0; k < 512 && empty; k++) empty = !(pt[k] & VMM_P_PRESENT);
+            if (!empty) break;
+            // The table may still sit in paging-structure caches: free it
+            // only after the flush.
+            retire_frame(flush, old);
+        }
+        pd[pd_i] = ((pa + (uint64_t)done * 0x200000ULL) & PTE_ADDR_MASK) | leaf;
+        if (old & VMM_P_PRESENT) vmm_flush_add(flush, cur);
+    }
+    if (done == count) return 0;
+    if (done) (void)update_range(pml4, va, done * 512, RANGE_UNMAP, 0, 0, flush);
+    return -1;
+}
+
+int vmm_map_large(uint64_t va, uint64_t pa, size_t count, uint64_t flags) {
+    if (!pml4) vmm_init();
+    if (count == 0) return 0;
+    if (va < VMM_KERNEL_BASE || (va & 0x1FFFFFULL) || (pa & 0x1FFFFFULL)) return -1;
+    vmm_flush_t flush;
+    vmm_flush_init(&flush);
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmm_lock);
+    int rc = map_large_locked(va, pa, count, flags, &flush);
+    spin_unlock(&vmm_lock);
+    cpu_irq_restore(irq);
+
+    vmm_flush_commit(&flush);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Address spaces and PCIDs
+
+vmm_space_t *vmm_kernel_space(void) {
+    if (!pml4) vmm_init();
+    return &kernel_space;
+}
+
+vmm_space_t *vmm_space_current(void) {
+    uint32_t me = cpu_local_index();
+    if (me >= SMP_MAX_CPUS || !cpu_space[me]) return &kernel_space;
+    return cpu_space[me];
+}
+
+bool vmm_pcid_supported(void) { return pcid_supported; }
+
+bool vmm_pat_supported(void) { return pat_supported; }
+
+void vmm_pcid_set_enabled(bool use) { pcid_use = use && pcid_supported; }
+
+vmm_space_t *vmm_space_create(void) {
+    if (!pml4) vmm_init();
+    vmm_space_t *space = calloc(1, sizeof(*space));
+    if (!space) return NULL;
+    void *root = palloc_zero_allocate_page();
+    if (!root) { free(space); return NULL; }
+    space->pml4 = (volatile uint64_t *)root;
+    space->pml4_phys = (uint64_t)(uintptr_t)root - hhdm_request.response->offset;
+    space->pcid = 0;
+    space->pcid_gen = 0; // forces a PCID on first switch
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmm_lock);
+    for (size_t i = 256; i < 512; i++) space->pml4[i] = pml4[i];
+    space->next = space_list;
+    space_list = space;
+    spin_unlock(&vmm_lock);
+    cpu_irq_restore(irq);
+    return space;
+}
+
+static void free_tables(volatile uint64_t *table, int level) {
+    for (size_t i = 0; i < 512; i++) {
+        uint64_t e = table[i];
+        if (!(e & VMM_P_PRESENT) || (e & VMM_P_HUGE)) continue;
+        if (level > 1) free_tables((volatile uint64_t *)phys_to_virt(e & PTE_ADDR_MASK), level - 1);
+        palloc_free_page(phys_to_virt(e & PTE_ADDR_MASK));
+    }
+}
+
+void vmm_space_destroy(vmm_space_t *space) {
+    if (!space || space == &kernel_space) return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmm_lock);
+    for (vmm_space_t **it = &space_list; *it; it = &(*it)->next) {
+        if (*it == space) { *it = space->next; break; }
+    }
+    spin_unlock(&vmm_lock);
+    cpu_irq_restore(irq);
+    // Lower half only: PDPT -> PD -> PT, the PT level holds leaves.
+    for (size_t i = 0; i < 256; i++) {
+        uint64_t e = space->pml4[i];
+        if (!(e & VMM_P_PRESENT)) continue;
+        free_tables((volatile uint64_t *)phys_to_virt(e & PTE_ADDR_MASK), 2);
+        palloc_free_page(phys_to_virt(e & PTE_ADDR_MASK));
+    }
+    // Its PCID is not reused before the next generation rollover, which
+    // flushes every CPU, so stale tagged entries can never resurface.
+    palloc_free_page((void *)space->pml4);
+    free(space);
+}
+
+// Give 'space' a PCID of the current generation. On exhaustion start a new
+// generation; every CPU flushes all tags before using one of its PCIDs.
+static void pcid_assign(vmm_space_t *space) {
+    spin_lock(&pcid_lock);
+    uint64_t gen = atomic_load_explicit(&pcid_generation, memory_order_relaxed);
+    if (space->pcid_gen != gen) {
+        if (pcid_next > PCID_MAX) {
+            gen++;
+            atomic_store_explicit(&pcid_generation, gen, memory_order_release);
+            pcid_next = 1;
+        }
+        space->pcid = pcid_next++;
+        space->pcid_gen = gen;
+    }
+    spin_unlock(&pcid_lock);
+}
+
+void vmm_space_switch(vmm_space_t *space) {
+    if (!pml4) vmm_init();
+    if (!space) space = &kernel_space;
+    uint64_t irq = cpu_irq_save();
+    uint32_t me = cpu_local_index();
+    if (me >= SMP_MAX_CPUS) me = 0;
+    vmm_space_t *prev = cpu_space[me] ? cpu_space[me] : &kernel_space;
+    if (prev == space) { cpu_irq_restore(irq); return; }
+
+    atomic_fetch_and_explicit(&prev->active[me / 64], ~(1ULL << (me % 64)), memory_order_relaxed);
+    atomic_fetch_or_explicit(&space->active[me / 64], 1ULL << (me % 64), memory_order_seq_cst);
+    cpu_space[me] = space;
+
+    uint64_t cr3 = space->pml4_phys;
+    if (pcid_supported && space != &kernel_space) {
+        uint64_t gen = atomic_load_explicit(&pcid_generation, memory_order_acquire);
+        if (space->pcid_gen != gen) {
+            pcid_assign(space);
+            gen = space->pcid_gen;
+        }
+        if (cpu_pcid_gen[me] != gen) {
+            // New generation: tags from the old one may be handed out again.
+            flush_everything();
+            cpu_pcid_gen[me] = gen;
+        }
+        uint64_t tlb_gen = atomic_load_explicit(&space->tlb_gen, memory_order_seq_cst);
+        bool keep = pcid_use && space->cpu_seen_gen[me] == tlb_gen;
+        space->cpu_seen_gen[me] = tlb_gen;
+        cr3 |= space->pcid;
+        if (keep) cr3 |= CR3_NOFLUSH;
+    } else if (pcid_supported && pcid_use) {
+        // Kernel space (PCID 0) holds only kernel-half entries, all of which
+        // are kept coherent by shootdowns.
+        cr3 |= CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
+    cpu_irq_restore(irq);
+}
+
+int vmm_space_map_page(vmm_space_t *space, uint64_t va, uint64_t pa, uint64_t flags) {
+    if (!space) space = vmm_kernel_space();
+    return map_common(space, va, pa, NULL, 1, flags);
+}
+
+int vmm_space_unmap_range(vmm_space_t *space, uint64_t va, size_t npages, uint32_t opts) {
+    if (!space) space = &kernel_space;
+    return edit_range(space, va, npages, RANGE_UNMAP, opts, 0, NULL);
+}
@@ -0,0 +1,472 @@
+// Virtual address range allocator: augmented red-black trees over a fixed
+// window, with lazy batched unmapping of released ranges. See vrange.h.
+
+#include <vrange.h>
+#include <vmm.h>
+#include <palloc.h>
+#include <cpu_local.h>
+#include <lprintf.h>
+
+#define PAGE_SIZE 0x1000ULL
+
+static inline uint64_t align_up(uint64_t x, uint64_t a) { return (x + (a-1)) & ~(a-1); }
+
+// ---------------------------------------------------------------------------
+// Node pool. Nodes are carved out of palloc pages (HHDM addresses) so the
+// allocator never recurses into the heaps it backs. Caller holds r->lock.
+
+static vrange_node_t *node_get(vrange_t *r) {
+    if (!r->spare) {
+        vrange_node_t *page = (vrange_node_t *)palloc_allocate_page();
+        if (!page) return NULL;
+        size_t n = PAGE_SIZE / sizeof(vrange_node_t);
+        for (size_t i = 0; i < n; i++) {
+            page[i].next = r->spare;
+            r->spare = &page[i];
+        }
+    }
+    vrange_node_t *node = r->spare;
+    r->spare = node->next;
+    node->next = NULL;
+    return node;
+}
+
+static void node_put(vrange_t *r, vrange_node_t *node) {
+    node->next = r->spare;
+    r->spare = node;
+}
+
+// ---------------------------------------------------------------------------
+// Red-black tree keyed by 'start' and augmented with 'max_free', the largest
+// range size in each subtree. Every tree has its own sentinel so the CLRS
+// delete can park a parent pointer on it.
+
+static void tree_init(vrange_tree_t *t) {
+    t->nil.parent = t->nil.left = t->nil.right = &t->nil;
+    t->nil.size = t->nil.max_free = 0;
+    t->nil.red = 0;
+    t->root = &t->nil;
+}
+
+static inline void update(vrange_tree_t *t, vrange_node_t *x) {
+    uint64_t m = x->size;
+    if (x->left != &t->nil && x->left->max_free > m) m = x->left->max_free;
+    if (x->right != &t->nil && x->right->max_free > m) m = x->right->max_free;
+    x->max_free = m;
+}
+
+// Recompute the augmentation from 'x' up to the root.
+static void propagate(vrange_tree_t *t, vrange_node_t *x) {
+    while (x != &t->nil) {
+        update(t, x);
+        x = x->parent;
+    }
+}
+
+static void rotate_left(vrange_tree_t *t, vrange_node_t *x) {
+    vrange_node_t *y = x->right;
+    x->right = y->left;
+    if (y->left != &t->nil) y->left->parent = x;
+    y->parent = x->parent;
+    if (x->parent == &t->nil) t->root = y;
+    else if (x == x->parent->left) x->parent->left = y;
+    else x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+    update(t, x);
+    update(t, y);
+}
+
+static void rotate_right(vrange_tree_t *t, vrange_node_t *x) {
+    vrange_node_t *y = x->left;
+    x->left = y->right;
+    if (y->right != &t->nil) y->right->parent = x;
+    y->parent = x->parent;
+    if (x->parent == &t->nil) t->root = y;
+    else if (x == x->parent->right) x->parent->right = y;
+    else x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+    update(t, x);
+    update(t, y);
+}
+
+static void tree_insert(vrange_tree_t *t, vrange_node_t *z) {
+    vrange_node_t *y = &t->nil;
+    vrange_node_t *x = t->root;
+    while (x != &t->nil) {
+        y = x;
+        x = z->start < x->start ? x->left : x->right;
+    }
+    z->parent = y;
+    if (y == &t->nil) t->root = z;
+    else if (z->start < y->start) y->left = z;
+    else y->right = z;
+    z->left = z->right = &t->nil;
+    z->red = 1;
+    z->max_free = z->size;
+    propagate(t, y);
+
+    while (z->parent->red) {
+        vrange_node_t *gp = z->parent->parent;
+        if (z->parent == gp->left) {
+            vrange_node_t *u = gp->right;
+            if (u->red) {
+                z->parent->red = 0; u->red = 0; gp->red = 1;
+                z = gp;
+            } else {
+                if (z == z->parent->right) { z = z->parent; rotate_left(t, z); }
+                z->parent->red = 0; z->parent->parent->red = 1;
+                rotate_right(t, z->parent->parent);
+            }
+        } else {
+            vrange_node_t *u = gp->left;
+            if (u->red) {
+                z->parent->red = 0; u->red = 0; gp->red = 1;
+                z = gp;
+            } else {
+                if (z == z->parent->left) { z = z->parent; rotate_right(t, z); }
+                z->parent->red = 0; z->parent->parent->red = 1;
+                rotate_left(t, z->parent->parent);
+            }
+        }
+    }
+    t->root->red = 0;
+}
+
+static void transplant(vrange_tree_t *t, vrange_node_t *u, vrange_node_t *v) {
+    if (u->parent == &t->nil) t->root = v;
+    else if (u == u->parent->left) u->parent->left = v;
+    else u->parent->right = v;
+    v->parent = u->parent;
+}
+
+static void tree_delete(vrange_tree_t *t, vrange_node_t *z) {
+    vrange_node_t *y = z, *x;
+    uint8_t y_red = y->red;
+    if (z->left == &t->nil) {
+        x = z->right;
+        transplant(t, z, z->right);
+    } else if (z->right == &t->nil) {
+        x = z->left;
+        transplant(t, z, z->left);
+    } else {
+        y = z->right;
+        while (y->left != &t->nil) y = y->left;
+        y_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            x->parent = y;
+        } else {
+            transplant(t, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        transplant(t, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    // Every subtree that lost a node lies on the path above x.
+    propagate(t, x->parent);
+
+    if (y_red) return;
+    while (x != t->root && !x->red) {
+        if (x == x->parent->left) {
+            vrange_node_t *w = x->parent->right;
+            if (w->red) {
+                w->red = 0; x->parent->red = 1;
+                rotate_left(t, x->parent);
+                w = x->parent->right;
+            }
+            if (!w->left->red && !w->right->red) {
+                w->red = 1;
+                x = x->parent;
+            } else {
+                if (!w->right->red) {
+                    w->left->red = 0; w->red = 1;
+                    rotate_right(t, w);
+                    w = x->parent->right;
+                }
+                w->red = x->parent->red;
+                x->parent->red = 0;
+                w->right->red = 0;
+                rotate_left(t, x->parent);
+                x = t->root;
+            }
+        } else {
+            vrange_node_t *w = x->parent->left;
+            if (w->red) {
+                w->red = 0; x->parent->red = 1;
+                rotate_right(t, x->parent);
+                w = x->parent->left;
+            }
+            if (!w->right->red && !w->left->red) {
+                w->red = 1;
+                x = x->parent;
+            } else {
+                if (!w->left->red) {
+                    w->right->red = 0; w->red = 1;
+                    rotate_left(t, w);
+                    w = x->parent->left;
+                }
+                w->red = x->parent->red;
+                x->parent->red = 0;
+                w->left->red = 0;
+                rotate_right(t, x->parent);
+                x = t->root;
+            }
+        }
+    }
+    x->red = 0;
+}
+
+// Greatest node with start <= va, or NULL.
+static vrange_node_t *tree_floor(vrange_tree_t *t, uint64_t va) {
+    vrange_node_t *x = t->root, *best = NULL;
+    while (x != &t->nil) {
+        if (x->start <= va) { best = x; x = x->right; }
+        else x = x->left;
+    }
+    return best;
+}
+
+// Smallest node with start > va, or NULL.
+static vrange_node_t *tree_above(vrange_tree_t *t, uint64_t va) {
+    vrange_node_t *x = t->root, *best = NULL;
+    while (x != &t->nil) {
+        if (x->start > va) { best = x; x = x->left; }
+        else x = x->right;
+    }
+    return best;
+}
+
+// Lowest-address free range of at least 'need' bytes, or NULL.
+static vrange_node_t *tree_first_fit(vrange_tree_t *t, uint64_t need) {
+    vrange_node_t *x = t->root;
+    if (x == &t->nil || x->max_free < need) return NULL;
+    for (;;) {
+        if (x->left != &t->nil && x->left->max_free >= need) x = x->left;
+        else if (x->size >= need) return x;
+        else x = x->right;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Free-space bookkeeping. Caller holds r->lock.
+
+// Return [start, start + len) to the free tree, merging with its neighbours.
+static void free_insert(vrange_t *r, uint64_t start, uint64_t len, vrange_node_t *spare) {
+    vrange_node_t *pred = tree_floor(&r->free, start);
+    vrange_node_t *succ = tree_above(&r->free, start);
+    bool merge_pred = pred && pred->start + pred->size == start;
+    bool merge_succ = succ && start + len == succ->start;
+
+    if (merge_pred && merge_succ) {
+        pred->size += len + succ->size;
+        tree_delete(&r->free, succ);
+        node_put(r, succ);
+        propagate(&r->free, pred);
+    } else if (merge_pred) {
+        pred->size += len;
+        propagate(&r->free, pred);
+    } else if (merge_succ) {
+        succ->start = start;
+        succ->size += len;
+        propagate(&r->free, succ);
+    } else {
+        vrange_node_t *n = spare ? spare : node_get(r);
+        if (!n) {
+            error_printf("vrange(%s): out of nodes, leaking %llu bytes of VA\n",
+                         r->name, (unsigned long long)len);
+            return;
+        }
+        spare = NULL;
+        n->start = start;
+        n->size = len;
+        tree_insert(&r->free, n);
+    }
+    if (spare) node_put(r, spare);
+    r->stats.free_bytes += len;
+}
+
+// Carve [va, va + len) out of free node 'n', which must contain it.
+static bool free_carve(vrange_t *r, vrange_node_t *n, uint64_t va, uint64_t len) {
+    uint64_t front = va - n->start;
+    uint64_t back = (n->start + n->size) - (va + len);
+    if (front && back) {
+        vrange_node_t *tail = node_get(r);
+        if (!tail) return false;
+        tail->start = va + len;
+        tail->size = back;
+        n->size = front;
+        propagate(&r->free, n);
+        tree_insert(&r->free, tail);
+    } else if (front) {
+        n->size = front;
+        propagate(&r->free, n);
+    } else if (back) {
+        n->start = va + len;
+        n->size = back;
+        propagate(&r->free, n);
+    } else {
+        tree_delete(&r->free, n);
+        node_put(r, n);
+    }
+    r->stats.free_bytes -= len;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+
+int vrange_init(vrange_t *r, const char *name, uint64_t base, uint64_t size, uint32_t guard_pages) {
+    spinlock_init(&r->lock);
+    r->name = name ? name : "vrange";
+    r->base = align_up(base, PAGE_SIZE);
+    r->size = size & ~(PAGE_SIZE - 1);
+    r->guard_pages = guard_pages;
+    tree_init(&r->free);
+    tree_init(&r->busy);
+    r->lazy = NULL;
+    r->lazy_pages = 0;
+    r->lazy_limit = VRANGE_LAZY_LIMIT;
+    r->spare = NULL;
+    r->stats = (vrange_stats_t){0};
+    if (!r->size) return -1;
+
+    vrange_node_t *n = node_get(r);
+    if (!n) return -1;
+    n->start = r->base;
+    n->size = r->size;
+    tree_insert(&r->free, n);
+    r->stats.free_bytes = r->size;
+    return 0;
+}
+
+static uint64_t alloc_locked(vrange_t *r, uint64_t bytes, uint64_t align) {
+    uint64_t span = bytes + (uint64_t)r->guard_pages * PAGE_SIZE;
+    uint64_t need = span + (align > PAGE_SIZE ? align - PAGE_SIZE : 0);
+    vrange_node_t *n = tree_first_fit(&r->free, need);
+    if (!n) return 0;
+
+    vrange_node_t *busy = node_get(r);
+    if (!busy) return 0;
+    uint64_t va = align_up(n->start, align);
+    if (!free_carve(r, n, va, span)) { node_put(r, busy); return 0; }
+
+    busy->start = va;
+    busy->size = bytes;
+    busy->unmap_opts = 0;
+    tree_insert(&r->busy, busy);
+    r->stats.allocs++;
+    r->stats.busy_bytes += bytes;
+    return va;
+}
+
+uint64_t vrange_alloc(vrange_t *r, size_t bytes, size_t align) {
+    if (!r->size || bytes == 0) return 0;
+    uint64_t len = align_up((uint64_t)bytes, PAGE_SIZE);
+    uint64_t al = align < PAGE_SIZE ? PAGE_SIZE : (uint64_t)align;
+    if (al & (al - 1)) return 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&r->lock);
+        uint64_t va = alloc_locked(r, len, al);
+        bool pending = r->lazy != NULL;
+        spin_unlock(&r->lock);
+        cpu_irq_restore(irq);
+        if (va) return va;
+        // Out of space: reclaim the lazy list once and retry.
+        if (!pending || vrange_purge(r) == 0) break;
+    }
+    return 0;
+}
+
+size_t vrange_release(vrange_t *r, uint64_t va, uint32_t unmap_opts) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&r->lock);
+    vrange_node_t *n = tree_floor(&r->busy, va);
+    if (!n || n->start != va) {
+        spin_unlock(&r->lock);
+        cpu_irq_restore(irq);
+        return 0;
+    }
+    tree_delete(&r->busy, n);
+    size_t bytes = (size_t)n->size;
+    n->unmap_opts = unmap_opts;
+    n->next = r->lazy;
+    r->lazy = n;
+    r->lazy_pages += n->size / PAGE_SIZE;
+    r->stats.frees++;
+    r->stats.busy_bytes -= n->size;
+    r->stats.lazy_bytes += n->size;
+    bool purge = r->lazy_pages >= r->lazy_limit;
+    spin_unlock(&r->lock);
+    cpu_irq_restore(irq);
+
+    if (purge) (void)vrange_purge(r);
+    return bytes;
+}
+
+bool vrange_lookup(vrange_t *r, uint64_t va, uint64_t *start, uint64_t *size) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&r->lock);
+    vrange_node_t *n = tree_floor(&r->busy, va);
+    bool hit = n && va < n->start + n->size;
+    if (hit) {
+        if (start) *start = n->start;
+        if (size) *size = n->size;
+    }
+    spin_unlock(&r->lock);
+    cpu_irq_restore(irq);
+    return hit;
+}
+
+size_t vrange_purge(vrange_t *r) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&r->lock);
+    vrange_node_t *list = r->lazy;
+    r->lazy = NULL;
+    r->lazy_pages = 0;
+    spin_unlock(&r->lock);
+    cpu_irq_restore(irq);
+    if (!list) return 0;
+
+    // The detached ranges belong to nobody, so they can be unmapped without
+    // the lock. All invalidations share one batch: one flush, one IPI round,
+    // and frames are only handed back to palloc after it.
+    vmm_flush_t flush;
+    vmm_flush_init(&flush);
+    size_t pages = 0;
+    for (vrange_node_t *n = list; n; n = n->next) {
+        (void)vmm_unmap_range(n->start, (size_t)(n->size / PAGE_SIZE), n->unmap_opts, &flush);
+        pages += (size_t)(n->size / PAGE_SIZE);
+    }
+    vmm_flush_commit(&flush);
+
+    irq = cpu_irq_save();
+    spin_lock(&r->lock);
+    while (list) {
+        vrange_node_t *n = list;
+        list = n->next;
+        uint64_t span = n->size + (uint64_t)r->guard_pages * PAGE_SIZE;
+        r->stats.lazy_bytes -= n->size;
+        free_insert(r, n->start, span, n);
+    }
+    r->stats.purges++;
+    spin_unlock(&r->lock);
+    cpu_irq_restore(irq);
+    return pages;
+}
+
+void vrange_get_stats(vrange_t *r, vrange_stats_t *out) {
+    if (!out) return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&r->lock);
+    *out = r->stats;
+    out->largest_free = r->free.root->max_free;
+    spin_unlock(&r->lock);
+    cpu_irq_restore(irq);
+}
@@ -2,14 +2,23 @@
 #include <flanterm.h>
 #include <ftfb.h>
 #include <spinlock.h>
+#include <ioremap.h>
+#include <boot.h>
+#include <lprintf.h>
 
 struct fb *global_fb;
 struct flanterm_context *ft_ctx;
 static spinlock_t ft_lock = {0};
+static struct fb display_fb;
+// CPU mapping of the framebuffer the console draws through: the bootloader's
+// HHDM address until displaystandard_map_wc() succeeds.
+static uintptr_t fb_base;
 
 void displaystandard_init(struct fb *fb)
 {
-    global_fb = fb;
+    display_fb = *fb;
+    global_fb = &display_fb;
+    fb_base = (uintptr_t)fb->lfb->address;
     ft_ctx = flanterm_fb_init(
         NULL,
         NULL,
@@ -27,6 +36,47 @@ void displaystandard_init(struct fb *fb)
     );
 }
 
+bool displaystandard_fb_region(uint64_t *phys, size_t *size)
+{
+    if (!global_fb || !fb_is_valid(global_fb)) return false;
+    *phys = (uint64_t)(uintptr_t)global_fb->lfb->address - hhdm_request.response->offset;
+    *size = (size_t)global_fb->lfb->pitch * global_fb->lfb->height;
+    return true;
+}
+
+void *displaystandard_set_mapping(void *base)
+{
+    void *old = (void *)fb_base;
+    if (!ft_ctx || !base) return old;
+    struct flanterm_fb_context *ctx = (struct flanterm_fb_context *)ft_ctx;
+    spin_lock(&ft_lock);
+    // flanterm may draw into a centred window of the framebuffer; keep the offset.
+    ctx->framebuffer = (volatile uint32_t *)((uintptr_t)ctx->framebuffer - fb_base + (uintptr_t)base);
+    fb_base = (uintptr_t)base;
+    spin_unlock(&ft_lock);
+    return old;
+}
+
+bool displaystandard_map_wc(void)
+{
+    uint64_t phys;
+    size_t size;
+    if (!displaystandard_fb_region(&phys, &size)) return false;
+    void *wc = ioremap_wc(phys, size);
+    if (!wc) return false;
+    displaystandard_set_mapping(wc);
+    return true;
+}
+
+void displaystandard_redraw(void)
+{
+    if (!ft_ctx) return;
+    spin_lock(&ft_lock);
+    ft_ctx->full_refresh(ft_ctx);
+    __asm__ volatile ("sfence" ::: "memory"); // drain write-combining buffers
+    spin_unlock(&ft_lock);
+}
+
 void displaystandard_putc(char c)
 {
     if (global_fb != NULL && ft_ctx != NULL) {
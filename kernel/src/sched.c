@@ -7,15 +7,22 @@
 #include <palloc.h>
 #include <vmm.h>
 #include <vheap.h>
+#include <slab.h>
+#include <shrinker.h>
 
 extern void context_switch(task_context_t *prev, task_context_t *next);
 
+// Pages the idle task zeroes per wakeup (see palloc_zero_refill()).
+#define IDLE_ZERO_BATCH 16
+
 static spinlock_t sched_lock;
 static task_t *current_task;
 static task_t *rq_head, *rq_tail;
 static task_t *sleep_head;
 static task_t bootstrap_task;
 static task_t *idle_task;
+static task_t *zombie_head; // exited tasks whose stacks are not yet released
+static kmem_cache_t *task_cache;
 static uint64_t next_tid = 1;
 static uint32_t timeslice_ticks = 10;
 static uint32_t tick_log_div = 100;
@@ -121,6 +128,10 @@ static bool sleep_remove(task_t *t) {
 static void idle_entry(void *arg) {
     (void)arg;
     for (;;) {
+        // Nothing else to do: act on any memory pressure palloc flagged,
+        // then zero a few pages ahead for the next zeroed allocations.
+        (void)shrinker_poll();
+        (void)palloc_zero_refill(IDLE_ZERO_BATCH);
         __asm__ __volatile__("hlt");
     }
 }
@@ -138,7 +149,20 @@ static void setup_stack(task_t *t, size_t stack_pages) {
     size_t guard_pages = 1; // lightweight guard with canary
     size_t total_pages = usable_pages + guard_pages;
     size_t bytes = total_pages * PAGE_SIZE;
-    uint64_t base = vheap_commit(bytes);
+    uint64_t base;
+    if (usable_pages > MIN_STACK_PAGES) {
+        // Large stacks are demand-paged: only the top MIN_STACK_PAGES and the
+        // canary page are backed up front, deeper pages fault in on use.
+        base = (uint64_t)(uintptr_t)vheap_reserve(bytes);
+        uint64_t hot = base + (total_pages - MIN_STACK_PAGES) * PAGE_SIZE;
+        if (base && (vheap_populate(base, PAGE_SIZE) != 0 ||
+                     vheap_populate(hot, MIN_STACK_PAGES * PAGE_SIZE) != 0)) {
+            vfree((void *)(uintptr_t)base);
+            base = 0;
+        }
+    } else {
+        base = vheap_commit(bytes);
+    }
     if (!base) {
         error_printf("sched: failed to allocate stack for task %s\n", t->name);
         t->stack_base = NULL;
@@ -167,8 +191,10 @@ static void setup_stack(task_t *t, size_t stack_pages) {
 }
 
 static task_t *task_alloc(const char *name, task_entry_t entry, void *arg, size_t stack_pages) {
-    task_t *t = calloc(1, sizeof(task_t));
+    if (!task_cache) task_cache = kmem_cache_create("task", sizeof(task_t), KMEM_ALIGN_CACHELINE, NULL);
+    task_t *t = kmem_cache_alloc(task_cache);
     if (!t) return NULL;
+    memset(t, 0, sizeof(*t));
     t->id = next_tid++;
     t->state = TASK_RUNNABLE;
     t->entry = entry;
@@ -179,7 +205,7 @@ static task_t *task_alloc(const char *name, task_entry_t entry, void *arg, size_
         strncpy(t->name, "task", TASK_NAME_MAX - 1);
     }
     setup_stack(t, stack_pages);
-    if (!t->stack_base) { free(t); return NULL; }
+    if (!t->stack_base) { kmem_cache_free(task_cache, t); return NULL; }
     return t;
 }
 
@@ -234,7 +260,25 @@ bool scheduler_is_started(void) {
 
 task_t *scheduler_current(void) { return current_task; }
 
+// Release the stacks and control blocks of exited tasks. Only tasks that have
+// already switched away are on the list, so their stacks are no longer live.
+static void reap_zombies(void) {
+    irq_disable();
+    spin_lock(&sched_lock);
+    task_t *t = zombie_head;
+    zombie_head = NULL;
+    spin_unlock(&sched_lock);
+    irq_enable();
+    while (t) {
+        task_t *next = t->next;
+        vfree((uint8_t *)t->stack_base - PAGE_SIZE); // includes the canary page
+        kmem_cache_free(task_cache, t);
+        t = next;
+    }
+}
+
 int task_create(const char *name, task_entry_t entry, void *arg, size_t stack_pages) {
+    reap_zombies();
     task_t *t = task_alloc(name, entry, arg, stack_pages);
     if (!t) return -1;
     irq_disable();
@@ -253,6 +297,10 @@ __attribute__((noreturn)) void task_exit(void) {
     if (prev->stack_base && !stack_canary_ok(prev)) stack_overflow(prev);
     prev->state = TASK_ZOMBIE;
     task_t *next = dequeue();
+    if (next && prev != &bootstrap_task && prev->stack_base) {
+        prev->next = zombie_head;
+        zombie_head = prev;
+    }
     if (!next) {
         spin_unlock(&sched_lock);
         error_printf("sched: no runnable tasks, halting\n");
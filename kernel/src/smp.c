@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <cpu_local.h>
 #include <stdbool.h>
+#include <vmm.h>
+#include <numa.h>
 
 extern volatile struct LIMINE_MP(request) mp_request;
 
@@ -22,6 +24,19 @@ extern volatile struct LIMINE_MP(request) mp_request;
 static _Atomic uint32_t g_cpu_online = 1; // BSP counts as online
 static _Atomic uint32_t g_cpu_halted = 0; // number of APs that acknowledged the panic IPI
 static uint32_t g_cpu_total = 1;
+static uint32_t g_cpu_lapic[SMP_MAX_CPUS];
+
+// smp_run_on_cpus(): the caller publishes fn/arg and the CPUs taking part,
+// bumps the generation and wakes them with LAPIC_CALL_VECTOR. Idle APs
+// check the generation with interrupts off before each hlt, so a wake-up
+// cannot slip in between the check and the halt.
+static _Atomic bool g_ap_idle[SMP_MAX_CPUS];
+static uint32_t g_call_on[SMP_MAX_CPUS]; // generation a CPU takes part in
+static void (*g_call_fn)(void *);
+static void *g_call_arg;
+static _Atomic uint32_t g_call_gen;
+static _Atomic uint32_t g_call_left;
+static _Atomic bool g_call_busy;
 
 struct ap_bootstrap {
     uint64_t stack_base;
@@ -29,8 +44,30 @@ struct ap_bootstrap {
     uint32_t cpu_index;
 };
 
-static void ap_idle(void) {
-    for (;;) { __asm__ __volatile__("hlt"); }
+static void ap_idle(uint32_t cpu_index) {
+    if (cpu_index >= SMP_MAX_CPUS) {
+        for (;;) { __asm__ __volatile__("hlt"); }
+    }
+    uint32_t seen = atomic_load_explicit(&g_call_gen, memory_order_acquire);
+    atomic_store_explicit(&g_ap_idle[cpu_index], true, memory_order_release);
+    for (;;) {
+        __asm__ __volatile__("cli");
+        uint32_t gen = atomic_load_explicit(&g_call_gen, memory_order_acquire);
+        if (gen == seen) {
+            __asm__ __volatile__("sti; hlt");
+            continue;
+        }
+        __asm__ __volatile__("sti");
+        seen = gen;
+        if (g_call_on[cpu_index] != gen) continue;
+        g_call_fn(g_call_arg);
+        atomic_fetch_sub_explicit(&g_call_left, 1, memory_order_release);
+    }
+}
+
+static void smp_call_ipi(isr_frame_t *f) {
+    (void)f;
+    lapic_eoi(); // the work is picked up by ap_idle() once hlt returns
 }
 
 static void enable_sse_on_this_cpu(void) {
@@ -56,8 +93,10 @@ static void smp_ap_entry(struct LIMINE_MP(info) *info) {
         __asm__ __volatile__("mov %0, %%rsp" :: "r"(stack_top));
     }
     cpu_local_t local = {
+        .self = NULL,
         .cpu_index = cpu_index,
         .lapic_id = info->lapic_id,
+        .numa_node = numa_node_of_apic(info->lapic_id),
         .tss_base = NULL,
         .current_task = NULL,
         .idle_task = NULL,
@@ -72,29 +111,37 @@ static void smp_ap_entry(struct LIMINE_MP(info) *info) {
 
     idt_enable_interrupts();
     lapic_enable();
-    info_printf("smp: AP lapic %u online (cpu_index=%u)\n", info->lapic_id, cpu_index);
+    // Only now can this CPU take part in TLB shootdowns.
+    vmm_cpu_online(cpu_index);
+    info_printf("smp: AP lapic %u online (cpu_index=%u, node %u)\n", info->lapic_id, cpu_index, local.numa_node);
     atomic_fetch_add_explicit(&g_cpu_online, 1, memory_order_relaxed);
-    ap_idle();
+    ap_idle(cpu_index);
 }
 
 void smp_init(uint64_t tsc_hz_hint) {
     (void)tsc_hz_hint;
     struct LIMINE_MP(response) *resp = mp_request.response;
-    if (!resp || resp->cpu_count <= 1) {
-        info_printf("smp: single CPU (no APs)\n");
-        g_cpu_total = 1;
-        return;
-    }
-    g_cpu_total = (uint32_t)resp->cpu_count;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) g_cpu_lapic[i] = UINT32_MAX;
+    // The BSP always gets its per-CPU block, even without APs, so that
+    // cpu_local_get() is usable on every configuration.
     static cpu_local_t bsp_local;
     bsp_local.cpu_index = 0;
-    bsp_local.lapic_id = resp->bsp_lapic_id;
+    bsp_local.lapic_id = resp ? resp->bsp_lapic_id : 0;
+    bsp_local.numa_node = numa_node_of_apic(bsp_local.lapic_id);
     bsp_local.tss_base = NULL;
     bsp_local.current_task = NULL;
     bsp_local.idle_task = NULL;
     bsp_local.tick_count = 0;
     bsp_local.online = true;
     cpu_local_set(&bsp_local);
+    g_cpu_lapic[0] = bsp_local.lapic_id;
+    if (!resp || resp->cpu_count <= 1) {
+        info_printf("smp: single CPU (no APs)\n");
+        g_cpu_total = 1;
+        return;
+    }
+    g_cpu_total = (uint32_t)resp->cpu_count;
+    isr_register(LAPIC_CALL_VECTOR, smp_call_ipi);
     info_printf("smp: cpus=%u bsp_lapic=%u flags=%#x\n",
                 g_cpu_total, resp->bsp_lapic_id, resp->flags);
     for (uint64_t i = 0; i < resp->cpu_count; ++i) {
@@ -115,6 +162,7 @@ void smp_init(uint64_t tsc_hz_hint) {
         boot->stack_base = usable_base + PAGE_SIZE; // avoid clobbering bootstrap struct
         boot->stack_size = (AP_STACK_PAGES * PAGE_SIZE) - PAGE_SIZE;
         boot->cpu_index = (uint32_t)i;
+        if (i < SMP_MAX_CPUS) g_cpu_lapic[i] = cpu->lapic_id;
         uint64_t top = boot->stack_base + boot->stack_size;
         top &= ~0xFULL;
         cpu->extra_argument = (uint64_t)(uintptr_t)boot;
@@ -131,12 +179,51 @@ uint32_t smp_cpu_count(void) {
     return g_cpu_total;
 }
 
+uint32_t smp_cpu_lapic_id(uint32_t cpu_index) {
+    if (cpu_index >= SMP_MAX_CPUS) return UINT32_MAX;
+    return g_cpu_lapic[cpu_index];
+}
+
 void smp_wait_all_aps(void) {
     while (atomic_load_explicit(&g_cpu_online, memory_order_relaxed) < g_cpu_total) {
         __asm__ __volatile__("pause");
     }
 }
 
+bool smp_run_on_cpus(uint32_t count, void (*fn)(void *), void *arg) {
+    if (count == 0 || count > SMP_MAX_CPUS) return false;
+    bool busy = false;
+    if (!atomic_compare_exchange_strong(&g_call_busy, &busy, true)) return false;
+    uint32_t me = cpu_local_index();
+    uint32_t gen = atomic_load_explicit(&g_call_gen, memory_order_relaxed) + 1;
+    uint32_t others = 0;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS && others < count - 1; i++) {
+        if (i == me || !atomic_load_explicit(&g_ap_idle[i], memory_order_acquire)) continue;
+        g_call_on[i] = gen;
+        others++;
+    }
+    if (others < count - 1) {
+        for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+            if (g_call_on[i] == gen) g_call_on[i] = 0;
+        }
+        atomic_store_explicit(&g_call_busy, false, memory_order_release);
+        return false;
+    }
+    g_call_fn = fn;
+    g_call_arg = arg;
+    atomic_store_explicit(&g_call_left, others, memory_order_relaxed);
+    atomic_store_explicit(&g_call_gen, gen, memory_order_release);
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (g_call_on[i] == gen) lapic_send_ipi(g_cpu_lapic[i], LAPIC_CALL_VECTOR);
+    }
+    fn(arg);
+    while (atomic_load_explicit(&g_call_left, memory_order_acquire)) {
+        __asm__ __volatile__("pause");
+    }
+    atomic_store_explicit(&g_call_busy, false, memory_order_release);
+    return true;
+}
+
 static void smp_panic_ipi(isr_frame_t* f) {
     (void)f;
     atomic_fetch_add_explicit(&g_cpu_halted, 1, memory_order_relaxed);